@@ -0,0 +1,469 @@
+/* catterm-bench -- throughput and latency benchmark for catterm
+ *
+ * Copyright (C) 2002 and up by Alexander Pevzner (pzz@pzz.msk.ru)
+ * See LICENSE for license terms and conditions
+ *
+ * catterm is started with two pseudo-terminals, one stands for the
+ * serial line, another for the console. Traffic is pushed through the
+ * real catterm data path, and the benchmark measures throughput,
+ * system calls per byte (from /proc/<pid>/io) and echo latency
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <termios.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define ESC_CHAR        0x18    /* catterm default exit char, ctrl-X */
+#define CHUNK           65536
+
+/***** Static variables -- options *****/
+static const char       *opt_catterm = "./catterm";
+static size_t           opt_size = 16 * 1024 * 1024;
+static int              opt_probes = 1000;
+static const char       *opt_pattern = NULL;
+static char             **opt_args = NULL;
+static int              opt_nargs = 0;
+
+/***** Error handling *****/
+/*
+ * panic with strerror(errno)
+ */
+#define panic_perror(msg...)                            \
+    do{                                                 \
+        int     err = errno;                            \
+        fprintf( stderr, msg );                         \
+        fprintf( stderr, ": %s\n", strerror( err ) );   \
+        exit( 1 );                                      \
+    }while(0)
+
+/*
+ * panic
+ */
+#define panic(msg...)                                   \
+    do{                                                 \
+        fprintf( stderr, msg );                         \
+        fprintf( stderr, "\n" );                        \
+        exit( 1 );                                      \
+    }while(0)
+
+/***** Time *****/
+/*
+ * Get current CLOCK_MONOTONIC time in nanoseconds
+ */
+static uint64_t
+now_ns (void)
+{
+    struct timespec     ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/***** catterm process *****/
+/*
+ * Running catterm instance
+ */
+typedef struct {
+    pid_t       pid;            /* catterm process */
+    int         tty;            /* Serial line side, pty master */
+    int         con;            /* Console side, pty master */
+} instance;
+
+/*
+ * Get read+write system calls count of the process
+ */
+static unsigned long long
+proc_syscalls (pid_t pid)
+{
+    char                path[64], line[128];
+    FILE                *fp;
+    unsigned long long  total = 0, v;
+
+    snprintf(path, sizeof(path), "/proc/%d/io", (int) pid);
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "syscr: %llu", &v) == 1 ||
+            sscanf(line, "syscw: %llu", &v) == 1) {
+            total += v;
+        }
+    }
+
+    fclose(fp);
+    return total;
+}
+
+/*
+ * Read whatever available from fd, with timeout in milliseconds.
+ * Returns count of bytes read, 0 on timeout
+ */
+static size_t
+read_some (int fd, unsigned char *buf, size_t size, int timeout)
+{
+    struct pollfd       pfd = {.fd = fd, .events = POLLIN};
+    ssize_t             rc;
+
+    if (poll(&pfd, 1, timeout) <= 0) {
+        return 0;
+    }
+
+    rc = read(fd, buf, size);
+    return rc > 0 ? (size_t) rc : 0;
+}
+
+/*
+ * Start catterm with the given extra arguments
+ */
+static void
+instance_start (instance *inst, char **args, int nargs)
+{
+    int             tty_slave, con_slave, i, argc = 0;
+    struct termios  mode;
+    char            **argv = calloc(nargs + opt_nargs + 3, sizeof(char*));
+    unsigned char   buf[256];
+    bool            synced = false;
+
+    if (openpty(&inst->tty, &tty_slave, NULL, NULL, NULL) == -1 ||
+        openpty(&inst->con, &con_slave, NULL, NULL, NULL) == -1) {
+        panic_perror("openpty()");
+    }
+
+    tcgetattr(con_slave, &mode);
+    cfmakeraw(&mode);
+    tcsetattr(con_slave, TCSANOW, &mode);
+
+    argv[argc ++] = (char*) opt_catterm;
+    for (i = 0; i < opt_nargs; i ++) {
+        argv[argc ++] = opt_args[i];
+    }
+    for (i = 0; i < nargs; i ++) {
+        argv[argc ++] = args[i];
+    }
+    argv[argc ++] = ttyname(tty_slave);
+
+    inst->pid = fork();
+    if (inst->pid == -1) {
+        panic_perror("fork()");
+    }
+
+    if (inst->pid == 0) {
+        int     null = open("/dev/null", O_WRONLY);
+
+        setsid();
+        dup2(con_slave, 0);
+        dup2(con_slave, 1);
+        dup2(null, 2);
+        execv(opt_catterm, argv);
+        _exit(127);
+    }
+
+    close(con_slave);
+    close(tty_slave);
+    free(argv);
+
+    /* Wait until catterm is ready to pass data */
+    for (i = 0; i < 100 && !synced; i ++) {
+        size_t  n;
+
+        write(inst->tty, "S", 1);
+        while ((n = read_some(inst->con, buf, sizeof(buf), 20)) != 0) {
+            synced = synced || memchr(buf, 'S', n) != NULL;
+        }
+    }
+
+    if (!synced) {
+        panic("%s doesn't respond", opt_catterm);
+    }
+
+    /* Drop echo of the sync bytes, made before line was configured */
+    while (read_some(inst->tty, buf, sizeof(buf), 20) != 0)
+        ;
+
+    fcntl(inst->tty, F_SETFL, O_NONBLOCK);
+    fcntl(inst->con, F_SETFL, O_NONBLOCK);
+}
+
+/*
+ * Stop catterm
+ */
+static void
+instance_stop (instance *inst)
+{
+    unsigned char   c = ESC_CHAR;
+
+    write(inst->con, &c, 1);
+    waitpid(inst->pid, NULL, 0);
+    close(inst->tty);
+    close(inst->con);
+}
+
+/***** Traffic patterns *****/
+/*
+ * Fill buffer with traffic of the given pattern
+ */
+static void
+pattern_fill (const char *pattern, unsigned char *buf, size_t size)
+{
+    size_t      i;
+
+    srand(1);
+    for (i = 0; i < size; i ++) {
+        if (!strcmp(pattern, "bulk")) {
+            buf[i] = 0x20 + rand() % 0x5f;
+        } else if (!strcmp(pattern, "ctrl")) {
+            buf[i] = rand() % 3 ? 0x20 + rand() % 0x5f : rand() % 0x20;
+        } else {
+            buf[i] = (i % 80) == 79 ? '\n' : 0x20 + rand() % 0x5f;
+        }
+    }
+}
+
+/*
+ * Pattern description
+ */
+typedef struct {
+    const char  *name;          /* Pattern name */
+    const char  *args[4];       /* catterm arguments */
+    bool        tx;             /* console->tty direction */
+} pattern;
+
+static const pattern
+patterns[] = {
+    {"bulk",    {NULL},                 false},
+    {"line",    {NULL},                 false},
+    {"ctrl",    {"-c", NULL},           false},
+    {"crlf",    {"-n", "crlf", NULL},   true},
+    {"lf",      {"-n", "lf", NULL},     true},
+    {NULL,      {NULL},                 false}
+};
+
+/***** Measurements *****/
+/*
+ * Run throughput test for the pattern
+ */
+static void
+run_throughput (const pattern *pat)
+{
+    instance            inst;
+    unsigned char       *data = malloc(opt_size), buf[CHUNK];
+    size_t              sent = 0, received = 0, expected = opt_size;
+    unsigned long long  sc_start, sc_end;
+    uint64_t            start, last;
+    int                 nargs = 0, out, in;
+
+    while (pat->args[nargs] != NULL) {
+        nargs ++;
+    }
+
+    pattern_fill(pat->name, data, opt_size);
+    if (!strcmp(pat->name, "crlf")) {
+        for (expected = 0; sent < opt_size; sent ++) {
+            expected += data[sent] == '\n' ? 2 : 1;
+        }
+        sent = 0;
+    }
+
+    instance_start(&inst, (char**) pat->args, nargs);
+    out = pat->tx ? inst.con : inst.tty;
+    in = pat->tx ? inst.tty : inst.con;
+
+    sc_start = proc_syscalls(inst.pid);
+    start = last = now_ns();
+
+    while (received < expected) {
+        struct pollfd   pfd[2] = {
+            {.fd = in, .events = POLLIN},
+            {.fd = out, .events = sent < opt_size ? POLLOUT : 0}
+        };
+        ssize_t         rc;
+
+        if (poll(pfd, 2, 2000) <= 0) {
+            break;
+        }
+
+        if (pfd[1].revents & POLLOUT) {
+            rc = write(out, data + sent, opt_size - sent);
+            if (rc > 0) {
+                sent += rc;
+            }
+        }
+
+        if (pfd[0].revents & POLLIN) {
+            rc = read(in, buf, sizeof(buf));
+            if (rc > 0) {
+                received += rc;
+                last = now_ns();
+            }
+        }
+    }
+
+    sc_end = proc_syscalls(inst.pid);
+    instance_stop(&inst);
+    free(data);
+
+    printf("%-8s %-14s %10.2f %12.4f%s\n", pat->name,
+        pat->tx ? "console->tty" : "tty->console",
+        received / ((last - start) / 1e9) / 1e6,
+        received ? (double) (sc_end - sc_start) / received : 0.0,
+        received == expected ? "" : " INCOMPLETE");
+}
+
+/*
+ * Compare two uint64_t, for qsort
+ */
+static int
+cmp_u64 (const void *p1, const void *p2)
+{
+    uint64_t    v1 = *(const uint64_t*) p1, v2 = *(const uint64_t*) p2;
+
+    return v1 < v2 ? -1 : (v1 > v2 ? 1 : 0);
+}
+
+/*
+ * Run echo latency test: byte goes console->tty, gets echoed
+ * back on the line side and returns tty->console
+ */
+static void
+run_latency (void)
+{
+    instance        inst;
+    uint64_t        *lat = calloc(opt_probes, sizeof(uint64_t));
+    unsigned char   c, buf[16];
+    int             i, n = 0;
+
+    instance_start(&inst, NULL, 0);
+
+    for (i = 0; i < opt_probes; i ++) {
+        uint64_t    start = now_ns();
+
+        c = 'a' + i % 26;
+        write(inst.con, &c, 1);
+
+        if (read_some(inst.tty, buf, sizeof(buf), 1000) != 1) {
+            continue;
+        }
+
+        write(inst.tty, buf, 1);
+        if (read_some(inst.con, buf, sizeof(buf), 1000) != 1) {
+            continue;
+        }
+
+        lat[n ++] = now_ns() - start;
+    }
+
+    instance_stop(&inst);
+
+    if (n == 0) {
+        panic("echo latency: no echoes received");
+    }
+
+    qsort(lat, n, sizeof(uint64_t), cmp_u64);
+    printf("echo latency (%d probes): p50 %.1f us, p99 %.1f us, "
+        "max %.1f us\n", n, lat[n / 2] / 1e3, lat[(n * 99) / 100] / 1e3,
+        lat[n - 1] / 1e3);
+
+    free(lat);
+}
+
+/***** Usage *****/
+/*
+ * Print usage and exit
+ */
+static void
+usage (void)
+{
+    printf(
+        "usage:\n"
+        "    catterm-bench [options] [-- catterm options]\n"
+        "\n"
+        "options:\n"
+        "    -b path    -- catterm binary (default is ./catterm)\n"
+        "    -S size    -- traffic size, in megabytes (default is 16)\n"
+        "    -p pattern -- run only this pattern:\n"
+        "                    bulk    - random printable bytes\n"
+        "                    line    - 80-character lines\n"
+        "                    ctrl    - control-heavy traffic with -c\n"
+        "                    crlf    - console->tty lines with -n crlf\n"
+        "                    lf      - console->tty lines as is (-n lf)\n"
+        "                    echo    - echo latency only\n"
+        "    -n count   -- count of echo latency probes (default is 1000)\n"
+        "    -h         -- print this help screen\n"
+    );
+
+    exit(0);
+}
+
+/***** The main function *****/
+/*
+ * Main function
+ */
+int
+main (int argc, char *argv[])
+{
+    int             opt;
+    const pattern   *pat;
+
+    while ((opt = getopt(argc, argv, "b:S:p:n:h")) != EOF) {
+        switch (opt) {
+            case 'b':
+                opt_catterm = optarg;
+                break;
+
+            case 'S':
+                opt_size = strtoul(optarg, NULL, 0) * 1024 * 1024;
+                break;
+
+            case 'p':
+                opt_pattern = optarg;
+                break;
+
+            case 'n':
+                opt_probes = atoi(optarg);
+                break;
+
+            default:
+                usage();
+        }
+    }
+
+    opt_args = argv + optind;
+    opt_nargs = argc - optind;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("%-8s %-14s %10s %12s\n", "pattern", "direction", "MB/s",
+        "syscalls/B");
+
+    for (pat = patterns; pat->name != NULL; pat ++) {
+        if (opt_pattern == NULL || !strcmp(opt_pattern, pat->name)) {
+            run_throughput(pat);
+        }
+    }
+
+    if (opt_probes > 0 &&
+        (opt_pattern == NULL || !strcmp(opt_pattern, "echo"))) {
+        run_latency();
+    }
+
+    return 0;
+}
+
+/* vim:ts=8:sw=4:et
+ */
@@ -4,6 +4,8 @@
  * See LICENSE for license terms and conditions
  */
 
+#define _GNU_SOURCE
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
@@ -13,23 +15,198 @@
 #include <termios.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <getopt.h>
+#include <limits.h>
+#include <dirent.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+
+#include <time.h>
+
+#ifdef  __linux__
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/inotify.h>
+#include <linux/serial.h>
+#endif
+
+#ifdef  HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+#ifdef  __APPLE__
+#include <IOKit/serial/ioss.h>
+#endif
+
+#ifdef  HAVE_ZSTD
+#define ZSTD_STATIC_LINKING_ONLY        /* ZSTD_createCCtx_advanced() */
+#include <zstd.h>
+#endif
+
+#ifdef  HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+#ifdef  HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#if     defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CTRLS_X86
+#elif   defined(__aarch64__)
+#include <arm_neon.h>
+#define CTRLS_NEON
+#endif
 
 #define DEFAULT_ESC_CHAR        "X"
+#define DEFAULT_SWITCH_CHAR     "T"
+#define DEFAULT_SEARCH_CHAR     "F"
+#define MAX_THREADS             8
+#define DEFAULT_RING_SIZE       65536
+#define MAX_RING_SIZE           (1UL << 30)
+#define DEFAULT_TEE_BUFFER      (1024 * 1024)
+#define AW_SPILL_CHUNK          65536
+#define SPLICE_CHUNK            65536
+#define RX_TIMES                256
+#define TS_CHUNK                4096
+#define TS_MAX_LEN              40
+#define CTC_BLOCK               65536
+#define CTC_BLOCK_NS            1000000000ULL
+#define CTC_INDEX_INITIAL       4096
+#define SEG_COMPRESS_BLOCK      (1024 * 1024)
+#define SEG_COMPRESS_OUT        (256 * 1024)
+#define SEG_FLUSH_NS            1000000000ULL
+#define SEND_CHUNK              65536
+#define TX_CHUNK                16384
+#define SEND_OUTQ_MAX           4096
+#define SEND_PROMPT_TIMEOUT     (5 * 1000000000ULL)
+#define DEFAULT_SEND_PROMPT     "=> "
+#define RECONNECT_RETRY_NS      (100 * 1000000ULL)
+#define SHUTDOWN_DRAIN_NS       1000000000ULL
+#define RENDER_CHUNK            16384
+#define CON_HOLD_SIZE           256
+#define TRIG_PENDING_MAX        16
+#define DEFAULT_BATCH_TIMEOUT   1000000000ULL
+#define BATCH_POLL_NS           (10 * 1000000ULL)
+#define STATS_PRINT_TIMEOUT     100
+#define STATS_PRINT_RETRIES     10
+
+/***** Backpressure policy of asynchronous writer *****/
+typedef enum {
+    AW_BLOCK,           /* Producer waits for space */
+    AW_DROP,            /* Excess data is dropped and counted */
+    AW_SPILL            /* Excess data is kept in memory */
+} aw_policy;
+
+/***** Tee file compression *****/
+typedef enum {
+    SEG_COMPRESS_NONE,  /* No compression */
+    SEG_COMPRESS_ZSTD,  /* zstd frames */
+    SEG_COMPRESS_LZ4,   /* lz4 frames */
+    SEG_COMPRESS_GZIP   /* gzip (zlib) stream */
+} seg_compress;
+
+/***** Bulk upload pacing *****/
+typedef enum {
+    SEND_PACE_OUTQ,     /* Full speed, limit driver queue */
+    SEND_PACE_LINE,     /* Wait for line drain and -D after each line */
+    SEND_PACE_PROMPT    /* Wait for prompt after each line */
+} send_pace;
+
+/***** Line timestamps *****/
+typedef enum {
+    TS_NONE,            /* No timestamps */
+    TS_MONO,            /* Seconds since start */
+    TS_WALL             /* Local wall-clock time */
+} ts_mode;
+
+/***** Flow control *****/
+typedef enum {
+    FLOW_NONE,          /* No flow control */
+    FLOW_RTSCTS,        /* Hardware, RTS/CTS */
+    FLOW_XONXOFF        /* Software, XON/XOFF */
+} flow_mode;
 
 /***** Static variables -- options *****/
 static unsigned long            opt_tty_speed = 115200;
 static char                     *opt_tty_line = NULL;
 static bool                     opt_supress_ctrls = false;
-static unsigned long            opt_send_delay = 0;
+static uint64_t                 opt_send_delay = 0;      /* ns */
 static bool                     opt_send_delay_relative = false;
+static uint64_t                 opt_line_delay = 0;      /* ns */
+static bool                     opt_line_delay_relative = false;
 static unsigned const char      *opt_nl_sequence = (unsigned char*) "\r";
 static size_t                   opt_nl_size = 1;
 static int                      opt_esc_char;
+static int                      opt_switch_char;
+static int                      opt_search_char;
+static size_t                   opt_scrollback = 0;
+static int                      opt_latency_probe = 0;
+static char                     **opt_ports = NULL;
+static int                      opt_nports = 0;
+static int                      opt_threads = 0;
+static char                     *opt_listen = NULL;
+static bool                     opt_listen_batch = false;
+static bool                     opt_rfc2217 = false;
+static bool                     opt_reconnect = false;
+static bool                     opt_tty_flush = true;
+static flow_mode                opt_flow = FLOW_NONE;
+static bool                     opt_rx_thread = false;
+static int                      opt_rx_cpu = -1;
+static int                      opt_rx_prio = 0;
+static bool                     opt_hugepages = false;
+static bool                     opt_batch = false;
+static uint64_t                 opt_batch_timeout =
+                                    DEFAULT_BATCH_TIMEOUT;      /* ns */
+static char                     **opt_triggers = NULL;
+static int                      opt_ntriggers = 0;
+static int                      opt_render_fps = 0;
+static bool                     opt_hex = false;
 static char                     *opt_tee_file = NULL;
+static size_t                   opt_ring_size = DEFAULT_RING_SIZE;
+static size_t                   opt_tee_buffer = DEFAULT_TEE_BUFFER;
+static aw_policy                opt_tee_policy = AW_BLOCK;
+static uint64_t                 opt_tee_max_size = 0;
+static uint64_t                 opt_tee_rotate_interval = 0;    /* ns */
+static seg_compress             opt_tee_compress = SEG_COMPRESS_NONE;
+static bool                     opt_splice = false;
+static bool                     opt_low_latency = false;
+static int                      opt_latency_timer = -1;
+static int                      opt_vmin = 1;
+static int                      opt_vtime = 0;
+static char                     *opt_stats_socket = NULL;
+static ts_mode                  opt_timestamp = TS_NONE;
+static char                     *opt_capture_file = NULL;
+static char                     *opt_replay_file = NULL;
+static uint64_t                 opt_replay_from = 0;            /* ns */
+static uint64_t                 opt_replay_to = UINT64_MAX;     /* ns */
+static bool                     opt_replay_records = false;
+static char                     *opt_send_file = NULL;
+static send_pace                opt_send_pace = SEND_PACE_OUTQ;
+static char                     *opt_send_prompt = DEFAULT_SEND_PROMPT;
+static bool                     opt_self_test = false;
 
 /***** Static variables -- miscellaneous *****/
 static struct termios           saved_console_mode;
+static int                      saved_console_flags = -1;
+static int                      saved_console_out_flags = -1;
+static volatile sig_atomic_t    console_saved = 0;
 static const char*              program_name = "catterm";
 
 /***** Bit rate table *****/
@@ -51,7 +228,7 @@ bit_rate_table[] = {
     {75, B75},
 #endif
 #ifdef  B110
-    {75, B110},
+    {110, B110},
 #endif
 #ifdef  B134
     {134, B134},
@@ -140,12 +317,17 @@ bit_rate_table[] = {
 /***** Error handling *****/
 /*
  * panic with strerror(errno)
+ *
+ * Diagnostics go to stderr, so they are never mixed with received
+ * data on stdout. exit() runs atexit handlers, so tee and capture
+ * are still flushed and console mode is restored
  */
 #define panic_perror(msg...)                            \
     do{                                                 \
         int     err = errno;                            \
-        printf( msg );                                  \
-        printf( ": %s\n", strerror( err ) );            \
+        fprintf( stderr, "%s: ", program_name );        \
+        fprintf( stderr, msg );                         \
+        fprintf( stderr, ": %s\n", strerror( err ) );   \
         exit( 1 );                                      \
     }while(0)
 
@@ -154,8 +336,9 @@ bit_rate_table[] = {
  */
 #define panic(msg...)                                   \
     do{                                                 \
-        printf( msg );                                  \
-        printf( "\n" );                                 \
+        fprintf( stderr, "%s: ", program_name );        \
+        fprintf( stderr, msg );                         \
+        fprintf( stderr, "\n" );                        \
         exit( 1 );                                      \
     }while(0)
 
@@ -169,6 +352,7 @@ usage (void)
     printf(
         "usage:\n"
         "    catterm [options] line\n"
+        "    catterm [options] -m line,line,...\n"
         "\n"
         "options:\n"
         "    -c       -- suppress control characters on output\n"
@@ -177,6 +361,7 @@ usage (void)
         "                    NNN[us] - microseconds\n"
         "                    NNNms   - milliseconds\n"
         "                    NNN%%    - percent of character transmit time\n"
+        "    -D delay -- delay after each line sent, same syntax as -d\n"
         "    -n arg   -- send new line as:\n"
         "                    lf      - '\\n'\n"
         "                    cr      - '\\r' (this is default)\n"
@@ -185,9 +370,183 @@ usage (void)
         "    -s speed -- line speed (default is %ld)\n"
         "    -x char  -- use ctrl-char as exit char (default is ctrl-%s)\n"
         "    -t file  -- save (\"tee\") output to file\n"
-        "    -h       -- print this help screen\n",
+        "    -B size  -- I/O buffer size, NNN[K|M] (default is %zuK)\n"
+        "    -T mode  -- prepend timestamp to each received line:\n"
+        "                    mono    - seconds since start\n"
+        "                    wall    - local date and time\n"
+        "                    none    - no timestamps (this is default)\n"
+        "    --hex    -- show received data as hex dump (tee file\n"
+        "                still gets raw data)\n"
+        "    -h       -- print this help screen\n"
+        "\n"
+        "line options:\n"
+        "    --flow mode         -- flow control:\n"
+        "                    none    - no flow control (this is default)\n"
+        "                    rtscts  - hardware (RTS/CTS)\n"
+        "                    xonxoff - software (XON/XOFF)\n"
+        "                           with flow control, --send fills the\n"
+        "                           driver queue, instead of limiting it\n"
+        "    --reconnect         -- when line disappears (i.e., USB serial\n"
+        "                           re-enumerates on board reset), wait\n"
+        "                           for it and reopen, instead of exit\n"
+        "    --no-flush          -- don't discard pending line data on open\n"
+        "                           (it is never discarded on reconnect)\n"
+        "\n"
+        "multi-port options:\n"
+        "    -m lines -- monitor several comma-separated lines; with -t\n"
+        "                and --capture, each line gets own file.line\n"
+        "    -e char  -- use ctrl-char as port switch char (default\n"
+        "                is ctrl-%s), followed by:\n"
+        "                    1..9, 0 - switch to port 1..10\n"
+        "                    a..z    - switch to port 11..36\n"
+        "                    n, p    - switch to next/previous port\n"
+        "                    l       - list ports\n"
+        "    --threads n         -- count of worker threads (default is\n"
+        "                           one per CPU, up to %d)\n"
+        "\n"
+        "tee options:\n"
+        "    --tee-buffer size   -- tee buffer size (default is %zuK)\n"
+        "    --tee-policy policy -- what to do when tee buffer is full:\n"
+        "                    block   - wait for the disk (this is default)\n"
+        "                    drop    - drop and count excess data\n"
+        "                    spill   - keep excess data in memory\n"
+        "    --tee-max-size size -- start new tee file segment, when\n"
+        "                           current reaches NNN[K|M|G] bytes\n"
+        "    --tee-rotate-interval time\n"
+        "                        -- start new tee file segment after\n"
+        "                           NNN[s|m|h|d] time\n"
+        "                           old segments are renamed to file.N\n"
+        "                           (.N.zst, .N.lz4 or .N.gz, if compressed);\n"
+        "                           with rotation, existing file is kept\n"
+        "    --tee-compress method\n"
+        "                        -- compress tee file: none, zstd, lz4 or\n"
+        "                           gzip, if supported by this build\n"
+        "    --capture file      -- save both directions with timing\n"
+        "                           into the binary capture file (.ctc)\n"
+        "\n"
+        "upload options:\n"
+        "    --send file         -- send file to the line, translating new\n"
+        "                           lines as with -n, then continue as usual\n"
+        "    --send-pace mode    -- upload pacing:\n"
+        "                    outq    - full speed, limit driver queue\n"
+        "                              (this is default)\n"
+        "                    line    - after each line wait until line\n"
+        "                              is transmitted, then wait for -D\n"
+        "                    prompt  - after each line wait for prompt\n"
+        "    --send-prompt str   -- prompt to wait for (default is \"%s\")\n"
+        "\n"
+        "trigger options:\n"
+        "    --on pattern=action -- when pattern is received, do action:\n"
+        "                    send:str    - send str to the line, as typed\n"
+        "                    mark[:str]  - write str (default is pattern)\n"
+        "                                  into the tee file\n"
+        "                    exit[:code] - exit with code (default is 0)\n"
+        "                           may be repeated; pattern and str\n"
+        "                           understand \\n, \\r, \\t, \\e, \\xHH,\n"
+        "                           \\\\ and \\=\n"
+        "\n"
+        "scrollback options:\n"
+        "    --scrollback size   -- keep last NNN[K|M|G] of console output\n"
+        "                           in memory, for search\n"
+        "    -r char             -- use ctrl-char as search char (default\n"
+        "                           is ctrl-%s), followed by:\n"
+        "                    text      - find the last line with text\n"
+        "                    search char - find the previous one\n"
+        "                    Enter     - show lines around it and\n"
+        "                                return to the output\n"
+        "                    ESC       - return to the output\n"
+        "\n"
+        "capture replay:\n"
+        "    catterm --replay file [--from sec] [--to sec] [--records]\n"
+        "    --replay file       -- write received data from capture file\n"
+        "                           to stdout (no terminal line is needed)\n"
+        "    --from sec          -- start from this time since capture start\n"
+        "    --to sec            -- stop at this time since capture start\n"
+        "    --records           -- dump records of both directions as text\n"
+        "    --hex               -- hex dump of both directions, rows are\n"
+        "                           marked with rx or tx\n"
+        "\n"
+        "performance options:\n"
+        "    --splice            -- use zero-copy tty->console/tee path\n"
+        "                           (Linux only, not used with -c, -T,\n"
+        "                           --hex, --capture, --on or --render-fps)\n"
+        "    --low-latency       -- set ASYNC_LOW_LATENCY serial driver flag,\n"
+        "                           and USB latency timer to 1ms, if any\n"
+        "    --latency-timer ms  -- set USB-serial latency timer (i.e., FTDI)\n"
+        "    --vmin count        -- wake up when count bytes received\n"
+        "                           (1..255, default is 1, more is for bulk\n"
+        "                           capture)\n"
+        "    --vtime dsec        -- with --vmin, pick up data below count\n"
+        "                           at most dsec 0.1 seconds later (default\n"
+        "                           is 0, wait for count bytes)\n"
+        "    --render-fps n      -- write to console at most n times per\n"
+        "                           second; if console can't keep up, skip\n"
+        "                           data and tell how much (tee, capture\n"
+        "                           and triggers still get everything)\n"
+        "    --rx-thread         -- read the line on a dedicated thread,\n"
+        "                           so console, tee and triggers never\n"
+        "                           delay it (not used with --splice)\n"
+        "    --rx-cpu n          -- pin RX thread to CPU n, implies\n"
+        "                           --rx-thread\n"
+        "    --rx-fifo prio      -- run RX thread as SCHED_FIFO with this\n"
+        "                           priority (1..99), lock memory with\n"
+        "                           mlockall(); implies --rx-thread\n"
+        "    --hugepages         -- back buffers with hugepages (reserved,\n"
+        "                           if any, or transparent), for large -B\n"
+        "\n"
+        "network bridge options:\n"
+        "    --listen [addr:]port\n"
+        "                        -- share the line with TCP clients; local\n"
+        "                           console, if any, is shared too\n"
+        "    --listen-batch      -- batch small writes to clients (Nagle),\n"
+        "                           for bulk use; default is TCP_NODELAY\n"
+        "    --rfc2217           -- speak telnet to clients, allow them to\n"
+        "                           set line speed (RFC 2217)\n"
+        "\n"
+        "batch options:\n"
+        "    --batch             -- non-interactive mode, the default when\n"
+        "                           stdin is not a terminal: console mode\n"
+        "                           is not touched, exit char is not\n"
+        "                           special; at stdin EOF, wait until all\n"
+        "                           input is transmitted, then exit after\n"
+        "                           --batch-timeout; with -m, stdin goes\n"
+        "                           to the first port, switch char is not\n"
+        "                           special either\n"
+        "    --batch-timeout time\n"
+        "                        -- NNN[ms|s|m], time to keep receiving\n"
+        "                           after transmit (default is 1s)\n"
+        "\n"
+        "latency probe:\n"
+        "    catterm --latency-probe count [options] line\n"
+        "    --latency-probe count\n"
+        "                        -- send count probe bytes one by one to\n"
+        "                           the line with a loopback plug or an\n"
+        "                           echoing target, and print round trip\n"
+        "                           latency histogram and percentiles;\n"
+        "                           probes go through the usual data\n"
+        "                           path and echoes are matched after the\n"
+        "                           line stages, so line, --rx-thread,\n"
+        "                           -T, --hex and --on options apply\n"
+        "\n"
+        "statistics options:\n"
+        "    --stats-socket path -- report statistics as JSON to clients,\n"
+        "                           connected to this Unix socket\n"
+        "    statistics is also printed to stderr on SIGUSR1 and at exit\n"
+        "\n"
+        "exit:\n"
+        "    on exit char, exit trigger, SIGTERM, SIGHUP or SIGINT, pending\n"
+        "    data is written to console and line (for up to 1 second), tee\n"
+        "    and capture are flushed and synced, then console is restored;\n"
+        "    a second signal exits at once. Exit code for a signal is\n"
+        "    128 + signal number\n",
         opt_tty_speed,
-        DEFAULT_ESC_CHAR
+        DEFAULT_ESC_CHAR,
+        (size_t) DEFAULT_RING_SIZE / 1024,
+        DEFAULT_SWITCH_CHAR,
+        MAX_THREADS,
+        (size_t) DEFAULT_TEE_BUFFER / 1024,
+        DEFAULT_SEND_PROMPT,
+        DEFAULT_SEARCH_CHAR
     );
 
     exit(0);
@@ -206,7 +565,7 @@ usage_error (const char* error, ...)
     vsnprintf(buf, sizeof(buf), error, ap);
     va_end( ap );
 
-    printf(
+    fprintf(stderr,
         "%s: %s\n"
         "try %s -h for more information\n",
         program_name, buf, program_name
@@ -216,13 +575,127 @@ usage_error (const char* error, ...)
 }
 
 /***** Memory allocation *****/
+/*
+ * Memory arena
+ *
+ * Once options are parsed, a single arena is mapped, sized from the
+ * options for everything the data path needs (see mem_plan()), and
+ * mem_alloc() carves memory from it. Arena is populated in advance,
+ * and with --hugepages it is backed by hugepages, if any reserved,
+ * or transparent hugepages otherwise
+ *
+ * Arena memory is never reused; mem_free() ignores it. When arena
+ * is exhausted, or not mapped (i.e., while parsing options), heap
+ * is used. After the data path is set up (mem_seal()) heap is
+ * still used, but such allocations are counted: it is only expected
+ * from --tee-policy spill, growth of the capture index and from
+ * zstd and zlib, which get mem_alloc() as allocator and allocate
+ * part of their state on the first compressed data. lz4 calls
+ * malloc() directly, so it is not counted; its expected size is
+ * planned as lib_heap instead (see mem_plan()) and reported in
+ * statistics. mem_realloc() always uses heap
+ */
+#define MEM_ALIGN               64
+#define MEM_HUGEPAGE            (2 * 1024 * 1024)
+#define MEM_PLAN_SLACK          (256 * 1024)
+
+static struct {
+    unsigned char   *base;              /* Arena memory, NULL if none */
+    size_t          size;               /* Arena size */
+    atomic_size_t   used;               /* Bytes allocated */
+    bool            huge;               /* Backed by MAP_HUGETLB */
+    bool            sealed;             /* Data path is set up */
+    atomic_ullong   overflows;          /* Didn't fit into the arena */
+    atomic_ullong   late;               /* Heap allocations after seal */
+    size_t          lib_heap;           /* Expected heap use by libraries,
+                                           outside of the above */
+} mem_arena;
+
+/*
+ * Map the arena
+ */
+static void
+mem_arena_init (size_t size, bool huge)
+{
+    int     flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    void    *p = MAP_FAILED;
+
+#ifdef  __linux__
+    flags |= MAP_POPULATE;
+
+    if (huge) {
+        size = (size + MEM_HUGEPAGE - 1) & ~(size_t) (MEM_HUGEPAGE - 1);
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB,
+            -1, 0);
+        if (p == MAP_FAILED) {
+            fprintf(stderr, "%s: hugepages: %s, using transparent hugepages\n",
+                program_name, strerror(errno));
+        }
+    }
+#endif
+
+    mem_arena.huge = p != MAP_FAILED;
+    if (p == MAP_FAILED) {
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (p == MAP_FAILED) {
+            panic_perror("can't map %zu bytes of memory", size);
+        }
+
+#ifdef  MADV_HUGEPAGE
+        if (huge) {
+            madvise(p, size, MADV_HUGEPAGE);
+        }
+#endif
+    }
+
+    mem_arena.base = p;
+    mem_arena.size = size;
+}
+
+/*
+ * Mark the end of startup: the data path is set up
+ */
+static void
+mem_seal (void)
+{
+    mem_arena.sealed = true;
+}
+
+/*
+ * Check if memory belongs to the arena
+ */
+static inline bool
+mem_in_arena (const void *p)
+{
+    const unsigned char *c = p;
+
+    return c >= mem_arena.base && c < mem_arena.base + mem_arena.size;
+}
+
 /*
  * Allocate some memory. Panic on OOM
  */
 static void*
 mem_alloc (size_t size)
 {
-    void *p = malloc(size);
+    void *p;
+
+    if (mem_arena.base != NULL && !mem_arena.sealed) {
+        size_t  sz = (size + MEM_ALIGN - 1) & ~(size_t) (MEM_ALIGN - 1);
+        size_t  off = atomic_fetch_add(&mem_arena.used, sz);
+
+        if (off + sz <= mem_arena.size) {
+            return mem_arena.base + off;
+        }
+
+        atomic_fetch_sub(&mem_arena.used, sz);
+        atomic_fetch_add_explicit(&mem_arena.overflows, 1,
+            memory_order_relaxed);
+    } else if (mem_arena.sealed) {
+        atomic_fetch_add_explicit(&mem_arena.late, 1, memory_order_relaxed);
+    }
+
+    p = malloc(size);
 
     if (p == NULL) {
         panic_perror("allocation failed");
@@ -232,6 +705,37 @@ mem_alloc (size_t size)
     return p;
 }
 
+/*
+ * Resize allocated memory. Panic on OOM. Memory must be
+ * allocated by mem_realloc()
+ */
+static void*
+mem_realloc (void *p, size_t size)
+{
+    if (mem_arena.sealed) {
+        atomic_fetch_add_explicit(&mem_arena.late, 1, memory_order_relaxed);
+    }
+
+    p = realloc(p, size);
+
+    if (p == NULL) {
+        panic_perror("allocation failed");
+    }
+
+    return p;
+}
+
+/*
+ * Free allocated memory
+ */
+static void
+mem_free (void *p)
+{
+    if (!mem_in_arena(p)) {
+        free(p);
+    }
+}
+
 /*
  * Safe version of strdup. Panics on OOM
  */
@@ -249,7 +753,9 @@ mem_strdup (const char *s)
 /*
  * Map bit rate to c_flags
  *
- * For unknown/invalid bit rate returns B0
+ * For unknown/invalid bit rate returns B0. Where custom bit rates
+ * are supported (see tty_set_custom_speed()), it is only used as
+ * a fallback
  */
 static tcflag_t
 bit_rate_to_c_flags (unsigned long rate)
@@ -266,6 +772,89 @@ bit_rate_to_c_flags (unsigned long rate)
     return B0;
 }
 
+/***** Custom bit rates *****/
+#if     defined(__linux__) && defined(TCGETS2)
+/*
+ * Linux termios2, as defined in <asm/termbits.h>. This header
+ * can't be included together with <termios.h>, so we define
+ * this structure locally
+ */
+#if     defined(__mips__)
+#define KERNEL_NCCS     23
+#elif   defined(__sparc__)
+#define KERNEL_NCCS     17
+#else
+#define KERNEL_NCCS     19
+#endif
+
+#ifndef BOTHER
+#define BOTHER          0010000
+#endif
+
+#ifndef IBSHIFT
+#define IBSHIFT         16
+#endif
+
+struct termios2 {
+    tcflag_t    c_iflag;
+    tcflag_t    c_oflag;
+    tcflag_t    c_cflag;
+    tcflag_t    c_lflag;
+    cc_t        c_line;
+    cc_t        c_cc[KERNEL_NCCS];
+    speed_t     c_ispeed;
+    speed_t     c_ospeed;
+};
+
+#define HAVE_CUSTOM_BIT_RATE
+#elif   defined(__APPLE__) && defined(IOSSIOSPEED)
+#define HAVE_CUSTOM_BIT_RATE
+#endif
+
+/*
+ * Set arbitrary bit rate on the already configured TTY line.
+ * Returns effective bit rate, as reported by driver, or 0
+ * if custom bit rates are not supported
+ */
+static unsigned long
+tty_set_custom_speed (int fd, unsigned long rate)
+{
+#if     defined(__linux__) && defined(TCGETS2)
+    struct termios2     mode;
+
+    if (ioctl(fd, TCGETS2, &mode) == -1) {
+        return 0;
+    }
+
+    if (mode.c_ispeed == rate && mode.c_ospeed == rate) {
+        return rate; /* Already set */
+    }
+
+    mode.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+    mode.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+    mode.c_ispeed = mode.c_ospeed = rate;
+
+    if (ioctl(fd, TCSETS2, &mode) == -1 || ioctl(fd, TCGETS2, &mode) == -1) {
+        return 0;
+    }
+
+    return mode.c_ospeed;
+#elif   defined(__APPLE__) && defined(IOSSIOSPEED)
+    speed_t             speed = rate;
+    struct termios      mode;
+
+    if (ioctl(fd, IOSSIOSPEED, &speed) == -1 || tcgetattr(fd, &mode) == -1) {
+        return 0;
+    }
+
+    return cfgetospeed(&mode);
+#else
+    (void) fd;
+    (void) rate;
+    return 0;
+#endif
+}
+
 /***** Command-line arguments parsing *****/
 /*
  * Parse NL sequence (-n option)
@@ -303,13 +892,15 @@ parse_speed (char* s)
     unsigned long rate;
 
     rate = strtoul( s, &end, 0 );
-    if (*end) {
+    if (*end || rate == 0) {
         goto USAGE;
     }
 
+#ifndef HAVE_CUSTOM_BIT_RATE
     if (bit_rate_to_c_flags(rate) == B0) {
         goto USAGE;
     }
+#endif
 
     return rate;
 
@@ -319,10 +910,10 @@ USAGE:
 }
 
 /*
- * Parse ESC character (-x option)
+ * Parse control character (-x and -e options)
  */
 static void
-parse_esc_char (char* s)
+parse_ctrl_char (char* s, int *out, const char *what)
 {
     int c;
 
@@ -332,400 +923,10891 @@ parse_esc_char (char* s)
 
     c = *(unsigned char*) s;
     if (0x40 <= c && c <= 0x5f) {
-        opt_esc_char = c - 0x40;
+        *out = c - 0x40;
     }
 
     if (0x60 <= c && c <= 0x7f) {
-        opt_esc_char = c - 0x60;
+        *out = c - 0x60;
     }
 
     return;
 
 USAGE:
-    usage_error("invalid exit char -- %s", s);
+    usage_error("invalid %s char -- %s", what, s);
 }
 
 /*
- * Parse delay (-d option)
+ * Parse delay (-d and -D options)
+ *
+ * Returns delay in nanoseconds. For relative delay, returns
+ * percents and sets *relative to true
  */
-static void
-parse_delay (const char* s)
+static uint64_t
+parse_delay (const char* s, bool *relative)
 {
     char*       end;
+    uint64_t    delay;
 
-    opt_send_delay = strtoul( s, &end, 0 );
+    *relative = false;
+    delay = strtoul( s, &end, 0 );
     if (*end == '\0' || !strcasecmp(end, "us")) {
-        ;
+        delay *= 1000;
     } else if (!strcasecmp(end, "ms")) {
-        opt_send_delay *= 1000;
+        delay *= 1000000;
     } else if (!strcasecmp(end, "%")) {
-        opt_send_delay_relative = true;
+        *relative = true;
     } else {
         usage_error( "invalid output delay -- %s", s );
     }
+
+    return delay;
 }
 
 /*
- * Parse command-line options
+ * Convert relative delay in percents of character
+ * transmit time into nanoseconds
  */
-static void
-parse_argv (int argc, char **argv)
+static uint64_t
+relative_delay (uint64_t percents)
 {
-    int opt;
-
-    /***** Parse options *****/
-    if (argc == 1) {
-        usage();
-    }
-
-    while ((opt = getopt(argc, argv, ":cs:x:d:n:t:h")) != EOF) {
-        switch (opt) {
-            case 'c':
-                opt_supress_ctrls = true;
-                break;
-
-            case 'n':
-                opt_nl_sequence = parse_nl_sequence(optarg);
-                break;
-
-            case 's':
-                opt_tty_speed = parse_speed(optarg);
-                break;
-
-            case 'x':
-                parse_esc_char(optarg);
-                break;
-
-            case 'd':
-                parse_delay(optarg);
-                break;
-
-            case 't':
-                free(opt_tee_file);
-                opt_tee_file = mem_strdup(optarg);
-                break;
+    return (percents * 9 * 1000000000ULL) / (100 * opt_tty_speed);
+}
 
-            case 'h':
-                usage();
-                break;
+/*
+ * Parse buffer size (-B option)
+ *
+ * Size is rounded up to the power of two
+ */
+static size_t
+parse_ring_size (const char* s)
+{
+    char          *end;
+    unsigned long size, ring;
 
-            case '?':
-                usage_error("invalid option -- -%c", optopt);
-                break;
-        }
+    size = strtoul( s, &end, 0 );
+    if (!strcasecmp(end, "k")) {
+        size *= 1024;
+    } else if (!strcasecmp(end, "m")) {
+        size *= 1024 * 1024;
+    } else if (*end) {
+        goto USAGE;
     }
 
-    /***** Fixup output delay *****/
-    if (opt_send_delay_relative) {
-        opt_send_delay = (1000000 * 9) / opt_tty_speed;
+    if (size == 0 || size > MAX_RING_SIZE) {
+        goto USAGE;
     }
 
-    /***** Fixup opt_nl_size *****/
-    if (opt_nl_sequence) {
-        opt_nl_size = strlen( (char*) opt_nl_sequence );
-    }
+    for (ring = 1; ring < size; ring <<= 1)
+        ;
 
-    /***** Guess device name *****/
-    if (optind + 1 == argc) {
-        if (argv[optind][0] == '/') {
-            opt_tty_line = argv[optind];
-        } else {
-            char        prefix[] = "/dev/";
+    return ring;
 
-            opt_tty_line = mem_alloc(sizeof(prefix) + strlen(argv[optind]));
-            strcpy(opt_tty_line, prefix);
-            strcat(opt_tty_line, argv[optind]);
-        }
-    }else if (optind + 1 < argc) {
-        usage_error("unexpected argument -- %s", argv[optind + 1]);
-    } else {
-        usage_error("missed terminal line");
-    }
+USAGE:
+    usage_error("invalid buffer size -- %s", s);
+    return 0;
 }
 
-/***** Opening files *****/
 /*
- * Open output file. Returns -1, if save to file is not requested
+ * Parse integer option in range [min...max]
  */
 static int
-open_tee (void)
+parse_int (const char *s, int min, int max, const char *what)
 {
-    int fd = -1;
+    char        *end;
+    long        v = strtol(s, &end, 0);
 
-    if (opt_tee_file != NULL) {
-        fd = open(opt_tee_file, O_CREAT | O_TRUNC | O_WRONLY, 0644);
-        if (fd == -1) {
-            panic_perror( "can't open %s", opt_tee_file );
-        }
+    if (*end || end == s || v < min || v > max) {
+        usage_error("invalid %s -- %s", what, s);
     }
 
-    return fd;
+    return (int) v;
 }
 
 /*
- * Open and initialize TTY line
+ * Parse tee backpressure policy (--tee-policy option)
  */
-static int
-open_tty (void)
+static aw_policy
+parse_tee_policy (const char *s)
 {
-    int                 fd;
-    struct termios      mode;
-    int                 tmp;
-    speed_t             speed = bit_rate_to_c_flags(opt_tty_speed);
-
-    fd = open(opt_tty_line, O_RDWR | O_NONBLOCK | O_NOCTTY);
-    if (fd == -1) {
-        panic_perror( "can't open %s", opt_tty_line );
+    if (!strcasecmp(s, "block")) {
+        return AW_BLOCK;
+    } else if (!strcasecmp(s, "drop")) {
+        return AW_DROP;
+    } else if (!strcasecmp(s, "spill")) {
+        return AW_SPILL;
     }
 
-    memset(&mode, 0, sizeof(mode));
-    mode.c_cflag = CS8 | HUPCL | CLOCAL | CREAD;
-    mode.c_iflag = IGNBRK | IGNPAR;
-    mode.c_oflag = 0;
-    mode.c_lflag = 0;
+    usage_error("invalid tee policy -- %s", s);
+    return AW_BLOCK;
+}
 
-    cfsetospeed(&mode, speed);
-    cfsetispeed(&mode, speed);
+/*
+ * Parse file size, NNN[K|M|G] (--tee-max-size option)
+ */
+static uint64_t
+parse_size (const char *s)
+{
+    char                *end;
+    unsigned long long  size;
+    int                 shift = 0;
 
-    mode.c_cc[VMIN] = 1;
-    mode.c_cc[VTIME] = 0;
+    errno = 0;
+    size = strtoull(s, &end, 0);
 
-    if (tcflush( fd, TCIOFLUSH ) == -1) {
-        panic_perror( "tcflush()" );
+    if (!strcasecmp(end, "k")) {
+        shift = 10;
+    } else if (!strcasecmp(end, "m")) {
+        shift = 20;
+    } else if (!strcasecmp(end, "g")) {
+        shift = 30;
+    } else if (*end) {
+        size = 0;
     }
 
-    if (tcsetattr( fd, TCSANOW, &mode ) == -1) {
-        panic_perror( "tcsetattr()" );
+    if (errno == ERANGE || size > (ULLONG_MAX >> shift) ||
+        size << shift > SIZE_MAX) {
+        usage_error("size is too large -- %s", s);
     }
 
-    tmp = fcntl(fd, F_GETFD);
-    tmp &= ~O_NONBLOCK;
-    fcntl(fd, F_SETFL, tmp);
+    size <<= shift;
+    if (size == 0 || end == s || *s == '-') {
+        usage_error("invalid size -- %s", s);
+    }
 
-    return fd;
+    return size;
 }
 
-/***** TTY mode setting *****/
 /*
- * Restore console settins
+ * Parse time interval, NNN[ms|s|m|h|d] (--tee-rotate-interval and
+ * --batch-timeout options). Returns nanoseconds
  */
-static void
-console_restore (void)
+static uint64_t
+parse_interval (const char *s)
 {
-    tcsetattr(0, TCSANOW, &saved_console_mode);
-}
+    char                *end;
+    unsigned long long  t, mul = 0;
 
-/*
- * Setup console mode
- */
-static void
-console_setup (void)
-{
-    struct termios      mode;
+    errno = 0;
+    t = strtoull(s, &end, 0);
 
-    if (tcgetattr(0, &mode) == -1) {
-        panic_perror("tcgetattr(console)");
+    if (*end == '\0' || !strcasecmp(end, "s")) {
+        mul = 1000;
+    } else if (!strcasecmp(end, "ms")) {
+        mul = 1;
+    } else if (!strcasecmp(end, "m")) {
+        mul = 60 * 1000;
+    } else if (!strcasecmp(end, "h")) {
+        mul = 60 * 60 * 1000;
+    } else if (!strcasecmp(end, "d")) {
+        mul = 24 * 60 * 60 * 1000;
     }
 
-    saved_console_mode = mode;
-    atexit(console_restore);
-
-    mode.c_lflag &= ~(ICANON | ISIG | ECHO);
-//    mode.c_cflag |= CSTOPB;
+    if (mul != 0 && (errno == ERANGE ||
+                     t > UINT64_MAX / 1000000ULL / mul)) {
+        usage_error("time interval is too large -- %s", s);
+    }
 
-    if (tcsetattr(0, TCSANOW, &mode) == -1) {
-        panic_perror("tcsetattr(console)");
+    t *= mul;
+    if (t == 0 || end == s || *s == '-') {
+        usage_error("invalid time interval -- %s", s);
     }
+
+    return (uint64_t) t * 1000000ULL;
 }
 
-/***** Miscellaneous helpers *****/
 /*
- * Suppress control characters on input
- *
- * Modifies buffer in place and returns new size
+ * Parse compression method (--tee-compress option)
  */
-static size_t
+static seg_compress
+parse_compress (const char *s)
+{
+    if (!strcasecmp(s, "none")) {
+        return SEG_COMPRESS_NONE;
+    }
+
+#ifdef  HAVE_ZSTD
+    if (!strcasecmp(s, "zstd")) {
+        return SEG_COMPRESS_ZSTD;
+    }
+#endif
+
+#ifdef  HAVE_LZ4
+    if (!strcasecmp(s, "lz4")) {
+        return SEG_COMPRESS_LZ4;
+    }
+#endif
+
+#ifdef  HAVE_ZLIB
+    if (!strcasecmp(s, "gzip")) {
+        return SEG_COMPRESS_GZIP;
+    }
+#endif
+
+    if (!strcasecmp(s, "zstd") || !strcasecmp(s, "lz4") ||
+        !strcasecmp(s, "gzip")) {
+        usage_error("%s compression is not supported by this build", s);
+    }
+
+    usage_error("invalid compression method -- %s", s);
+    return SEG_COMPRESS_NONE;
+}
+
+/*
+ * Parse time in seconds (--from and --to options). Returns nanoseconds
+ */
+static uint64_t
+parse_seconds (const char *s)
+{
+    char        *end;
+    double      v = strtod(s, &end);
+
+    if (*end || end == s || v < 0 || v > 1e9) {
+        usage_error("invalid time -- %s", s);
+    }
+
+    return (uint64_t) (v * 1e9);
+}
+
+/*
+ * Parse upload pacing mode (--send-pace option)
+ */
+static send_pace
+parse_send_pace (const char *s)
+{
+    if (!strcasecmp(s, "outq")) {
+        return SEND_PACE_OUTQ;
+    } else if (!strcasecmp(s, "line")) {
+        return SEND_PACE_LINE;
+    } else if (!strcasecmp(s, "prompt")) {
+        return SEND_PACE_PROMPT;
+    }
+
+    usage_error("invalid upload pacing -- %s", s);
+    return SEND_PACE_OUTQ;
+}
+
+/*
+ * Parse timestamp mode (-T option)
+ */
+static ts_mode
+parse_timestamp (const char *s)
+{
+    if (!strcasecmp(s, "mono")) {
+        return TS_MONO;
+    } else if (!strcasecmp(s, "wall")) {
+        return TS_WALL;
+    } else if (!strcasecmp(s, "none")) {
+        return TS_NONE;
+    }
+
+    usage_error("invalid timestamp mode -- %s", s);
+    return TS_NONE;
+}
+
+/*
+ * Parse flow control mode (--flow option)
+ */
+static flow_mode
+parse_flow (const char *s)
+{
+    if (!strcasecmp(s, "none")) {
+        return FLOW_NONE;
+    } else if (!strcasecmp(s, "rtscts")) {
+#ifdef  CRTSCTS
+        return FLOW_RTSCTS;
+#else
+        usage_error("hardware flow control is not supported");
+#endif
+    } else if (!strcasecmp(s, "xonxoff")) {
+        return FLOW_XONXOFF;
+    }
+
+    usage_error("invalid flow control -- %s", s);
+    return FLOW_NONE;
+}
+
+/*
+ * Parse terminal line name. Names without leading slash
+ * are relative to /dev
+ */
+static char*
+parse_line (const char *s)
+{
+    char        prefix[] = "/dev/";
+    char        *line;
+
+    if (s[0] == '/') {
+        return mem_strdup(s);
+    }
+
+    line = mem_alloc(sizeof(prefix) + strlen(s));
+    strcpy(line, prefix);
+    strcat(line, s);
+
+    return line;
+}
+
+/*
+ * Parse list of terminal lines (-m option)
+ */
+static void
+parse_ports (const char *s)
+{
+    char        *list = mem_strdup(s), *name, *save;
+
+    for (name = strtok_r(list, ",", &save); name != NULL;
+         name = strtok_r(NULL, ",", &save)) {
+        opt_ports = mem_realloc(opt_ports,
+            (opt_nports + 1) * sizeof(*opt_ports));
+        opt_ports[opt_nports ++] = parse_line(name);
+    }
+
+    mem_free(list);
+
+    if (opt_nports == 0) {
+        usage_error("empty list of lines -- %s", s);
+    }
+}
+
+/*
+ * Codes of long-only options
+ */
+enum {
+    OPT_TEE_BUFFER = 256,
+    OPT_TEE_POLICY,
+    OPT_TEE_MAX_SIZE,
+    OPT_TEE_ROTATE_INTERVAL,
+    OPT_TEE_COMPRESS,
+    OPT_SPLICE,
+    OPT_LOW_LATENCY,
+    OPT_LATENCY_TIMER,
+    OPT_VMIN,
+    OPT_VTIME,
+    OPT_STATS_SOCKET,
+    OPT_CAPTURE,
+    OPT_REPLAY,
+    OPT_FROM,
+    OPT_TO,
+    OPT_RECORDS,
+    OPT_SEND,
+    OPT_SEND_PACE,
+    OPT_SEND_PROMPT,
+    OPT_THREADS,
+    OPT_LISTEN,
+    OPT_LISTEN_BATCH,
+    OPT_RFC2217,
+    OPT_RECONNECT,
+    OPT_NO_FLUSH,
+    OPT_ON,
+    OPT_RENDER_FPS,
+    OPT_HEX,
+    OPT_FLOW,
+    OPT_RX_THREAD,
+    OPT_RX_CPU,
+    OPT_RX_FIFO,
+    OPT_HUGEPAGES,
+    OPT_SCROLLBACK,
+    OPT_LATENCY_PROBE,
+    OPT_BATCH,
+    OPT_BATCH_TIMEOUT,
+    OPT_SELF_TEST
+};
+
+/*
+ * Long options
+ */
+static const struct option
+long_options[] = {
+    {"tee-buffer",      required_argument, NULL, OPT_TEE_BUFFER},
+    {"tee-policy",      required_argument, NULL, OPT_TEE_POLICY},
+    {"tee-max-size",    required_argument, NULL, OPT_TEE_MAX_SIZE},
+    {"tee-rotate-interval", required_argument, NULL, OPT_TEE_ROTATE_INTERVAL},
+    {"tee-compress",    required_argument, NULL, OPT_TEE_COMPRESS},
+    {"splice",          no_argument,       NULL, OPT_SPLICE},
+    {"low-latency",     no_argument,       NULL, OPT_LOW_LATENCY},
+    {"latency-timer",   required_argument, NULL, OPT_LATENCY_TIMER},
+    {"vmin",            required_argument, NULL, OPT_VMIN},
+    {"vtime",           required_argument, NULL, OPT_VTIME},
+    {"stats-socket",    required_argument, NULL, OPT_STATS_SOCKET},
+    {"capture",         required_argument, NULL, OPT_CAPTURE},
+    {"replay",          required_argument, NULL, OPT_REPLAY},
+    {"from",            required_argument, NULL, OPT_FROM},
+    {"to",              required_argument, NULL, OPT_TO},
+    {"records",         no_argument,       NULL, OPT_RECORDS},
+    {"send",            required_argument, NULL, OPT_SEND},
+    {"send-pace",       required_argument, NULL, OPT_SEND_PACE},
+    {"send-prompt",     required_argument, NULL, OPT_SEND_PROMPT},
+    {"threads",         required_argument, NULL, OPT_THREADS},
+    {"listen",          required_argument, NULL, OPT_LISTEN},
+    {"listen-batch",    no_argument,       NULL, OPT_LISTEN_BATCH},
+    {"rfc2217",         no_argument,       NULL, OPT_RFC2217},
+    {"reconnect",       no_argument,       NULL, OPT_RECONNECT},
+    {"no-flush",        no_argument,       NULL, OPT_NO_FLUSH},
+    {"on",              required_argument, NULL, OPT_ON},
+    {"render-fps",      required_argument, NULL, OPT_RENDER_FPS},
+    {"hex",             no_argument,       NULL, OPT_HEX},
+    {"flow",            required_argument, NULL, OPT_FLOW},
+    {"rx-thread",       no_argument,       NULL, OPT_RX_THREAD},
+    {"rx-cpu",          required_argument, NULL, OPT_RX_CPU},
+    {"rx-fifo",         required_argument, NULL, OPT_RX_FIFO},
+    {"hugepages",       no_argument,       NULL, OPT_HUGEPAGES},
+    {"scrollback",      required_argument, NULL, OPT_SCROLLBACK},
+    {"latency-probe",   required_argument, NULL, OPT_LATENCY_PROBE},
+    {"batch",           no_argument,       NULL, OPT_BATCH},
+    {"batch-timeout",   required_argument, NULL, OPT_BATCH_TIMEOUT},
+    {"self-test",       no_argument,       NULL, OPT_SELF_TEST},
+    {NULL,              0,                 NULL, 0}
+};
+
+/*
+ * Parse command-line options
+ */
+static void
+parse_argv (int argc, char **argv)
+{
+    int opt;
+
+    /***** Parse options *****/
+    if (argc == 1) {
+        usage();
+    }
+
+    while ((opt = getopt_long(argc, argv, ":cs:x:r:d:D:n:t:B:T:m:e:h",
+                              long_options, NULL)) != EOF) {
+        switch (opt) {
+            case 'c':
+                opt_supress_ctrls = true;
+                break;
+
+            case 'n':
+                opt_nl_sequence = parse_nl_sequence(optarg);
+                break;
+
+            case 's':
+                opt_tty_speed = parse_speed(optarg);
+                break;
+
+            case 'x':
+                parse_ctrl_char(optarg, &opt_esc_char, "exit");
+                break;
+
+            case 'r':
+                parse_ctrl_char(optarg, &opt_search_char, "search");
+                break;
+
+            case 'd':
+                opt_send_delay = parse_delay(optarg, &opt_send_delay_relative);
+                break;
+
+            case 'D':
+                opt_line_delay = parse_delay(optarg, &opt_line_delay_relative);
+                break;
+
+            case 't':
+                mem_free(opt_tee_file);
+                opt_tee_file = mem_strdup(optarg);
+                break;
+
+            case 'B':
+                opt_ring_size = parse_ring_size(optarg);
+                break;
+
+            case 'T':
+                opt_timestamp = parse_timestamp(optarg);
+                break;
+
+            case 'm':
+                parse_ports(optarg);
+                break;
+
+            case 'e':
+                parse_ctrl_char(optarg, &opt_switch_char, "switch");
+                break;
+
+            case OPT_TEE_BUFFER:
+                opt_tee_buffer = parse_ring_size(optarg);
+                break;
+
+            case OPT_TEE_POLICY:
+                opt_tee_policy = parse_tee_policy(optarg);
+                break;
+
+            case OPT_TEE_MAX_SIZE:
+                opt_tee_max_size = parse_size(optarg);
+                break;
+
+            case OPT_TEE_ROTATE_INTERVAL:
+                opt_tee_rotate_interval = parse_interval(optarg);
+                break;
+
+            case OPT_TEE_COMPRESS:
+                opt_tee_compress = parse_compress(optarg);
+                break;
+
+            case OPT_SPLICE:
+                opt_splice = true;
+                break;
+
+            case OPT_LOW_LATENCY:
+                opt_low_latency = true;
+                break;
+
+            case OPT_LATENCY_TIMER:
+                opt_latency_timer = parse_int(optarg, 1, 255, "latency timer");
+                break;
+
+            case OPT_VMIN:
+                opt_vmin = parse_int(optarg, 1, 255, "VMIN");
+                break;
+
+            case OPT_VTIME:
+                opt_vtime = parse_int(optarg, 0, 255, "VTIME");
+                break;
+
+            case OPT_STATS_SOCKET:
+                mem_free(opt_stats_socket);
+                opt_stats_socket = mem_strdup(optarg);
+                break;
+
+            case OPT_CAPTURE:
+                mem_free(opt_capture_file);
+                opt_capture_file = mem_strdup(optarg);
+                break;
+
+            case OPT_REPLAY:
+                mem_free(opt_replay_file);
+                opt_replay_file = mem_strdup(optarg);
+                break;
+
+            case OPT_FROM:
+                opt_replay_from = parse_seconds(optarg);
+                break;
+
+            case OPT_TO:
+                opt_replay_to = parse_seconds(optarg);
+                break;
+
+            case OPT_RECORDS:
+                opt_replay_records = true;
+                break;
+
+            case OPT_SEND:
+                mem_free(opt_send_file);
+                opt_send_file = mem_strdup(optarg);
+                break;
+
+            case OPT_SEND_PACE:
+                opt_send_pace = parse_send_pace(optarg);
+                break;
+
+            case OPT_SEND_PROMPT:
+                if (!*optarg) {
+                    usage_error("empty upload prompt");
+                }
+                opt_send_prompt = mem_strdup(optarg);
+                break;
+
+            case OPT_THREADS:
+                opt_threads = parse_int(optarg, 1, 1024, "count of threads");
+                break;
+
+            case OPT_LISTEN:
+                mem_free(opt_listen);
+                opt_listen = mem_strdup(optarg);
+                break;
+
+            case OPT_LISTEN_BATCH:
+                opt_listen_batch = true;
+                break;
+
+            case OPT_RFC2217:
+                opt_rfc2217 = true;
+                break;
+
+            case OPT_RECONNECT:
+                opt_reconnect = true;
+                break;
+
+            case OPT_NO_FLUSH:
+                opt_tty_flush = false;
+                break;
+
+            case OPT_ON:
+                opt_triggers = mem_realloc(opt_triggers,
+                    (opt_ntriggers + 1) * sizeof(*opt_triggers));
+                opt_triggers[opt_ntriggers ++] = mem_strdup(optarg);
+                break;
+
+            case OPT_RENDER_FPS:
+                opt_render_fps = parse_int(optarg, 1, 1000, "frame rate");
+                break;
+
+            case OPT_HEX:
+                opt_hex = true;
+                break;
+
+            case OPT_FLOW:
+                opt_flow = parse_flow(optarg);
+                break;
+
+            case OPT_RX_THREAD:
+                opt_rx_thread = true;
+                break;
+
+            case OPT_RX_CPU:
+                opt_rx_cpu = parse_int(optarg, 0, 1023, "CPU");
+                opt_rx_thread = true;
+                break;
+
+            case OPT_RX_FIFO:
+                opt_rx_prio = parse_int(optarg, 1, 99, "priority");
+                opt_rx_thread = true;
+                break;
+
+            case OPT_HUGEPAGES:
+                opt_hugepages = true;
+                break;
+
+            case OPT_SCROLLBACK:
+                opt_scrollback = parse_size(optarg);
+                break;
+
+            case OPT_LATENCY_PROBE:
+                opt_latency_probe = parse_int(optarg, 1, 10000000,
+                    "count of probes");
+                break;
+
+            case OPT_BATCH:
+                opt_batch = true;
+                break;
+
+            case OPT_BATCH_TIMEOUT:
+                opt_batch_timeout = parse_interval(optarg);
+                break;
+
+            case OPT_SELF_TEST:
+                opt_self_test = true;
+                break;
+
+            case 'h':
+                usage();
+                break;
+
+            case '?':
+                if (optopt) {
+                    usage_error("invalid option -- -%c", optopt);
+                }
+                usage_error("invalid option -- %s", argv[optind - 1]);
+                break;
+
+            case ':':
+                usage_error("missed option argument -- %s", argv[optind - 1]);
+                break;
+        }
+    }
+
+    /***** Check options compatibility *****/
+    if (opt_splice && opt_tee_policy == AW_SPILL) {
+        usage_error("--splice can't be used with --tee-policy spill");
+    }
+
+    if (opt_tee_file == NULL && (opt_tee_max_size || opt_tee_rotate_interval ||
+        opt_tee_compress != SEG_COMPRESS_NONE)) {
+        usage_error("tee file rotation and compression require -t");
+    }
+
+    if (opt_nports != 0) {
+        if (opt_stats_socket != NULL) {
+            usage_error("--stats-socket can't be used with -m");
+        }
+
+        if (opt_send_file != NULL) {
+            usage_error("--send can't be used with -m");
+        }
+
+        if (opt_low_latency || opt_latency_timer != -1) {
+            usage_error("low-latency settings can't be used with -m");
+        }
+
+        if (opt_switch_char == opt_esc_char) {
+            usage_error("exit and switch chars must differ");
+        }
+
+        if (opt_listen != NULL) {
+            usage_error("--listen can't be used with -m");
+        }
+
+        if (opt_latency_probe != 0) {
+            usage_error("--latency-probe can't be used with -m");
+        }
+    }
+
+    if (opt_hex && (opt_supress_ctrls || opt_timestamp != TS_NONE)) {
+        usage_error("--hex can't be used with -c or -T");
+    }
+
+    if (opt_hex && opt_replay_records) {
+        usage_error("--hex can't be used with --records");
+    }
+
+    if (opt_scrollback != 0) {
+        if (opt_nports != 0 || opt_listen != NULL) {
+            usage_error("--scrollback can't be used with -m or --listen");
+        }
+
+        if (opt_search_char == opt_esc_char) {
+            usage_error("exit and search chars must differ");
+        }
+    }
+
+    if (opt_batch && opt_listen != NULL) {
+        usage_error("--batch can't be used with --listen");
+    }
+
+    if (opt_listen == NULL && (opt_listen_batch || opt_rfc2217)) {
+        usage_error("--listen-batch and --rfc2217 require --listen");
+    }
+
+    /***** Fixup output delay *****/
+    if (opt_send_delay_relative) {
+        opt_send_delay = relative_delay(opt_send_delay);
+    }
+
+    if (opt_line_delay_relative) {
+        opt_line_delay = relative_delay(opt_line_delay);
+    }
+
+    /***** Fixup opt_nl_size *****/
+    if (opt_nl_sequence) {
+        opt_nl_size = strlen( (char*) opt_nl_sequence );
+    }
+
+    /***** Replay and self-test need no terminal line *****/
+    if (opt_replay_file != NULL || opt_self_test) {
+        if (optind < argc) {
+            usage_error("unexpected argument -- %s", argv[optind]);
+        }
+        return;
+    }
+
+    /***** Multi-port mode takes lines from -m *****/
+    if (opt_nports != 0) {
+        if (optind < argc) {
+            usage_error("unexpected argument -- %s", argv[optind]);
+        }
+        return;
+    }
+
+    /***** Guess device name *****/
+    if (optind + 1 == argc) {
+        opt_tty_line = parse_line(argv[optind]);
+    }else if (optind + 1 < argc) {
+        usage_error("unexpected argument -- %s", argv[optind + 1]);
+    } else {
+        usage_error("missed terminal line");
+    }
+}
+
+/***** Opening files *****/
+/*
+ * Get file name suffix of the compression method
+ */
+static const char*
+seg_suffix (seg_compress method)
+{
+    switch (method) {
+    case SEG_COMPRESS_ZSTD: return ".zst";
+    case SEG_COMPRESS_LZ4:  return ".lz4";
+    case SEG_COMPRESS_GZIP: return ".gz";
+    default:                return "";
+    }
+}
+
+/*
+ * Detect compression of the existing file by its magic number.
+ * Plain text, empty and unreadable files are SEG_COMPRESS_NONE
+ */
+static seg_compress
+seg_detect (const char *name)
+{
+    unsigned char   m[4];
+    int             fd = open(name, O_RDONLY);
+    ssize_t         rc;
+
+    if (fd == -1) {
+        return SEG_COMPRESS_NONE;
+    }
+
+    rc = read(fd, m, sizeof(m));
+    close(fd);
+
+    if (rc == 4 && !memcmp(m, "\x28\xb5\x2f\xfd", 4)) {
+        return SEG_COMPRESS_ZSTD;
+    } else if (rc == 4 && !memcmp(m, "\x04\x22\x4d\x18", 4)) {
+        return SEG_COMPRESS_LZ4;
+    } else if (rc >= 2 && m[0] == 0x1f && m[1] == 0x8b) {
+        return SEG_COMPRESS_GZIP;
+    }
+
+    return SEG_COMPRESS_NONE;
+}
+
+/*
+ * Get length of the segment name base: tee file name without
+ * compression suffix, if it has one (log.zst -> log.N.zst)
+ */
+static size_t
+seg_base_len (const char *name, const char *sfx)
+{
+    size_t      len = strlen(name), sl = strlen(sfx);
+
+    if (sl != 0 && len > sl && !strcmp(name + len - sl, sfx)) {
+        len -= sl;
+    }
+
+    return len;
+}
+
+/*
+ * Find the largest N of existing name.N segments, 0 if none
+ */
+static unsigned
+seg_last_index (const char *name, seg_compress method)
+{
+    const char      *sfx = seg_suffix(method);
+    size_t          len = seg_base_len(name, sfx);
+    const char      *slash = strrchr(name, '/');
+    char            dir[PATH_MAX];
+    const char      *base = slash != NULL ? slash + 1 : name;
+    size_t          base_len = len - (base - name);
+    DIR             *d;
+    struct dirent   *ent;
+    unsigned        last = 0;
+
+    if (slash == NULL) {
+        strcpy(dir, ".");
+    } else {
+        snprintf(dir, sizeof(dir), "%.*s",
+            slash == name ? 1 : (int) (slash - name), name);
+    }
+
+    d = opendir(dir);
+    if (d == NULL) {
+        return 0;
+    }
+
+    while ((ent = readdir(d)) != NULL) {
+        const char      *s = ent->d_name;
+        char            *end;
+        unsigned long   n;
+
+        if (strncmp(s, base, base_len) || s[base_len] != '.' ||
+            !isdigit((unsigned char) s[base_len + 1])) {
+            continue;
+        }
+
+        /* Segments of runs with other compression count as well */
+        n = strtoul(s + base_len + 1, &end, 10);
+        if ((*end == '\0' || !strcmp(end, sfx) ||
+             !strcmp(end, seg_suffix(SEG_COMPRESS_ZSTD)) ||
+             !strcmp(end, seg_suffix(SEG_COMPRESS_LZ4)) ||
+             !strcmp(end, seg_suffix(SEG_COMPRESS_GZIP))) &&
+            n > last && n < UINT_MAX) {
+            last = n;
+        }
+    }
+
+    closedir(d);
+    return last;
+}
+
+/*
+ * Rename existing non-empty file to name.N, plus suffix of its
+ * compression format (a file of the previous run may differ from
+ * the current method). *next is the next N; if 0, it is seeded
+ * from the largest existing N, so numbers grow and are never reused
+ */
+static void
+seg_rename_old (const char *name, unsigned *next, seg_compress method,
+        seg_compress format)
+{
+    struct stat st;
+    char        path[PATH_MAX];
+    const char  *sfx = seg_suffix(method);
+
+    if (stat(name, &st) == -1 || st.st_size == 0) {
+        return;
+    }
+
+    if (*next == 0) {
+        *next = seg_last_index(name, method) + 1;
+    }
+
+    snprintf(path, sizeof(path), "%.*s.%u%s",
+        (int) seg_base_len(name, sfx), name, (*next) ++, seg_suffix(format));
+
+    if (rename(name, path) == -1) {
+        panic_perror( "rename(%s, %s)", name, path );
+    }
+}
+
+/*
+ * Open output file. Returns -1, if save to file is not requested
+ */
+static int
+open_tee (const char *name)
+{
+    int fd = -1;
+
+    if (name != NULL) {
+        /* With rotation, log of the previous run is kept */
+        if (opt_tee_max_size || opt_tee_rotate_interval) {
+            unsigned    next = 0;
+            seg_rename_old(name, &next, opt_tee_compress, seg_detect(name));
+        }
+
+        fd = open(name, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+        if (fd == -1) {
+            panic_perror( "can't open %s", name );
+        }
+    }
+
+    return fd;
+}
+
+/***** Serial driver tuning *****/
+/*
+ * Driver settings, applied by catterm and values they replaced
+ */
+static struct {
+    bool        termios_saved;          /* Original VMIN/VTIME known */
+    cc_t        vmin_old, vtime_old;    /* Original VMIN/VTIME */
+    int         fd;                     /* TTY fd, for restoring */
+    bool        serial_set;             /* ASYNC_LOW_LATENCY was changed */
+    bool        serial_old;             /* Original ASYNC_LOW_LATENCY */
+    int         timer_old;              /* Original latency timer, or -1 */
+    int         timer_new;              /* Applied latency timer, or -1 */
+    char        timer_path[PATH_MAX];   /* Latency timer sysfs path */
+    char        timer_text[16];         /* timer_old, as written to sysfs */
+} tty_tune = {.timer_old = -1, .timer_new = -1};
+
+/*
+ * Save original driver settings, before TTY is configured
+ */
+static void
+tty_tune_save (int fd)
+{
+    struct termios      mode;
+
+    if (tcgetattr(fd, &mode) == 0) {
+        tty_tune.fd = fd;
+        tty_tune.termios_saved = true;
+        tty_tune.vmin_old = mode.c_cc[VMIN];
+        tty_tune.vtime_old = mode.c_cc[VTIME];
+    }
+}
+
+#ifdef  __linux__
+/*
+ * Read integer from the sysfs file. Returns -1 on error
+ */
+static int
+sysfs_read_int (const char *path)
+{
+    FILE        *fp = fopen(path, "r");
+    int         v = -1;
+
+    if (fp != NULL) {
+        if (fscanf(fp, "%d", &v) != 1) {
+            v = -1;
+        }
+        fclose(fp);
+    }
+
+    return v;
+}
+
+/*
+ * Write integer into the sysfs file
+ */
+static bool
+sysfs_write_int (const char *path, int v)
+{
+    FILE        *fp = fopen(path, "w");
+    bool        ok;
+
+    if (fp == NULL) {
+        return false;
+    }
+
+    ok = fprintf(fp, "%d\n", v) > 0;
+    ok = (fclose(fp) == 0) && ok;
+
+    return ok;
+}
+#endif
+
+/*
+ * Put back driver settings, changed by catterm. Only async-signal-safe
+ * calls are used here, so it is called from the signal handler too
+ */
+static void
+tty_tune_reset (void)
+{
+    struct termios  mode;
+
+#ifdef  __linux__
+    if (tty_tune.serial_set) {
+        struct serial_struct    ss;
+
+        if (ioctl(tty_tune.fd, TIOCGSERIAL, &ss) == 0) {
+            ss.flags &= ~ASYNC_LOW_LATENCY;
+            ss.flags |= tty_tune.serial_old ? ASYNC_LOW_LATENCY : 0;
+            ioctl(tty_tune.fd, TIOCSSERIAL, &ss);
+        }
+    }
+
+    if (tty_tune.timer_new != -1) {
+        int     fd = open(tty_tune.timer_path, O_WRONLY);
+
+        if (fd != -1) {
+            write(fd, tty_tune.timer_text, strlen(tty_tune.timer_text));
+            close(fd);
+        }
+    }
+#endif
+
+    if (tty_tune.termios_saved && (opt_vmin != 1 || opt_vtime != 0) &&
+        tcgetattr(tty_tune.fd, &mode) == 0) {
+        mode.c_cc[VMIN] = tty_tune.vmin_old;
+        mode.c_cc[VTIME] = tty_tune.vtime_old;
+        tcsetattr(tty_tune.fd, TCSANOW, &mode);
+    }
+}
+
+/*
+ * Restore driver settings and report what was changed. Called at exit
+ */
+static void
+tty_tune_restore (void)
+{
+    tty_tune_reset();
+
+#ifdef  __linux__
+    if (tty_tune.serial_set) {
+        fprintf(stderr, "%s: ASYNC_LOW_LATENCY: set (was %s)\n",
+            program_name, tty_tune.serial_old ? "set" : "not set");
+    }
+
+    if (tty_tune.timer_new != -1) {
+        fprintf(stderr, "%s: latency timer: %d ms (was %d ms)\n",
+            program_name, tty_tune.timer_new, tty_tune.timer_old);
+    }
+#endif
+
+    if (tty_tune.termios_saved &&
+        (opt_vmin != 1 || opt_vtime != 0)) {
+        fprintf(stderr, "%s: VMIN/VTIME: %d/0 (was %d/%d), "
+            "partial read timeout %d ms\n",
+            program_name, opt_vmin, tty_tune.vmin_old, tty_tune.vtime_old,
+            opt_vtime * 100);
+    }
+}
+
+/*
+ * Apply low-latency driver settings
+ */
+static void
+tty_tune_latency (int fd, const char *line)
+{
+#ifdef  __linux__
+    char                    path[PATH_MAX], *name;
+    struct serial_struct    ss;
+    int                     timer = opt_latency_timer;
+
+    tty_tune.fd = fd;
+
+    /* ASYNC_LOW_LATENCY */
+    if (opt_low_latency) {
+        if (ioctl(fd, TIOCGSERIAL, &ss) == -1) {
+            fprintf(stderr, "%s: TIOCGSERIAL: %s\n",
+                program_name, strerror(errno));
+        } else {
+            tty_tune.serial_old = (ss.flags & ASYNC_LOW_LATENCY) != 0;
+            ss.flags |= ASYNC_LOW_LATENCY;
+
+            if (ioctl(fd, TIOCSSERIAL, &ss) == -1) {
+                fprintf(stderr, "%s: TIOCSSERIAL: %s\n",
+                    program_name, strerror(errno));
+            } else {
+                tty_tune.serial_set = true;
+            }
+        }
+
+        if (timer == -1) {
+            timer = 1;
+        }
+    }
+
+    /* USB-serial latency timer */
+    if (realpath(line, path) == NULL) {
+        return;
+    }
+
+    name = strrchr(path, '/') + 1;
+    snprintf(tty_tune.timer_path, sizeof(tty_tune.timer_path),
+        "/sys/class/tty/%s/device/latency_timer", name);
+
+    tty_tune.timer_old = sysfs_read_int(tty_tune.timer_path);
+    snprintf(tty_tune.timer_text, sizeof(tty_tune.timer_text), "%d\n",
+        tty_tune.timer_old);
+    if (tty_tune.timer_old == -1) {
+        if (opt_latency_timer != -1) {
+            fprintf(stderr, "%s: %s: no latency timer\n",
+                program_name, line);
+        }
+        return;
+    }
+
+    if (!sysfs_write_int(tty_tune.timer_path, timer)) {
+        fprintf(stderr, "%s: %s: %s\n",
+            program_name, tty_tune.timer_path, strerror(errno));
+        return;
+    }
+
+    tty_tune.timer_new = timer;
+#else
+    (void) fd;
+    (void) line;
+    fprintf(stderr, "%s: low-latency settings are not supported\n",
+        program_name);
+#endif
+}
+
+/*
+ * Check that TTY mode already matches the wanted one
+ */
+static bool
+tty_mode_match (const struct termios *cur, const struct termios *want)
+{
+    return cur->c_iflag == want->c_iflag &&
+           cur->c_oflag == want->c_oflag &&
+           cur->c_cflag == want->c_cflag &&
+           cur->c_lflag == want->c_lflag &&
+           cur->c_cc[VMIN] == want->c_cc[VMIN] &&
+           cur->c_cc[VTIME] == want->c_cc[VTIME] &&
+           cur->c_cc[VSTART] == want->c_cc[VSTART] &&
+           cur->c_cc[VSTOP] == want->c_cc[VSTOP] &&
+           cfgetispeed(cur) == cfgetispeed(want) &&
+           cfgetospeed(cur) == cfgetospeed(want);
+}
+
+/*
+ * Open and initialize TTY line. Speed, actually set by the driver,
+ * is returned in *speed. On error, returns -1 and the failed
+ * operation in err; errno is preserved
+ *
+ * Line is opened non-blocking (so open doesn't wait for carrier)
+ * and left this way, as the event loop needs. Only things that
+ * differ are changed: if termios already matches (i.e., line was
+ * reopened after USB re-enumeration and driver kept settings, or
+ * settings were saved by the previous run), tcsetattr() is skipped.
+ * Flush is optional, as it may discard the very first bytes
+ */
+static int
+tty_open (const char *line, bool flush, char *err, size_t errsize,
+          unsigned long *speed_out)
+{
+    int                 fd, saved_errno;
+    struct termios      mode, cur;
+    bool                match;
+    speed_t             speed = bit_rate_to_c_flags(opt_tty_speed);
+    unsigned long       effective = opt_tty_speed;
+
+    if (speed == B0) {
+        /* Custom rate; actual speed is set later */
+        speed = B9600;
+    }
+
+    fd = open(line, O_RDWR | O_NONBLOCK | O_NOCTTY);
+    if (fd == -1) {
+        snprintf(err, errsize, "can't open %s", line);
+        return -1;
+    }
+
+    memset(&mode, 0, sizeof(mode));
+    mode.c_cflag = CS8 | HUPCL | CLOCAL | CREAD;
+    mode.c_iflag = IGNBRK | IGNPAR;
+    mode.c_oflag = 0;
+    mode.c_lflag = 0;
+
+    cfsetospeed(&mode, speed);
+    cfsetispeed(&mode, speed);
+
+    /*
+     * Line is non-blocking, so VTIME would be ignored by read(); worse,
+     * n_tty doesn't honor VMIN for poll wakeups when VTIME is set.
+     * --vtime is done by the main loop instead, see uterm_vtime_callback()
+     */
+    mode.c_cc[VMIN] = opt_vmin;
+    mode.c_cc[VTIME] = 0;
+
+#ifdef  CRTSCTS
+    if (opt_flow == FLOW_RTSCTS) {
+        mode.c_cflag |= CRTSCTS;
+    }
+#endif
+
+    if (opt_flow == FLOW_XONXOFF) {
+        mode.c_iflag |= IXON | IXOFF;
+        mode.c_cc[VSTART] = 0x11;
+        mode.c_cc[VSTOP] = 0x13;
+    }
+
+    if (!tty_tune.termios_saved) {
+        tty_tune_save(fd);
+    }
+
+    if (flush && tcflush( fd, TCIOFLUSH ) == -1) {
+        snprintf(err, errsize, "tcflush()");
+        goto FAIL;
+    }
+
+    match = tcgetattr(fd, &cur) == 0;
+    if (match && bit_rate_to_c_flags(opt_tty_speed) == B0) {
+        /* Custom rate is checked by tty_set_custom_speed() */
+        cfsetospeed(&cur, speed);
+        cfsetispeed(&cur, speed);
+    }
+
+    if (!(match && tty_mode_match(&cur, &mode)) &&
+        tcsetattr( fd, TCSANOW, &mode ) == -1) {
+        snprintf(err, errsize, "tcsetattr()");
+        goto FAIL;
+    }
+
+#ifdef  HAVE_CUSTOM_BIT_RATE
+    effective = tty_set_custom_speed(fd, opt_tty_speed);
+    if (effective == 0) {
+        if (bit_rate_to_c_flags(opt_tty_speed) == B0) {
+            snprintf(err, errsize, "can't set speed %lu", opt_tty_speed);
+            goto FAIL;
+        }
+        effective = opt_tty_speed;
+    }
+#endif
+
+    *speed_out = effective;
+    if (effective != opt_tty_speed) {
+        fprintf(stderr, "%s: %s: speed %lu requested, %lu set by driver\n",
+            program_name, line, opt_tty_speed, effective);
+    }
+
+    if (opt_low_latency || opt_latency_timer != -1) {
+        tty_tune_latency(fd, line);
+    }
+
+    return fd;
+
+FAIL:
+    saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return -1;
+}
+
+/*
+ * Open and initialize TTY line. Panics on error
+ */
+static int
+open_tty (const char *line, unsigned long *speed)
+{
+    char        what[PATH_MAX + 64];
+    int         fd = tty_open(line, opt_tty_flush, what, sizeof(what), speed);
+
+    if (fd == -1) {
+        panic_perror("%s", what);
+    }
+
+    return fd;
+}
+
+/*
+ * Change speed of the opened TTY line. Returns effective
+ * speed, 0 on error
+ */
+static unsigned long
+tty_set_speed (int fd, unsigned long rate)
+{
+    struct termios      mode;
+    speed_t             speed = bit_rate_to_c_flags(rate);
+    unsigned long       effective = rate;
+
+#ifndef HAVE_CUSTOM_BIT_RATE
+    if (speed == B0) {
+        return 0;
+    }
+#endif
+
+    if (tcgetattr(fd, &mode) == -1) {
+        return 0;
+    }
+
+    cfsetospeed(&mode, speed == B0 ? B9600 : speed);
+    cfsetispeed(&mode, speed == B0 ? B9600 : speed);
+
+    if (tcsetattr(fd, TCSANOW, &mode) == -1) {
+        return 0;
+    }
+
+#ifdef  HAVE_CUSTOM_BIT_RATE
+    effective = tty_set_custom_speed(fd, rate);
+    if (effective == 0) {
+        if (speed == B0) {
+            return 0;
+        }
+        effective = rate;
+    }
+#endif
+
+    return effective;
+}
+
+/***** TTY mode setting *****/
+/*
+ * Restore console settins
+ *
+ * Only async-signal-safe calls are used here, so it is called from
+ * the signal handler too; before console_setup() it does nothing
+ */
+static void
+console_restore (void)
+{
+    if (!console_saved) {
+        return;
+    }
+
+    if (!opt_batch) {
+        tcsetattr(0, TCSANOW, &saved_console_mode);
+    }
+
+    if (saved_console_flags != -1) {
+        fcntl(0, F_SETFL, saved_console_flags);
+    }
+
+    if (saved_console_out_flags != -1) {
+        fcntl(1, F_SETFL, saved_console_out_flags);
+    }
+}
+
+/*
+ * Grow console pipe to the I/O buffer size, so batch jobs move
+ * data in large chunks instead of the default 64K pipe. Not fatal:
+ * unprivileged processes are limited by /proc/sys/fs/pipe-max-size
+ */
+static void
+console_pipe_size (int fd)
+{
+#ifdef  F_SETPIPE_SZ
+    struct stat st;
+    int         size = (int) opt_ring_size;
+
+    if (fstat(fd, &st) == -1 || !S_ISFIFO(st.st_mode)) {
+        return;
+    }
+
+    while (fcntl(fd, F_SETPIPE_SZ, size) == -1 && errno == EPERM &&
+           size > DEFAULT_RING_SIZE) {
+        size /= 2;
+    }
+#else
+    (void) fd;
+#endif
+}
+
+/*
+ * Setup console mode
+ *
+ * In batch mode console is a pipe or file, and its mode is left
+ * alone; file status flags are restored anyway, as stdin and stdout
+ * may be shared with the invoking script
+ */
+static void
+console_setup (void)
+{
+    struct termios      mode;
+
+    if (opt_batch) {
+        saved_console_flags = fcntl(0, F_GETFL);
+        saved_console_out_flags = fcntl(1, F_GETFL);
+        console_saved = 1;
+        atexit(console_restore);
+        console_pipe_size(0);
+        console_pipe_size(1);
+        return;
+    }
+
+    if (tcgetattr(0, &mode) == -1) {
+        panic_perror("tcgetattr(console)");
+    }
+
+    saved_console_mode = mode;
+    saved_console_flags = fcntl(0, F_GETFL);
+    console_saved = 1;
+    atexit(console_restore);
+
+    mode.c_lflag &= ~(ICANON | ISIG | ECHO);
+//    mode.c_cflag |= CSTOPB;
+
+    if (tcsetattr(0, TCSANOW, &mode) == -1) {
+        panic_perror("tcsetattr(console)");
+    }
+}
+
+/***** Time *****/
+/*
+ * Get current CLOCK_MONOTONIC time in nanoseconds
+ */
+static uint64_t
+now_ns (void)
+{
+    struct timespec     ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/***** Line timestamps *****/
+/*
+ * Timestamps formatter. Formatting of seconds is expensive
+ * (especially localtime_r() and strftime()), so it is cached
+ * and repeated only when second changes; only microseconds
+ * are formatted for each stamp
+ */
+typedef struct {
+    ts_mode     mode;                   /* Timestamp mode */
+    uint64_t    base;                   /* TS_MONO: start time, ns */
+    time_t      sec;                    /* Second of cached prefix */
+    char        prefix[TS_MAX_LEN];     /* Cached "[seconds." prefix */
+    size_t      prefix_len;             /* Its length, 0 if none */
+} tstamp;
+
+/*
+ * Initialize timestamps formatter
+ */
+static void
+tstamp_init (tstamp *ts, ts_mode mode)
+{
+    memset(ts, 0, sizeof(*ts));
+    ts->mode = mode;
+    ts->base = now_ns();
+}
+
+/*
+ * Format timestamp for the time t (now_ns() clock). Returns
+ * its length, which never exceeds TS_MAX_LEN
+ */
+static size_t
+tstamp_format (tstamp *ts, unsigned char *out, uint64_t t)
+{
+    struct timespec     now;
+    unsigned long       usec;
+    time_t              sec;
+    int                 i;
+
+    if (ts->mode == TS_WALL) {
+        /* Wall clock of t is now, as much before, as t is */
+        uint64_t    ns, ago = now_ns() - t;
+
+        clock_gettime(CLOCK_REALTIME, &now);
+        ns = (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec - ago;
+        sec = (time_t) (ns / 1000000000ULL);
+        usec = (unsigned long) (ns % 1000000000ULL) / 1000;
+    } else {
+        uint64_t    ns = t - ts->base;
+        sec = (time_t) (ns / 1000000000ULL);
+        usec = (unsigned long) (ns % 1000000000ULL) / 1000;
+    }
+
+    if (ts->prefix_len == 0 || sec != ts->sec) {
+        if (ts->mode == TS_WALL) {
+            struct tm   tm;
+            localtime_r(&sec, &tm);
+            ts->prefix_len = strftime(ts->prefix, sizeof(ts->prefix),
+                "[%Y-%m-%d %H:%M:%S.", &tm);
+        } else {
+            ts->prefix_len = snprintf(ts->prefix, sizeof(ts->prefix),
+                "[%5lld.", (long long) sec);
+        }
+        ts->sec = sec;
+    }
+
+    memcpy(out, ts->prefix, ts->prefix_len);
+    out += ts->prefix_len;
+
+    for (i = 5; i >= 0; i --) {
+        out[i] = '0' + usec % 10;
+        usec /= 10;
+    }
+
+    out[6] = ']';
+    out[7] = ' ';
+
+    return ts->prefix_len + 8;
+}
+
+/*
+ * Copy chunk of received data from in to out, prepending timestamp
+ * to the beginning of each line. All lines of the chunk get the
+ * same timestamp t (now_ns() clock), when chunk was received
+ *
+ * *bol tells if we are at the beginning of line, and updated
+ * on return. Output buffer must have room for
+ * size * (TS_MAX_LEN + 1) bytes. Returns output length
+ */
+static size_t
+tstamp_lines (tstamp *ts, bool *bol, const unsigned char *in, size_t size,
+        unsigned char *out, uint64_t t)
+{
+    unsigned char       stamp[TS_MAX_LEN];
+    size_t              stamp_len = 0;
+    unsigned char       *start = out;
+
+    while (size != 0) {
+        const unsigned char *nl;
+        size_t              len;
+
+        if (*bol) {
+            if (stamp_len == 0) {
+                stamp_len = tstamp_format(ts, stamp, t);
+            }
+            memcpy(out, stamp, stamp_len);
+            out += stamp_len;
+            *bol = false;
+        }
+
+        nl = memchr(in, '\n', size);
+        if (nl != NULL) {
+            len = (size_t) (nl - in) + 1;
+            *bol = true;
+        } else {
+            len = size;
+        }
+
+        memcpy(out, in, len);
+        out += len;
+        in += len;
+        size -= len;
+    }
+
+    return (size_t) (out - start);
+}
+
+/***** Control characters suppression *****/
+/*
+ * Suppress control characters on input, reference implementation
+ *
+ * Replaces control characters, except '\n', '\r' and '\b', with '?'
+ */
+static void
+suppress_ctrls_scalar (unsigned char *buffer, size_t size)
+{
+    size_t      i;
+
+    for (i = 0; i < size; i ++) {
+        if (buffer[i] < 0x20 ) {
+            switch (buffer[i]) {
+                case '\n':
+                case '\r':
+                case '\b':
+                    break;
+                default:
+                    buffer[i] = '?';
+            }
+        }
+    }
+}
+
+#ifdef  CTRLS_X86
+/*
+ * SSE2 version of suppress_ctrls_scalar()
+ */
+__attribute__((target("sse2")))
+static void
+suppress_ctrls_sse2 (unsigned char *buffer, size_t size)
+{
+    const __m128i       max = _mm_set1_epi8(0x1f);
+    const __m128i       nl = _mm_set1_epi8('\n');
+    const __m128i       cr = _mm_set1_epi8('\r');
+    const __m128i       bs = _mm_set1_epi8('\b');
+    const __m128i       q = _mm_set1_epi8('?');
+    size_t              i;
+
+    for (i = 0; i + 16 <= size; i += 16) {
+        __m128i v = _mm_loadu_si128((__m128i*) (buffer + i));
+        __m128i ctrl = _mm_cmpeq_epi8(_mm_min_epu8(v, max), v);
+        __m128i keep = _mm_or_si128(_mm_cmpeq_epi8(v, nl),
+                       _mm_or_si128(_mm_cmpeq_epi8(v, cr),
+                                    _mm_cmpeq_epi8(v, bs)));
+        __m128i mask = _mm_andnot_si128(keep, ctrl);
+
+        if (_mm_movemask_epi8(mask) != 0) {
+            v = _mm_or_si128(_mm_andnot_si128(mask, v),
+                             _mm_and_si128(mask, q));
+            _mm_storeu_si128((__m128i*) (buffer + i), v);
+        }
+    }
+
+    suppress_ctrls_scalar(buffer + i, size - i);
+}
+
+/*
+ * AVX2 version of suppress_ctrls_scalar()
+ */
+__attribute__((target("avx2")))
+static void
+suppress_ctrls_avx2 (unsigned char *buffer, size_t size)
+{
+    const __m256i       max = _mm256_set1_epi8(0x1f);
+    const __m256i       nl = _mm256_set1_epi8('\n');
+    const __m256i       cr = _mm256_set1_epi8('\r');
+    const __m256i       bs = _mm256_set1_epi8('\b');
+    const __m256i       q = _mm256_set1_epi8('?');
+    size_t              i;
+
+    for (i = 0; i + 32 <= size; i += 32) {
+        __m256i v = _mm256_loadu_si256((__m256i*) (buffer + i));
+        __m256i ctrl = _mm256_cmpeq_epi8(_mm256_min_epu8(v, max), v);
+        __m256i keep = _mm256_or_si256(_mm256_cmpeq_epi8(v, nl),
+                       _mm256_or_si256(_mm256_cmpeq_epi8(v, cr),
+                                       _mm256_cmpeq_epi8(v, bs)));
+        __m256i mask = _mm256_andnot_si256(keep, ctrl);
+
+        if (!_mm256_testz_si256(mask, mask)) {
+            v = _mm256_blendv_epi8(v, q, mask);
+            _mm256_storeu_si256((__m256i*) (buffer + i), v);
+        }
+    }
+
+    suppress_ctrls_sse2(buffer + i, size - i);
+}
+#endif
+
+#ifdef  CTRLS_NEON
+/*
+ * NEON version of suppress_ctrls_scalar()
+ */
+static void
+suppress_ctrls_neon (unsigned char *buffer, size_t size)
+{
+    const uint8x16_t    lim = vdupq_n_u8(0x20);
+    const uint8x16_t    nl = vdupq_n_u8('\n');
+    const uint8x16_t    cr = vdupq_n_u8('\r');
+    const uint8x16_t    bs = vdupq_n_u8('\b');
+    const uint8x16_t    q = vdupq_n_u8('?');
+    size_t              i;
+
+    for (i = 0; i + 16 <= size; i += 16) {
+        uint8x16_t v = vld1q_u8(buffer + i);
+        uint8x16_t keep = vorrq_u8(vceqq_u8(v, nl),
+                          vorrq_u8(vceqq_u8(v, cr), vceqq_u8(v, bs)));
+        uint8x16_t mask = vbicq_u8(vcltq_u8(v, lim), keep);
+
+        if (vmaxvq_u8(mask) != 0) {
+            vst1q_u8(buffer + i, vbslq_u8(mask, q, v));
+        }
+    }
+
+    suppress_ctrls_scalar(buffer + i, size - i);
+}
+#endif
+
+#ifdef  CTRLS_X86
+/*
+ * CPU features detection
+ */
+static bool
+cpu_has_avx2 (void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+static bool
+cpu_has_sse2 (void)
+{
+    return __builtin_cpu_supports("sse2");
+}
+#endif
+
+/*
+ * Implementations of suppress_ctrls(), best first
+ */
+static const struct {
+    const char  *name;                          /* For --self-test */
+    bool        (*supported)(void);             /* NULL if always */
+    void        (*func)(unsigned char*, size_t);/* Implementation */
+} suppress_ctrls_impls[] = {
+#ifdef  CTRLS_X86
+    {"avx2",    cpu_has_avx2,      suppress_ctrls_avx2},
+    {"sse2",    cpu_has_sse2,      suppress_ctrls_sse2},
+#endif
+#ifdef  CTRLS_NEON
+    {"neon",    NULL,              suppress_ctrls_neon},
+#endif
+    {"scalar",  NULL,              suppress_ctrls_scalar},
+};
+
+static void (*suppress_ctrls_func)(unsigned char*, size_t);
+
+/*
+ * Select the best suppress_ctrls() implementation, supported
+ * by CPU
+ */
+static void
+suppress_ctrls_init (void)
+{
+    size_t      i;
+
+    for (i = 0; suppress_ctrls_func == NULL; i ++) {
+        if (suppress_ctrls_impls[i].supported == NULL ||
+            suppress_ctrls_impls[i].supported()) {
+            suppress_ctrls_func = suppress_ctrls_impls[i].func;
+        }
+    }
+}
+
+/*
+ * Suppress control characters on input
+ *
+ * Modifies buffer in place and returns new size
+ */
+static size_t
 suppress_ctrls (unsigned char *buffer, size_t size)
 {
-    size_t      i;
+    suppress_ctrls_func(buffer, size);
+    return size;
+}
+
+/*
+ * Check every suppress_ctrls() implementation, supported by CPU,
+ * against the scalar one (--self-test, make check). Input is random,
+ * half of it control characters; all lengths around vector sizes are
+ * tried at every alignment, so both vector loops and scalar tails
+ * are covered. Returns count of failed implementations
+ */
+#define CTRLS_TEST_MAX          4096
+#define CTRLS_TEST_ROUNDS       8
+
+static int
+suppress_ctrls_selftest (void)
+{
+    static unsigned char    in[CTRLS_TEST_MAX + 64];
+    static unsigned char    want[CTRLS_TEST_MAX + 64];
+    static unsigned char    got[CTRLS_TEST_MAX + 64];
+    size_t                  n = sizeof(suppress_ctrls_impls) /
+                                sizeof(suppress_ctrls_impls[0]);
+    size_t                  i, len, off;
+    int                     round, failed = 0;
+
+    srand(1);
+
+    for (i = 0; i < n; i ++) {
+        const char  *name = suppress_ctrls_impls[i].name;
+        bool        ok = true;
+
+        if (suppress_ctrls_impls[i].supported != NULL &&
+            !suppress_ctrls_impls[i].supported()) {
+            printf("suppress_ctrls %-8s skipped, not supported by CPU\n",
+                name);
+            continue;
+        }
+
+        for (round = 0; ok && round < CTRLS_TEST_ROUNDS; round ++) {
+            for (len = 0; ok && len <= CTRLS_TEST_MAX;
+                 len += len < 160 ? 1 : 997) {
+                for (off = 0; ok && off < 32; off ++) {
+                    size_t  j;
+
+                    for (j = 0; j < len; j ++) {
+                        in[off + j] = rand() % 2 ? rand() % 0x20 : rand();
+                    }
+
+                    memcpy(want, in, off + len + 32);
+                    memcpy(got, in, off + len + 32);
+                    suppress_ctrls_scalar(want + off, len);
+                    suppress_ctrls_impls[i].func(got + off, len);
+
+                    /* Bytes around the buffer must be untouched too */
+                    if (memcmp(want, got, off + len + 32) != 0) {
+                        printf("suppress_ctrls %-8s FAILED, length %zu, "
+                            "offset %zu\n", name, len, off);
+                        ok = false;
+                    }
+                }
+            }
+        }
+
+        if (ok) {
+            printf("suppress_ctrls %-8s ok\n", name);
+        } else {
+            failed ++;
+        }
+    }
+
+    return failed;
+}
+
+/***** Hex dump *****/
+/*
+ * Hex dump formatter (--hex option). Rows look like hexdump -C,
+ * with the text column (wrapped here) at the end of the row:
+ *
+ *   00000010  48 65 6c 6c 6f 2c 20 77  6f 72 6c 64 0d 0a 00 ff
+ *             |Hello, world....|
+ *
+ * optionally prefixed with direction marker. Rows are rendered
+ * from the precomputed table, without printf()
+ *
+ * In the live mode partial row is shown immediately, and redrawn
+ * from its beginning (after '\r') when more data comes
+ */
+#define HEXD_ROW_SIZE           16
+#define HEXD_ROW_LEN            (3 + 8 + 2 + 3 * HEXD_ROW_SIZE + 1 + 2 + \
+                                 HEXD_ROW_SIZE + 1)
+#define HEXD_LINE_MAX           (1 + HEXD_ROW_LEN + 2)
+#define HEXD_MAX_LEN(size)      (((size) / HEXD_ROW_SIZE + 2) * HEXD_LINE_MAX)
+
+typedef struct {
+    const char          *marker;        /* Direction marker, NULL if none */
+    bool                live;           /* Live mode */
+    const char          *eol;           /* End of line */
+    uint64_t            offset;         /* Offset of current row */
+    unsigned char       row[HEXD_ROW_SIZE]; /* Current row */
+    size_t              fill;           /* Bytes in current row */
+    bool                shown;          /* Partial row is on screen */
+} hexd;
+
+static const char hexd_digits[] = "0123456789abcdef";
+
+static struct {
+    char                hex[2];         /* Two hex digits */
+    char                ascii;          /* Printable form */
+} hexd_table[256];
+
+/*
+ * Fill hex dump table
+ */
+static void
+hexd_init (void)
+{
+    int         c;
+
+    for (c = 0; c < 256; c ++) {
+        hexd_table[c].hex[0] = hexd_digits[c >> 4];
+        hexd_table[c].hex[1] = hexd_digits[c & 0xf];
+        hexd_table[c].ascii = 0x20 <= c && c < 0x7f ? c : '.';
+    }
+}
+
+/*
+ * Start hex dump. marker is the 2-character direction marker,
+ * NULL if none
+ */
+static void
+hexd_start (hexd *h, const char *marker, bool live)
+{
+    memset(h, 0, sizeof(*h));
+    h->marker = marker;
+    h->live = live;
+    h->eol = live ? "\r\n" : "\n";
+}
+
+/*
+ * Render current row. Returns its length
+ */
+static size_t
+hexd_row (hexd *h, unsigned char *out)
+{
+    unsigned char       *p = out, *hex, *ascii;
+    uint64_t            off = h->offset;
+    size_t              i;
+
+    if (h->marker != NULL) {
+        memcpy(p, h->marker, 2);
+        p[2] = ' ';
+        p += 3;
+    }
+
+    for (i = 8; i > 0; i --) {
+        p[i - 1] = hexd_digits[off & 0xf];
+        off >>= 4;
+    }
+    p += 8;
+
+    /* Blank hex area, then fill it */
+    hex = p + 2;
+    ascii = hex + 3 * HEXD_ROW_SIZE + 1 + 2;
+    memset(p, ' ', (size_t) (ascii - p));
+    ascii[-1] = '|';
+
+    for (i = 0; i < h->fill; i ++) {
+        unsigned char   c = h->row[i];
+
+        memcpy(hex + 3 * i + (i >= HEXD_ROW_SIZE / 2), hexd_table[c].hex, 2);
+        ascii[i] = hexd_table[c].ascii;
+    }
+
+    ascii[i] = '|';
+
+    return (size_t) (ascii + i + 1 - out);
+}
+
+/*
+ * Format data as hex dump rows, continuing current row.
+ * Output buffer must have room for HEXD_MAX_LEN(size) bytes.
+ * Returns output length
+ */
+static size_t
+hexd_format (hexd *h, const unsigned char *in, size_t size,
+        unsigned char *out)
+{
+    unsigned char       *start = out;
+
+    while (size != 0) {
+        size_t          n = HEXD_ROW_SIZE - h->fill;
+
+        n = n < size ? n : size;
+        memcpy(h->row + h->fill, in, n);
+        h->fill += n;
+        in += n;
+        size -= n;
+
+        if (h->fill != HEXD_ROW_SIZE && !h->live) {
+            break;
+        }
+
+        if (h->shown) {
+            *out ++ = '\r';
+        }
+
+        out += hexd_row(h, out);
+
+        if (h->fill == HEXD_ROW_SIZE) {
+            memcpy(out, h->eol, strlen(h->eol));
+            out += strlen(h->eol);
+            h->offset += HEXD_ROW_SIZE;
+            h->fill = 0;
+            h->shown = false;
+        } else {
+            h->shown = true;
+        }
+    }
+
+    return (size_t) (out - start);
+}
+
+/*
+ * Finish current partial row, if any. Returns output length
+ */
+static size_t
+hexd_flush (hexd *h, unsigned char *out)
+{
+    size_t      len = 0;
+
+    if (h->fill != 0) {
+        if (h->shown) {
+            out[len ++] = '\r';
+        }
+
+        len += hexd_row(h, out + len);
+        memcpy(out + len, h->eol, strlen(h->eol));
+        len += strlen(h->eol);
+
+        h->offset += h->fill;
+        h->fill = 0;
+        h->shown = false;
+    }
+
+    return len;
+}
+
+/***** Pattern triggers *****/
+/*
+ * Triggers (--on pattern=action) are compiled into a single
+ * Aho-Corasick automaton with the full transition table, so
+ * scanning costs one table lookup per received byte, regardless
+ * of count of patterns. Automaton state is kept by the caller,
+ * so patterns are matched across read() chunk boundaries
+ *
+ * To keep the table small, bytes are mapped into classes: each
+ * byte that appears in patterns gets own class, all other bytes
+ * share class 0
+ */
+typedef enum {
+    TRIG_SEND,          /* Send string to the line */
+    TRIG_MARK,          /* Write mark into the tee file */
+    TRIG_EXIT           /* Exit with code */
+} trig_action;
+
+typedef struct {
+    const char          *source;        /* Pattern, as specified */
+    unsigned char       *pattern;       /* Unescaped pattern */
+    size_t              len;            /* Pattern length */
+    trig_action         action;         /* Action */
+    unsigned char       *arg;           /* Action string, unescaped */
+    size_t              arg_len;        /* Its length */
+    int                 code;           /* TRIG_EXIT: exit code */
+    int                 next;           /* Next rule of the same state */
+} trig_rule;
+
+/*
+ * Trigger callback, called for each matched rule
+ */
+typedef void (*trig_func)(void *data, const trig_rule *rule);
+
+static struct {
+    trig_rule           *rules;         /* Rules */
+    int                 nrules;         /* Count of rules */
+    uint16_t            cls[256];       /* Byte classes, up to 256 + 1 */
+    size_t              ncls;           /* Count of classes */
+    uint32_t            *delta;         /* Transitions, [state][class] */
+    uint32_t            *term;          /* State or its suffix with rules */
+    uint32_t            *dict;          /* Next proper suffix with rules */
+    int                 *own;           /* First rule ending at state */
+} trig;
+
+/*
+ * Unescape pattern or action string. Understands \n, \r, \t, \e,
+ * \xHH and \ before any other character, which is taken literally.
+ * Unescaping stops at the first unescaped stop character, if any.
+ * Returns pointer to stop character or to the end of string
+ */
+static const char*
+trig_unescape (const char *s, char stop, unsigned char *out, size_t *len)
+{
+    size_t      n = 0;
+
+    while (*s && *s != stop) {
+        unsigned char   c = (unsigned char) *s ++;
+
+        if (c == '\\' && *s) {
+            c = (unsigned char) *s ++;
+            switch (c) {
+            case 'n':
+                c = '\n';
+                break;
+
+            case 'r':
+                c = '\r';
+                break;
+
+            case 't':
+                c = '\t';
+                break;
+
+            case 'e':
+                c = 0x1b;
+                break;
+
+            case 'x':
+                if (isxdigit((unsigned char) s[0]) &&
+                    isxdigit((unsigned char) s[1])) {
+                    char    hex[3] = {s[0], s[1], '\0'};
+                    c = (unsigned char) strtoul(hex, NULL, 16);
+                    s += 2;
+                }
+                break;
+            }
+        }
+
+        out[n ++] = c;
+    }
+
+    *len = n;
+    return s;
+}
+
+/*
+ * Parse trigger rule, pattern=action
+ */
+static void
+trig_parse (const char *s, trig_rule *rule)
+{
+    const char  *act;
+    size_t      len;
+
+    rule->source = s;
+    rule->pattern = mem_alloc(strlen(s) + 1);
+    act = trig_unescape(s, '=', rule->pattern, &rule->len);
+
+    if (rule->len == 0 || *act != '=') {
+        usage_error("invalid trigger -- %s", s);
+    }
+
+    act ++;
+    len = strcspn(act, ":");
+
+    if (len == 4 && !strncasecmp(act, "send", len)) {
+        rule->action = TRIG_SEND;
+    } else if (len == 4 && !strncasecmp(act, "mark", len)) {
+        rule->action = TRIG_MARK;
+    } else if (len == 4 && !strncasecmp(act, "exit", len)) {
+        rule->action = TRIG_EXIT;
+    } else {
+        usage_error("invalid trigger action -- %s", act);
+    }
+
+    if (act[len] == ':') {
+        rule->arg = mem_alloc(strlen(act) + 1);
+        trig_unescape(act + len + 1, '\0', rule->arg, &rule->arg_len);
+    }
+
+    switch (rule->action) {
+    case TRIG_SEND:
+        if (rule->arg_len == 0) {
+            usage_error("send trigger needs string -- %s", s);
+        }
+
+        /* It goes to con2tty at once, see uterm_trig_flush() */
+        if (rule->arg_len > opt_ring_size) {
+            usage_error("send string is longer than ring buffer -- %s", s);
+        }
+        break;
+
+    case TRIG_MARK:
+        if (opt_tee_file == NULL) {
+            usage_error("mark trigger requires -t -- %s", s);
+        }
+
+        if (rule->arg == NULL) {
+            rule->arg = (unsigned char*) mem_strdup(s);
+            rule->arg_len = (size_t) (act - 1 - s);
+        }
+        break;
+
+    case TRIG_EXIT:
+        if (rule->arg != NULL) {
+            rule->code = parse_int((char*) rule->arg, 0, 255, "exit code");
+        }
+        break;
+    }
+}
+
+/*
+ * Compile triggers (opt_triggers) into the automaton
+ */
+static void
+trig_init (void)
+{
+    size_t      nstates = 1, max_states = 1, c, s, t;
+    uint32_t    *fail, *queue;
+    size_t      head = 0, tail = 0;
+    int         i;
+
+    if (opt_ntriggers == 0) {
+        return;
+    }
+
+    trig.nrules = opt_ntriggers;
+    trig.rules = mem_alloc(trig.nrules * sizeof(*trig.rules));
+
+    /* Parse rules and assign byte classes */
+    trig.ncls = 1;
+    for (i = 0; i < trig.nrules; i ++) {
+        trig_rule   *rule = &trig.rules[i];
+        size_t      j;
+
+        trig_parse(opt_triggers[i], rule);
+        max_states += rule->len;
+
+        for (j = 0; j < rule->len; j ++) {
+            if (trig.cls[rule->pattern[j]] == 0) {
+                trig.cls[rule->pattern[j]] = (uint16_t) trig.ncls ++;
+            }
+        }
+    }
+
+    trig.delta = mem_alloc(max_states * trig.ncls * sizeof(*trig.delta));
+    trig.term = mem_alloc(max_states * sizeof(*trig.term));
+    trig.dict = mem_alloc(max_states * sizeof(*trig.dict));
+    trig.own = mem_alloc(max_states * sizeof(*trig.own));
+    fail = mem_alloc(max_states * sizeof(*fail));
+    queue = mem_alloc(max_states * sizeof(*queue));
+
+    for (s = 0; s < max_states; s ++) {
+        trig.own[s] = -1;
+    }
+
+    /* Build trie. Value 0 means no transition, as root is nobody's child.
+     * Rules are inserted backwards, so own lists go in the rules order */
+    for (i = trig.nrules - 1; i >= 0; i --) {
+        trig_rule   *rule = &trig.rules[i];
+        size_t      j;
+
+        for (s = 0, j = 0; j < rule->len; j ++) {
+            uint32_t    *d = &trig.delta[s * trig.ncls +
+                                         trig.cls[rule->pattern[j]]];
+
+            if (*d == 0) {
+                *d = (uint32_t) nstates ++;
+            }
+            s = *d;
+        }
+
+        rule->next = trig.own[s];
+        trig.own[s] = i;
+    }
+
+    /* Breadth-first pass: compute failure links and make the table
+     * complete. Missed transitions of root already lead to root */
+    for (c = 0; c < trig.ncls; c ++) {
+        if ((t = trig.delta[c]) != 0) {
+            trig.term[t] = trig.own[t] >= 0 ? (uint32_t) t : 0;
+            queue[tail ++] = (uint32_t) t;
+        }
+    }
+
+    while (head != tail) {
+        s = queue[head ++];
+
+        for (c = 0; c < trig.ncls; c ++) {
+            uint32_t    *d = &trig.delta[s * trig.ncls + c];
+            uint32_t    f = trig.delta[fail[s] * trig.ncls + c];
+
+            if (*d == 0) {
+                *d = f;
+                continue;
+            }
+
+            t = *d;
+            fail[t] = f;
+            trig.dict[t] = trig.term[f];
+            trig.term[t] = trig.own[t] >= 0 ? (uint32_t) t : trig.dict[t];
+            queue[tail ++] = (uint32_t) t;
+        }
+    }
+
+    mem_free(fail);
+    mem_free(queue);
+}
+
+/*
+ * Scan received data for triggers. *state is the automaton state,
+ * initially 0. func is called for each matched rule
+ */
+static void
+trig_scan (unsigned int *state, const unsigned char *data, size_t size,
+        trig_func func, void *arg)
+{
+    const uint32_t      *delta = trig.delta;
+    const uint16_t      *cls = trig.cls;
+    size_t              ncls = trig.ncls, i;
+    uint32_t            s = *state;
+
+    for (i = 0; i < size; i ++) {
+        s = delta[s * ncls + cls[data[i]]];
+
+        if (trig.term[s] != 0) {
+            uint32_t    t;
+            int         r;
+
+            for (t = trig.term[s]; t != 0; t = trig.dict[t]) {
+                for (r = trig.own[t]; r >= 0; r = trig.rules[r].next) {
+                    func(arg, &trig.rules[r]);
+                }
+            }
+        }
+    }
+
+    *state = s;
+}
+
+/*
+ * Check the automaton against memmem() (--self-test, make check).
+ * Patterns overlap, share suffixes and repeat. Random text over their
+ * alphabet is scanned whole, byte by byte, split at every position
+ * and in random chunks; matches must come in the same order each
+ * time: by end position, then longer patterns first, then in rules
+ * order. Returns count of failed cases
+ */
+#define TRIG_TEST_LEN           512
+#define TRIG_TEST_ROUNDS        16
+#define TRIG_TEST_MATCHES       (TRIG_TEST_LEN * 16)
+
+static char *trig_test_rules[] = {
+    "he=exit", "she=exit", "his=exit", "hers=exit", "aab=exit",
+    "ab=exit", "b=exit", "abab=exit", "bb=exit", "he=exit:1"
+};
+
+static struct {
+    int                 rule[TRIG_TEST_MATCHES]; /* Matched rules */
+    size_t              end[TRIG_TEST_MATCHES];  /* Their end positions */
+    size_t              n;              /* Count of matches */
+    size_t              pos;            /* Bytes scanned */
+} trig_test;
+
+static void
+trig_test_match (void *data, const trig_rule *rule)
+{
+    (void) data;
+
+    if (trig_test.n < TRIG_TEST_MATCHES) {
+        trig_test.rule[trig_test.n] = (int) (rule - trig.rules);
+        trig_test.end[trig_test.n] = trig_test.pos;
+    }
+    trig_test.n ++;
+}
+
+static int
+trig_selftest (void)
+{
+    static int          want_rule[TRIG_TEST_MATCHES];
+    static size_t       want_end[TRIG_TEST_MATCHES];
+    static const char   alpha[] = "abhesrix";
+    unsigned char       text[TRIG_TEST_LEN];
+    size_t              nwant, i, k, split;
+    int                 round, r, failed = 0;
+
+    opt_triggers = trig_test_rules;
+    opt_ntriggers = sizeof(trig_test_rules) / sizeof(trig_test_rules[0]);
+    trig_init();
+    srand(1);
+
+    for (round = 0; round < TRIG_TEST_ROUNDS; round ++) {
+        unsigned int    state;
+
+        for (i = 0; i < TRIG_TEST_LEN; i ++) {
+            text[i] = alpha[rand() % (sizeof(alpha) - 1)];
+        }
+
+        /* Naive scan: every occurrence of every pattern, sorted */
+        nwant = 0;
+        for (r = 0; r < trig.nrules; r ++) {
+            const trig_rule     *rule = &trig.rules[r];
+            const unsigned char *p = text;
+
+            while ((p = memmem(p, text + TRIG_TEST_LEN - p,
+                               rule->pattern, rule->len)) != NULL) {
+                size_t  end = p - text + rule->len;
+
+                for (k = nwant; k > 0 && (want_end[k - 1] > end ||
+                     (want_end[k - 1] == end &&
+                      trig.rules[want_rule[k - 1]].len < rule->len)); k --) {
+                    want_end[k] = want_end[k - 1];
+                    want_rule[k] = want_rule[k - 1];
+                }
+                want_end[k] = end;
+                want_rule[k] = r;
+                nwant ++;
+                p ++;
+            }
+        }
+
+        /* split 0 is the whole text, split TRIG_TEST_LEN + 1 is byte
+         * by byte, the next one is random chunks */
+        for (split = 0; split <= TRIG_TEST_LEN + 2; split ++) {
+            bool    ok;
+
+            state = 0;
+            trig_test.n = 0;
+            trig_test.pos = 0;
+
+            if (split <= TRIG_TEST_LEN) {
+                trig_scan(&state, text, split, trig_test_match, NULL);
+                trig_scan(&state, text + split, TRIG_TEST_LEN - split,
+                    trig_test_match, NULL);
+            } else {
+                for (i = 0; i < TRIG_TEST_LEN; i += k) {
+                    k = split == TRIG_TEST_LEN + 1 ? 1 : 1 + rand() % 37;
+                    k = k < TRIG_TEST_LEN - i ? k : TRIG_TEST_LEN - i;
+                    trig_test.pos = i + k;
+                    trig_scan(&state, text + i, k, trig_test_match, NULL);
+                }
+            }
+
+            ok = trig_test.n == nwant;
+            for (i = 0; ok && i < nwant; i ++) {
+                ok = trig_test.rule[i] == want_rule[i];
+
+                /* End position is known, when chunk is a single byte */
+                if (split == TRIG_TEST_LEN + 1) {
+                    ok = ok && trig_test.end[i] == want_end[i];
+                }
+            }
+
+            if (!ok) {
+                printf("triggers FAILED, round %d, split %zu, %zu matches "
+                    "of %zu\n", round, split, trig_test.n, nwant);
+                failed ++;
+                break;
+            }
+        }
+    }
+
+    if (failed == 0) {
+        printf("triggers ok\n");
+    }
+
+    return failed;
+}
+
+/***** Scrollback *****/
+/*
+ * scrollback keeps recent console output for the in-session
+ * search (--scrollback)
+ *
+ * Data is kept in a byte ring. Positions are absolute offsets since
+ * start, so they stay valid while the ring moves on. Start offsets
+ * of lines are kept in another ring, the line index: line n starts
+ * at lines[n % nlines_max]. So line of any position is found by the
+ * binary search, and jumping to a match doesn't depend on how much
+ * history is kept. Line, partially overwritten in the data ring,
+ * starts at the oldest data
+ *
+ * Search goes backward by blocks of SB_BLOCK. Each block, with the
+ * tail, long enough for a match that crosses to the next block,
+ * is copied out of the ring and scanned with memmem()
+ */
+#define SB_BLOCK                65536
+#define SB_QUERY_MAX            64
+#define SB_LINE_AVG             32
+#define SB_LINES_MIN            1024
+
+typedef struct {
+    unsigned char       *data;          /* Data ring */
+    size_t              size;           /* Its size, 0 if disabled */
+    uint64_t            end;            /* Offset of the end of data */
+    uint64_t            *lines;         /* Line index ring */
+    size_t              nlines_max;     /* Its size */
+    uint64_t            first;          /* Oldest line in the index */
+    uint64_t            next;           /* Next line to start */
+    unsigned char       *tmp;           /* Search block */
+} scrollback;
+
+/*
+ * Initialize the scrollback
+ */
+static void
+sb_init (scrollback *sb, size_t size)
+{
+    sb->data = mem_alloc(size);
+    sb->size = size;
+    sb->nlines_max = size / SB_LINE_AVG;
+    sb->nlines_max = sb->nlines_max > SB_LINES_MIN ?
+        sb->nlines_max : SB_LINES_MIN;
+    sb->lines = mem_alloc(sb->nlines_max * sizeof(*sb->lines));
+    sb->tmp = mem_alloc(SB_BLOCK + SB_QUERY_MAX);
+    sb->next = 1;
+}
+
+/*
+ * Get offset of the oldest data
+ */
+static inline uint64_t
+sb_start (const scrollback *sb)
+{
+    return sb->end > sb->size ? sb->end - sb->size : 0;
+}
+
+/*
+ * Get start of the line
+ */
+static inline uint64_t
+sb_line_start (const scrollback *sb, uint64_t n)
+{
+    uint64_t    off = sb->lines[n % sb->nlines_max];
+    uint64_t    start = sb_start(sb);
+
+    return off > start ? off : start;
+}
+
+/*
+ * Get end of the line
+ */
+static inline uint64_t
+sb_line_end (const scrollback *sb, uint64_t n)
+{
+    return n + 1 < sb->next ? sb->lines[(n + 1) % sb->nlines_max] : sb->end;
+}
+
+/*
+ * Append data to the scrollback
+ */
+static void
+sb_put (scrollback *sb, const unsigned char *data, size_t size)
+{
+    const unsigned char *p = data, *end = data + size;
+    uint64_t            off = sb->end;
+    uint64_t            start;
+
+    /* Index line starts */
+    while ((p = memchr(p, '\n', end - p)) != NULL) {
+        p ++;
+        sb->lines[sb->next % sb->nlines_max] = off + (p - data);
+        sb->next ++;
+    }
+
+    /* Copy data; only its tail, if it is larger than the ring */
+    if (size > sb->size) {
+        data += size - sb->size;
+        off += size - sb->size;
+        size = sb->size;
+    }
+
+    while (size != 0) {
+        size_t  pos = off % sb->size;
+        size_t  n = sb->size - pos;
+
+        n = n < size ? n : size;
+        memcpy(sb->data + pos, data, n);
+        data += n;
+        off += n;
+        size -= n;
+    }
+
+    sb->end = off;
+
+    /* Drop lines that are out of the index or out of the data */
+    start = sb_start(sb);
+    if (sb->next - sb->first > sb->nlines_max) {
+        sb->first = sb->next - sb->nlines_max;
+    }
+
+    while (sb->first + 1 < sb->next && sb_line_end(sb, sb->first) <= start) {
+        sb->first ++;
+    }
+}
+
+/*
+ * Copy data out of the scrollback
+ */
+static void
+sb_copy (const scrollback *sb, uint64_t off, unsigned char *out, size_t size)
+{
+    while (size != 0) {
+        size_t  pos = off % sb->size;
+        size_t  n = sb->size - pos;
+
+        n = n < size ? n : size;
+        memcpy(out, sb->data + pos, n);
+        out += n;
+        off += n;
+        size -= n;
+    }
+}
+
+/*
+ * Find the line of the position
+ */
+static uint64_t
+sb_line (const scrollback *sb, uint64_t off)
+{
+    uint64_t    lo = sb->first, hi = sb->next - 1;
+
+    while (lo < hi) {
+        uint64_t    mid = lo + (hi - lo + 1) / 2;
+
+        if (sb->lines[mid % sb->nlines_max] <= off) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    return lo;
+}
+
+/*
+ * Find the last match of query that ends at or before hi.
+ * Returns its offset, or UINT64_MAX if not found
+ */
+static uint64_t
+sb_find_last (scrollback *sb, const char *query, size_t len, uint64_t hi)
+{
+    uint64_t    lo = sb_line_start(sb, sb->first);
+    uint64_t    stop;
+
+    if (len == 0 || hi < lo + len) {
+        return UINT64_MAX;
+    }
+
+    /* Matches start at [lo, stop) */
+    stop = hi - len + 1;
+    while (stop > lo) {
+        uint64_t        from = stop - lo > SB_BLOCK ? stop - SB_BLOCK : lo;
+        size_t          n = stop - from + len - 1;
+        unsigned char   *p = sb->tmp, *found = NULL;
+
+        sb_copy(sb, from, sb->tmp, n);
+
+        while ((p = memmem(p, sb->tmp + n - p, query, len)) != NULL) {
+            found = p ++;
+        }
+
+        if (found != NULL) {
+            return from + (found - sb->tmp);
+        }
+
+        stop = from;
+    }
+
+    return UINT64_MAX;
+}
+
+/***** Ring buffer *****/
+/*
+ * ring is a lock-free single-producer/single-consumer ring buffer
+ *
+ * Size is always a power of two. Head and tail are free-running
+ * counters; head is owned by consumer, tail is owned by producer.
+ * Each side publishes its counter with release semantics and reads
+ * counter of the opposite side with acquire semantics, so producer
+ * and consumer may safely live in different threads
+ */
+typedef struct {
+    unsigned char               *data;  /* Buffer memory */
+    size_t                      size;   /* Buffer size, power of 2 */
+    _Alignas(64) atomic_size_t  head;   /* Consumer position */
+    _Alignas(64) atomic_size_t  tail;   /* Producer position */
+    size_t                      hwm;    /* High-water mark, producer */
+} ring;
+
+/*
+ * Initialize the ring
+ */
+static void
+ring_init (ring *r, size_t size)
+{
+    r->data = mem_alloc(size);
+    r->size = size;
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    r->hwm = 0;
+}
+
+/*
+ * Get count of bytes in the ring (consumer side)
+ */
+static inline size_t
+ring_count (ring *r)
+{
+    return atomic_load_explicit(&r->tail, memory_order_acquire) -
+           atomic_load_explicit(&r->head, memory_order_relaxed);
+}
+
+/*
+ * Get free space in the ring (producer side)
+ */
+static inline size_t
+ring_space (ring *r)
+{
+    return r->size -
+           (atomic_load_explicit(&r->tail, memory_order_relaxed) -
+            atomic_load_explicit(&r->head, memory_order_acquire));
+}
+
+/*
+ * Get contiguous free region at the ring tail (producer side).
+ * Returns region size and sets *ptr to its beginning
+ */
+static inline size_t
+ring_write_ptr (ring *r, unsigned char **ptr)
+{
+    size_t      tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    size_t      off = tail & (r->size - 1);
+    size_t      space = ring_space(r);
+
+    *ptr = r->data + off;
+    return space < r->size - off ? space : r->size - off;
+}
+
+/*
+ * Commit count bytes, written at the ring tail (producer side)
+ */
+static inline void
+ring_produce (ring *r, size_t count)
+{
+    size_t      tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    size_t      used;
+
+    atomic_store_explicit(&r->tail, tail + count, memory_order_release);
+
+    used = r->size - ring_space(r);
+    if (used > r->hwm) {
+        r->hwm = used;
+    }
+}
+
+/*
+ * Get contiguous region of data at the ring head (consumer side).
+ * Returns region size and sets *ptr to its beginning
+ */
+static inline size_t
+ring_read_ptr (ring *r, unsigned char **ptr)
+{
+    size_t      head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t      off = head & (r->size - 1);
+    size_t      count = ring_count(r);
+
+    *ptr = r->data + off;
+    return count < r->size - off ? count : r->size - off;
+}
+
+/*
+ * Release count bytes at the ring head (consumer side)
+ */
+static inline void
+ring_consume (ring *r, size_t count)
+{
+    size_t      head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+    atomic_store_explicit(&r->head, head + count, memory_order_release);
+}
+
+/***** Tee file segments *****/
+/*
+ * tee_segments writes the tee file, rotating it by size and/or
+ * time and optionally compressing it. It runs on the asynchronous
+ * writer thread (see below), so neither rename(), nor compression
+ * ever block the serial line
+ *
+ * The current segment is always written under the tee file name;
+ * on rotation it is renamed into file.N (file.N.zst, .lz4 or .gz,
+ * if compressed), with N growing and never reused, and the new
+ * segment is started
+ *
+ * Compression works in large blocks: data is collected into
+ * SEG_COMPRESS_BLOCK bytes buffer and compressed at once. Each
+ * segment is the complete compressed stream. When data stops
+ * coming for SEG_FLUSH_NS, compressor is flushed, so the tail
+ * of the log is readable without waiting for the next block.
+ * Block is capped at the size limit, which is checked after each
+ * block, so compressed segment may exceed the limit by up to one
+ * compressed block, not by SEG_COMPRESS_BLOCK
+ */
+typedef struct {
+    int                 fd;             /* Current segment file */
+    const char          *name;          /* Tee file name */
+    uint64_t            max_size;       /* Max segment size, 0 if none */
+    uint64_t            interval;       /* Rotate interval, ns, 0 if none */
+    uint64_t            size;           /* Bytes written into segment */
+    uint64_t            started;        /* Segment start time */
+    unsigned            next;           /* Next segment N, 0 if unknown */
+    seg_compress        method;         /* Compression method */
+    bool                stream;         /* Compressed stream started */
+    bool                dirty;          /* Has unflushed data */
+    unsigned char       *in;            /* Data to be compressed */
+    size_t              in_len;         /* Bytes in the in buffer */
+    size_t              block;          /* Size of the in buffer */
+    unsigned char       *out;           /* Compressed data */
+    size_t              out_size;       /* Size of the out buffer */
+#ifdef  HAVE_ZSTD
+    ZSTD_CCtx           *zstd;          /* zstd context */
+#endif
+#ifdef  HAVE_LZ4
+    LZ4F_cctx           *lz4;           /* lz4 context */
+#endif
+#ifdef  HAVE_ZLIB
+    z_stream            zlib;           /* zlib stream */
+#endif
+} tee_segments;
+
+/*
+ * Compressor operations
+ */
+typedef enum {
+    SEG_CONTINUE,       /* Compress, output is optional */
+    SEG_FLUSH,          /* Compress and flush all output */
+    SEG_END             /* Compress and end the stream */
+} seg_op;
+
+/*
+ * Write data into the current segment file
+ */
+static void
+seg_output (tee_segments *seg, const void *data, size_t size)
+{
+    while (size != 0) {
+        ssize_t rc = write(seg->fd, data, size);
+
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            panic_perror( "write(%s)", seg->name );
+        }
+
+        data = (const char*) data + rc;
+        size -= rc;
+        seg->size += rc;
+    }
+}
+
+#ifdef  HAVE_ZSTD
+/*
+ * Compress input with zstd
+ */
+static void
+seg_compress_zstd (tee_segments *seg, seg_op op)
+{
+    ZSTD_EndDirective   mode = op == SEG_END ? ZSTD_e_end :
+                               op == SEG_FLUSH ? ZSTD_e_flush :
+                               ZSTD_e_continue;
+    ZSTD_inBuffer       in = {seg->in, seg->in_len, 0};
+    size_t              rc;
+
+    do {
+        ZSTD_outBuffer  out = {seg->out, seg->out_size, 0};
+
+        rc = ZSTD_compressStream2(seg->zstd, &out, &in, mode);
+        if (ZSTD_isError(rc)) {
+            panic( "%s: zstd: %s", seg->name, ZSTD_getErrorName(rc) );
+        }
+
+        seg_output(seg, seg->out, out.pos);
+    } while (mode == ZSTD_e_continue ? in.pos != in.size : rc != 0);
+}
+#endif
+
+#ifdef  HAVE_LZ4
+/*
+ * Compress input with lz4
+ */
+static void
+seg_compress_lz4 (tee_segments *seg, seg_op op)
+{
+    size_t      rc;
+
+    if (!seg->stream) {
+        rc = LZ4F_compressBegin(seg->lz4, seg->out, seg->out_size, NULL);
+        if (LZ4F_isError(rc)) {
+            goto ERROR;
+        }
+        seg_output(seg, seg->out, rc);
+    }
+
+    if (seg->in_len != 0) {
+        rc = LZ4F_compressUpdate(seg->lz4, seg->out, seg->out_size,
+            seg->in, seg->in_len, NULL);
+        if (LZ4F_isError(rc)) {
+            goto ERROR;
+        }
+        seg_output(seg, seg->out, rc);
+    }
+
+    if (op != SEG_CONTINUE) {
+        if (op == SEG_END) {
+            rc = LZ4F_compressEnd(seg->lz4, seg->out, seg->out_size, NULL);
+        } else {
+            rc = LZ4F_flush(seg->lz4, seg->out, seg->out_size, NULL);
+        }
+        if (LZ4F_isError(rc)) {
+            goto ERROR;
+        }
+        seg_output(seg, seg->out, rc);
+    }
+
+    return;
+
+ERROR:
+    panic( "%s: lz4: %s", seg->name, LZ4F_getErrorName(rc) );
+}
+#endif
+
+#ifdef  HAVE_ZLIB
+/*
+ * Compress input with zlib
+ */
+static void
+seg_compress_gzip (tee_segments *seg, seg_op op)
+{
+    int     flush = op == SEG_END ? Z_FINISH :
+                    op == SEG_FLUSH ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+    int     rc;
+
+    seg->zlib.next_in = seg->in;
+    seg->zlib.avail_in = seg->in_len;
+
+    do {
+        seg->zlib.next_out = seg->out;
+        seg->zlib.avail_out = seg->out_size;
+
+        rc = deflate(&seg->zlib, flush);
+        if (rc == Z_STREAM_ERROR) {
+            panic( "%s: zlib: deflate() failed", seg->name );
+        }
+
+        seg_output(seg, seg->out, seg->out_size - seg->zlib.avail_out);
+    } while (seg->zlib.avail_out == 0 ||
+             (flush == Z_FINISH && rc != Z_STREAM_END));
+
+    if (op == SEG_END) {
+        deflateReset(&seg->zlib);
+    }
+}
+#endif
+
+/*
+ * Compress accumulated input
+ */
+static void
+seg_compress_block (tee_segments *seg, seg_op op)
+{
+    if (!seg->stream && seg->in_len == 0) {
+        return; /* Nothing written into segment */
+    }
+
+    switch (seg->method) {
+    case SEG_COMPRESS_NONE:
+        break;
+#ifdef  HAVE_ZSTD
+    case SEG_COMPRESS_ZSTD:
+        seg_compress_zstd(seg, op);
+        break;
+#endif
+#ifdef  HAVE_LZ4
+    case SEG_COMPRESS_LZ4:
+        seg_compress_lz4(seg, op);
+        break;
+#endif
+#ifdef  HAVE_ZLIB
+    case SEG_COMPRESS_GZIP:
+        seg_compress_gzip(seg, op);
+        break;
+#endif
+    default:
+        break;
+    }
+
+    seg->in_len = 0;
+    seg->stream = op != SEG_END;
+    seg->dirty = false;
+}
+
+/*
+ * Get size of the compressed output buffer
+ */
+static size_t
+seg_out_size (seg_compress method)
+{
+#ifdef  HAVE_LZ4
+    if (method == SEG_COMPRESS_LZ4) {
+        return LZ4F_compressBound(SEG_COMPRESS_BLOCK, NULL);
+    }
+#endif
+
+    (void) method;
+    return SEG_COMPRESS_OUT;
+}
+
+/*
+ * Estimate memory, allocated by the compression library through
+ * mem_alloc(). lz4 uses malloc(), see seg_lib_heap()
+ */
+static size_t
+seg_state_size (seg_compress method)
+{
+    switch (method) {
+#ifdef  HAVE_ZSTD
+    case SEG_COMPRESS_ZSTD:
+        return ZSTD_estimateCStreamSize(ZSTD_CLEVEL_DEFAULT);
+#endif
+#ifdef  HAVE_ZLIB
+    case SEG_COMPRESS_GZIP:
+        /* Per zlib docs for windowBits 15 and memLevel 8, plus state */
+        return (1 << (15 + 2)) + (1 << (8 + 9)) + 16384;
+#endif
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Estimate memory, allocated by the compression library with
+ * malloc(), outside of the arena. lz4 frame context with default
+ * preferences: 64 KB block, 64 KB of linked blocks history and
+ * the LZ4_stream_t state, allocated on the first block
+ */
+static size_t
+seg_lib_heap (seg_compress method)
+{
+    switch (method) {
+#ifdef  HAVE_LZ4
+    case SEG_COMPRESS_LZ4:
+        return 64 * 1024 + 64 * 1024 + 16 * 1024 + 1024;
+#endif
+    default:
+        return 0;
+    }
+}
+
+#ifdef  HAVE_ZSTD
+/*
+ * zstd allocator, so library state is counted by mem_alloc()
+ */
+static void*
+seg_zstd_alloc (void *opaque, size_t size)
+{
+    (void) opaque;
+    return mem_alloc(size);
+}
+
+/*
+ * zstd deallocator
+ */
+static void
+seg_zstd_free (void *opaque, void *p)
+{
+    (void) opaque;
+    mem_free(p);
+}
+#endif
+
+#ifdef  HAVE_ZLIB
+/*
+ * zlib allocator, so library state is counted by mem_alloc()
+ */
+static voidpf
+seg_zlib_alloc (voidpf opaque, uInt items, uInt size)
+{
+    (void) opaque;
+    return mem_alloc((size_t) items * size);
+}
+
+/*
+ * zlib deallocator
+ */
+static void
+seg_zlib_free (voidpf opaque, voidpf p)
+{
+    (void) opaque;
+    mem_free(p);
+}
+#endif
+
+/*
+ * Initialize segments writer. fd is the already opened tee file
+ */
+static void
+seg_init (tee_segments *seg, int fd, const char *name, uint64_t max_size,
+          uint64_t interval, seg_compress method)
+{
+    seg->fd = fd;
+    seg->name = name;
+    seg->max_size = max_size;
+    seg->interval = interval;
+    seg->started = now_ns();
+    seg->method = method;
+
+    if (method == SEG_COMPRESS_NONE) {
+        return;
+    }
+
+    seg->block = SEG_COMPRESS_BLOCK;
+    if (max_size && max_size < seg->block) {
+        seg->block = max_size;
+    }
+
+    seg->in = mem_alloc(seg->block);
+    seg->out_size = seg_out_size(method);
+
+    switch (method) {
+#ifdef  HAVE_ZSTD
+    case SEG_COMPRESS_ZSTD:
+        seg->zstd = ZSTD_createCCtx_advanced((ZSTD_customMem) {
+            seg_zstd_alloc, seg_zstd_free, NULL});
+        if (seg->zstd == NULL) {
+            panic( "%s: can't create zstd context", name );
+        }
+        break;
+#endif
+#ifdef  HAVE_LZ4
+    case SEG_COMPRESS_LZ4:
+        if (LZ4F_isError(LZ4F_createCompressionContext(&seg->lz4,
+                                                       LZ4F_VERSION))) {
+            panic( "%s: can't create lz4 context", name );
+        }
+        break;
+#endif
+#ifdef  HAVE_ZLIB
+    case SEG_COMPRESS_GZIP:
+        /* windowBits + 16 selects gzip format */
+        seg->zlib.zalloc = seg_zlib_alloc;
+        seg->zlib.zfree = seg_zlib_free;
+        if (deflateInit2(&seg->zlib, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                         15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            panic( "%s: can't create zlib stream", name );
+        }
+        break;
+#endif
+    default:
+        break;
+    }
+
+    seg->out = mem_alloc(seg->out_size);
+}
+
+/*
+ * Finish current segment and start the new one
+ */
+static void
+seg_rotate (tee_segments *seg)
+{
+    seg_compress_block(seg, SEG_END);
+    close(seg->fd);
+
+    seg_rename_old(seg->name, &seg->next, seg->method, seg->method);
+
+    seg->fd = open(seg->name, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (seg->fd == -1) {
+        panic_perror( "can't open %s", seg->name );
+    }
+
+    seg->size = 0;
+    seg->started = now_ns();
+}
+
+/*
+ * Check, if segment is due to rotate by --tee-rotate-interval
+ */
+static inline bool
+seg_expired (tee_segments *seg, uint64_t now)
+{
+    return seg->interval && now - seg->started >= seg->interval;
+}
+
+/*
+ * Write data into the tee file
+ */
+static void
+seg_write (tee_segments *seg, const unsigned char *data, size_t size)
+{
+    if ((seg->max_size && seg->size >= seg->max_size) ||
+        seg_expired(seg, now_ns())) {
+        seg_rotate(seg);
+    }
+
+    if (seg->method == SEG_COMPRESS_NONE) {
+        /* Writer may pass up to the whole tee buffer, split it */
+        while (seg->max_size && seg->size + size > seg->max_size) {
+            size_t  n = seg->max_size - seg->size;
+
+            seg_output(seg, data, n);
+            data += n;
+            size -= n;
+            seg_rotate(seg);
+        }
+
+        seg_output(seg, data, size);
+        return;
+    }
+
+    while (size != 0) {
+        size_t  n = seg->block - seg->in_len;
+
+        n = n < size ? n : size;
+        memcpy(seg->in + seg->in_len, data, n);
+        seg->in_len += n;
+        data += n;
+        size -= n;
+
+        if (seg->in_len == seg->block) {
+            seg_compress_block(seg, SEG_CONTINUE);
+            if (seg->max_size && seg->size >= seg->max_size) {
+                seg_rotate(seg);
+            }
+        }
+
+        seg->dirty = true;
+    }
+}
+
+/*
+ * Flush compressor, so all written data gets to the file
+ */
+static void
+seg_flush (tee_segments *seg)
+{
+    if (seg->dirty) {
+        seg_compress_block(seg, SEG_FLUSH);
+    }
+}
+
+/*
+ * Get time to wait for data, before seg_idle() is due: compressor
+ * flush after SEG_FLUSH_NS, and rotation by time, so a quiet line
+ * doesn't keep the segment open past its interval. Returns 0, if
+ * there is nothing to wait for
+ */
+static uint64_t
+seg_idle_wait (tee_segments *seg)
+{
+    uint64_t    wait = seg->dirty ? SEG_FLUSH_NS : 0;
+
+    if (seg->interval) {
+        uint64_t    now = now_ns(), left = 1;
+
+        if (!seg_expired(seg, now)) {
+            left = seg->started + seg->interval - now;
+        }
+
+        wait = wait != 0 && wait < left ? wait : left;
+    }
+
+    return wait;
+}
+
+/*
+ * Idle timeout of the writer: rotate expired segment, or flush
+ * compressor
+ */
+static void
+seg_idle (tee_segments *seg)
+{
+    if (seg_expired(seg, now_ns())) {
+        seg_rotate(seg);
+    } else {
+        seg_flush(seg);
+    }
+}
+
+/*
+ * Finish the last segment
+ */
+static void
+seg_finish (tee_segments *seg)
+{
+    seg_compress_block(seg, SEG_END);
+}
+
+/***** Asynchronous writer *****/
+/*
+ * awriter writes data into a file on a dedicated thread, so
+ * slow storage never stalls the caller
+ *
+ * Data is passed through the SPSC ring: caller is the producer,
+ * writer thread is the consumer, which takes all accumulated data
+ * at once and writes it with a single writev() call
+ *
+ * When the ring is full, the behavior depends on policy:
+ *   AW_BLOCK - caller waits until writer makes some space
+ *   AW_DROP  - excess data is dropped and counted
+ *   AW_SPILL - excess data is appended to the list of memory
+ *              chunks. While this list is not empty, all new
+ *              data goes there too, to preserve ordering
+ *
+ * In the pipe mode (see aw_start_pipe()), ring is not used.
+ * Instead, data comes via pipe and writer thread moves it into
+ * the file with splice(). Backpressure is up to the pipe writer
+ *
+ * If aw_set_segments() is used, output goes through tee_segments,
+ * which does rotation and compression (and splice() is not used)
+ */
+typedef struct aw_chunk aw_chunk;
+struct aw_chunk {
+    aw_chunk            *next;          /* Next chunk in the list */
+    size_t              len;            /* Bytes used */
+    size_t              size;           /* Bytes allocated */
+    unsigned char       data[];         /* Chunk data */
+};
+
+typedef struct {
+    int                 fd;             /* Output file */
+    const char          *name;          /* File name, for messages */
+    int                 pipe[2];        /* Data pipe, pipe mode only */
+    aw_policy           policy;         /* Backpressure policy */
+    ring                ring;           /* Data ring */
+    pthread_t           thread;         /* Writer thread */
+    pthread_mutex_t     lock;           /* Protects everything below */
+    pthread_cond_t      cond_data;      /* Signaled when data added */
+    pthread_cond_t      cond_space;     /* Signaled when data consumed */
+    atomic_bool         wait_data;      /* Writer waits for data */
+    atomic_bool         wait_space;     /* Producer waits for space */
+    bool                stop;           /* Writer must exit */
+    aw_chunk *_Atomic   spill_head;     /* Spilled data, first chunk */
+    aw_chunk            *spill_tail;    /* Spilled data, last chunk */
+    size_t              spilled;        /* Currently spilled bytes */
+    size_t              spilled_max;    /* Max spilled bytes */
+    unsigned long long  dropped;        /* Dropped bytes */
+    tee_segments        *seg;           /* Segments writer, if any */
+} awriter;
+
+/*
+ * Write all data from iovec to the file
+ */
+static void
+aw_writev (awriter *aw, struct iovec *iov, int cnt)
+{
+    if (aw->seg != NULL) {
+        for (; cnt > 0; cnt --, iov ++) {
+            seg_write(aw->seg, iov->iov_base, iov->iov_len);
+        }
+        return;
+    }
+
+    while (cnt > 0) {
+        ssize_t rc = writev(aw->fd, iov, cnt);
+
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            panic_perror( "write(%s)", aw->name );
+        }
+
+        while (cnt > 0 && (size_t) rc >= iov->iov_len) {
+            rc -= iov->iov_len;
+            iov ++;
+            cnt --;
+        }
+
+        if (cnt > 0) {
+            iov->iov_base = (char*) iov->iov_base + rc;
+            iov->iov_len -= rc;
+        }
+    }
+}
+
+/*
+ * Write list of spilled chunks and free them
+ */
+static void
+aw_write_spill (awriter *aw, aw_chunk *chunk)
+{
+    while (chunk != NULL) {
+        struct iovec    iov[64];
+        aw_chunk        *next = chunk;
+        int             cnt = 0;
+
+        while (next != NULL && cnt < 64) {
+            iov[cnt].iov_base = next->data;
+            iov[cnt].iov_len = next->len;
+            cnt ++;
+            next = next->next;
+        }
+
+        aw_writev(aw, iov, cnt);
+
+        while (chunk != next) {
+            aw_chunk    *c = chunk;
+            chunk = chunk->next;
+            mem_free(c);
+        }
+    }
+}
+
+#ifdef  __linux__
+/*
+ * Writer thread, pipe mode
+ */
+static void*
+aw_pipe_thread (void *arg)
+{
+    awriter     *aw = arg;
+    bool        use_splice = aw->seg == NULL;
+
+    for (;;) {
+        ssize_t rc;
+
+        if (use_splice) {
+            rc = splice(aw->pipe[0], NULL, aw->fd, NULL, MAX_RING_SIZE,
+                        SPLICE_F_MOVE);
+            if (rc < 0 && errno == EINVAL) {
+                /* File system doesn't support splice */
+                use_splice = false;
+                continue;
+            }
+        } else {
+            unsigned char   buf[SPLICE_CHUNK];
+            struct iovec    iov;
+            uint64_t        wait = aw->seg != NULL ? seg_idle_wait(aw->seg) : 0;
+
+            /* Flush compressor or rotate segment, if idle */
+            if (wait != 0) {
+                struct pollfd   pfd = {.fd = aw->pipe[0], .events = POLLIN};
+                uint64_t        ms = (wait + 999999) / 1000000;
+
+                rc = poll(&pfd, 1, ms < INT_MAX ? (int) ms : INT_MAX);
+                if (rc == 0) {
+                    seg_idle(aw->seg);
+                    continue;
+                } else if (rc < 0 && errno == EINTR) {
+                    continue;
+                } else if (rc < 0) {
+                    panic_perror( "poll(%s)", aw->name );
+                }
+            }
+
+            rc = read(aw->pipe[0], buf, sizeof(buf));
+            if (rc > 0) {
+                iov.iov_base = buf;
+                iov.iov_len = rc;
+                aw_writev(aw, &iov, 1);
+            } else if (rc < 0 && errno != EINTR) {
+                panic_perror( "read(%s pipe)", aw->name );
+            }
+        }
+
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            panic_perror( "write(%s)", aw->name );
+        } else if (rc == 0) {
+            /* Write end is closed */
+            break;
+        }
+    }
+
+    if (aw->seg != NULL) {
+        seg_finish(aw->seg);
+    }
+
+    return NULL;
+}
+#endif
+
+/*
+ * Wait for cond_data with timeout, in nanoseconds.
+ * Must be called with aw->lock held
+ */
+static int
+aw_wait_timeout (awriter *aw, uint64_t timeout)
+{
+    struct timespec     ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    timeout += ts.tv_nsec;
+    ts.tv_sec += timeout / 1000000000ULL;
+    ts.tv_nsec = timeout % 1000000000ULL;
+
+    return pthread_cond_timedwait(&aw->cond_data, &aw->lock, &ts);
+}
+
+/*
+ * Writer thread
+ */
+static void*
+aw_thread (void *arg)
+{
+    awriter     *aw = arg;
+
+    for (;;) {
+        unsigned char   *data;
+        struct iovec    iov[2];
+        size_t          total;
+        int             cnt = 0;
+        aw_chunk        *spill = NULL;
+
+        /* Wait for data */
+        pthread_mutex_lock(&aw->lock);
+        atomic_store(&aw->wait_data, true);
+        while (ring_count(&aw->ring) == 0 && aw->spill_head == NULL &&
+               !aw->stop) {
+            uint64_t    wait = aw->seg != NULL ? seg_idle_wait(aw->seg) : 0;
+
+            if (wait != 0) {
+                /* Flush compressor or rotate segment, if idle */
+                if (aw_wait_timeout(aw, wait) == ETIMEDOUT) {
+                    pthread_mutex_unlock(&aw->lock);
+                    seg_idle(aw->seg);
+                    pthread_mutex_lock(&aw->lock);
+                }
+            } else {
+                pthread_cond_wait(&aw->cond_data, &aw->lock);
+            }
+        }
+        atomic_store(&aw->wait_data, false);
+
+        /* Ring data always precedes spilled data */
+        if (ring_count(&aw->ring) == 0) {
+            if (aw->spill_head == NULL) {
+                pthread_mutex_unlock(&aw->lock);
+                if (aw->seg != NULL) {
+                    seg_finish(aw->seg);
+                }
+                break;
+            }
+
+            spill = aw->spill_head;
+            aw->spill_head = aw->spill_tail = NULL;
+            aw->spilled = 0;
+        }
+        pthread_mutex_unlock(&aw->lock);
+
+        if (spill != NULL) {
+            aw_write_spill(aw, spill);
+            continue;
+        }
+
+        /* Take everything accumulated in the ring */
+        total = iov[cnt].iov_len = ring_read_ptr(&aw->ring, &data);
+        iov[cnt ++].iov_base = data;
+
+        if (total < ring_count(&aw->ring)) {
+            iov[cnt].iov_base = aw->ring.data;
+            iov[cnt].iov_len = ring_count(&aw->ring) - total;
+            total += iov[cnt ++].iov_len;
+        }
+
+        aw_writev(aw, iov, cnt);
+        ring_consume(&aw->ring, total);
+
+        /* Wake up producer, if it waits for space */
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load(&aw->wait_space)) {
+            pthread_mutex_lock(&aw->lock);
+            pthread_cond_signal(&aw->cond_space);
+            pthread_mutex_unlock(&aw->lock);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Start writer thread
+ */
+static void
+aw_start_thread (awriter *aw, void* (*thread)(void*))
+{
+    int rc;
+
+    pthread_mutex_init(&aw->lock, NULL);
+    pthread_cond_init(&aw->cond_data, NULL);
+    pthread_cond_init(&aw->cond_space, NULL);
+
+    rc = pthread_create(&aw->thread, NULL, thread, aw);
+    if (rc != 0) {
+        errno = rc;
+        panic_perror("pthread_create()");
+    }
+}
+
+/*
+ * Route writer output through tee_segments, for rotation and
+ * compression. Must be called before writer is started
+ */
+static void
+aw_set_segments (awriter *aw, int fd, const char *name, uint64_t max_size,
+                 uint64_t interval, seg_compress method)
+{
+    aw->seg = mem_alloc(sizeof(tee_segments));
+    seg_init(aw->seg, fd, name, max_size, interval, method);
+}
+
+/*
+ * Start asynchronous writer
+ */
+static void
+aw_start (awriter *aw, int fd, const char *name, size_t size,
+          aw_policy policy)
+{
+    aw->fd = fd;
+    aw->name = name;
+    aw->policy = policy;
+    aw->pipe[0] = aw->pipe[1] = -1;
+    ring_init(&aw->ring, size);
+
+    aw_start_thread(aw, aw_thread);
+}
+
+#ifdef  __linux__
+/*
+ * Start asynchronous writer in the pipe mode. Returns
+ * non-blocking write end of the pipe, where data must
+ * be written to
+ */
+static int
+aw_start_pipe (awriter *aw, int fd, const char *name, size_t size)
+{
+    aw->fd = fd;
+    aw->name = name;
+    aw->policy = AW_BLOCK;
+
+    if (pipe2(aw->pipe, O_CLOEXEC) == -1) {
+        panic_perror("pipe()");
+    }
+
+    /* May fail because of pipe-max-size limit; it's not fatal */
+    fcntl(aw->pipe[1], F_SETPIPE_SZ, (int) size);
+    fcntl(aw->pipe[1], F_SETFL, O_NONBLOCK);
+
+    aw_start_thread(aw, aw_pipe_thread);
+
+    return aw->pipe[1];
+}
+#endif
+
+/*
+ * Stop asynchronous writer. All pending data is written and
+ * synced to disk before this function returns, so the last
+ * received bytes survive the crash or power off that follows
+ */
+static void
+aw_stop (awriter *aw)
+{
+    int fd;
+
+    if (aw->pipe[1] >= 0) {
+        close(aw->pipe[1]);
+    }
+
+    /* Writer panics on write errors, then exit() runs here in it */
+    if (!pthread_equal(pthread_self(), aw->thread)) {
+        pthread_mutex_lock(&aw->lock);
+        aw->stop = true;
+        pthread_cond_signal(&aw->cond_data);
+        pthread_mutex_unlock(&aw->lock);
+
+        pthread_join(aw->thread, NULL);
+    }
+
+    /* Pipes and terminals can't be synced, it's not an error */
+    fd = aw->seg != NULL ? aw->seg->fd : aw->fd;
+    if (fsync(fd) == -1 && errno != EINVAL && errno != EROFS) {
+        fprintf(stderr, "%s: %s: fsync(): %s\n",
+            program_name, aw->name, strerror(errno));
+    }
+
+    if (aw->dropped != 0) {
+        fprintf(stderr, "%s: %s: %llu bytes dropped\n",
+            program_name, aw->name, aw->dropped);
+    }
+
+    if (aw->spilled_max != 0) {
+        fprintf(stderr, "%s: %s: up to %zu bytes spilled to memory\n",
+            program_name, aw->name, aw->spilled_max);
+    }
+}
+
+/*
+ * Append data to the spill list. Called under lock
+ */
+static void
+aw_spill (awriter *aw, const unsigned char *data, size_t size)
+{
+    aw_chunk    *chunk = aw->spill_tail;
+    size_t      n;
+
+    while (size != 0) {
+        if (chunk == NULL || chunk->len == chunk->size) {
+            size_t      sz = size > AW_SPILL_CHUNK ? size : AW_SPILL_CHUNK;
+
+            chunk = mem_alloc(sizeof(aw_chunk) + sz);
+            chunk->size = sz;
+
+            if (aw->spill_tail != NULL) {
+                aw->spill_tail->next = chunk;
+            } else {
+                aw->spill_head = chunk;
+            }
+            aw->spill_tail = chunk;
+        }
+
+        n = chunk->size - chunk->len;
+        n = n < size ? n : size;
+        memcpy(chunk->data + chunk->len, data, n);
+        chunk->len += n;
+        data += n;
+        size -= n;
+        aw->spilled += n;
+    }
+
+    if (aw->spilled > aw->spilled_max) {
+        aw->spilled_max = aw->spilled;
+    }
+}
+
+/*
+ * Queue data for writing
+ */
+static void
+aw_write (awriter *aw, const unsigned char *data, size_t size)
+{
+    bool        spilled = false;
+
+    while (size != 0) {
+        unsigned char   *p;
+        size_t          n = ring_write_ptr(&aw->ring, &p);
+
+        /* Producer peeks at spill list without lock */
+        if (atomic_load_explicit(&aw->spill_head,
+                                 memory_order_acquire) != NULL) {
+            n = 0;
+        }
+
+        if (n != 0) {
+            n = n < size ? n : size;
+            memcpy(p, data, n);
+            ring_produce(&aw->ring, n);
+            data += n;
+            size -= n;
+            continue;
+        }
+
+        if (aw->policy == AW_DROP) {
+            aw->dropped += size;
+            break;
+        }
+
+        pthread_mutex_lock(&aw->lock);
+        if (aw->policy == AW_SPILL) {
+            aw_spill(aw, data, size);
+            size = 0;
+            spilled = true;
+        } else {
+            atomic_store(&aw->wait_space, true);
+            while (ring_space(&aw->ring) == 0) {
+                pthread_cond_signal(&aw->cond_data);
+                pthread_cond_wait(&aw->cond_space, &aw->lock);
+            }
+            atomic_store(&aw->wait_space, false);
+        }
+        pthread_mutex_unlock(&aw->lock);
+    }
+
+    /* Wake up writer, if it waits for data */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (spilled || atomic_load(&aw->wait_data)) {
+        pthread_mutex_lock(&aw->lock);
+        pthread_cond_signal(&aw->cond_data);
+        pthread_mutex_unlock(&aw->lock);
+    }
+}
+
+/***** Capture files *****/
+/*
+ * Capture file (.ctc) keeps data of both directions together
+ * with timing. All numbers are little-endian. File layout:
+ *
+ *   file header:   magic "CTCAP01\n", u64 wall-clock start time (ns),
+ *                  u64 line bit rate
+ *   blocks:        block header: u32 magic "BLCK", u32 payload length,
+ *                  u32 count of records, u32 reserved (0),
+ *                  u64 time of the first record (ns since start);
+ *                  followed by records
+ *   index:         one entry per block: u64 file offset of the block,
+ *                  u64 time of the first and u64 time of the last record
+ *   trailer:       u64 file offset of the index, u64 count of entries,
+ *                  magic "CTCINDEX"
+ *
+ * Record is varint(time delta from the previous record of the block,
+ * ns), varint(payload length << 1 | direction), payload. Direction
+ * is 0 for received (rx) and 1 for transmitted (tx) data
+ *
+ * Blocks are limited to CTC_BLOCK bytes and CTC_BLOCK_NS of time.
+ * Index is written on exit; if it is missed (i.e., after crash),
+ * reader still can walk the blocks by their headers
+ */
+#define CTC_MAGIC               "CTCAP01\n"
+#define CTC_INDEX_MAGIC         "CTCINDEX"
+#define CTC_BLOCK_MAGIC         0x4b434c42      /* "BLCK" */
+#define CTC_HEADER_SIZE         24
+#define CTC_BLOCK_HEADER_SIZE   24
+#define CTC_INDEX_ENTRY_SIZE    24
+#define CTC_TRAILER_SIZE        24
+#define CTC_RECORD_MAX_HEADER   20
+
+typedef enum {
+    CTC_RX,
+    CTC_TX
+} ctc_dir;
+
+typedef struct {
+    uint64_t            offset;         /* Block offset */
+    uint64_t            first;          /* First record time */
+    uint64_t            last;           /* Last record time */
+} ctc_index;
+
+typedef struct {
+    awriter             aw;             /* Asynchronous file writer */
+    const char          *name;          /* File name */
+    uint64_t            base;           /* Capture start time */
+    uint64_t            offset;         /* Current file offset */
+    unsigned char       *block;         /* Current block */
+    size_t              len;            /* Bytes in current block */
+    uint32_t            records;        /* Records in current block */
+    uint64_t            first;          /* First record time */
+    uint64_t            last;           /* Last record time */
+    ctc_index           *index;         /* Index entries */
+    size_t              index_len;      /* Count of index entries */
+    size_t              index_cap;      /* Allocated index entries */
+} capture;
+
+/*
+ * Store n-byte little-endian number
+ */
+static void
+ctc_put_le (unsigned char *p, uint64_t v, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i ++) {
+        p[i] = (unsigned char) (v >> (8 * i));
+    }
+}
+
+/*
+ * Load n-byte little-endian number
+ */
+static uint64_t
+ctc_get_le (const unsigned char *p, int n)
+{
+    uint64_t    v = 0;
+    int         i;
+
+    for (i = n - 1; i >= 0; i --) {
+        v = (v << 8) | p[i];
+    }
+
+    return v;
+}
+
+/*
+ * Store varint. Returns its length
+ */
+static size_t
+ctc_put_varint (unsigned char *p, uint64_t v)
+{
+    size_t      len = 0;
+
+    while (v >= 0x80) {
+        p[len ++] = (unsigned char) (v | 0x80);
+        v >>= 7;
+    }
+
+    p[len ++] = (unsigned char) v;
+    return len;
+}
+
+/*
+ * Load varint. Returns false, if data is truncated or invalid
+ */
+static bool
+ctc_get_varint (const unsigned char **p, const unsigned char *end,
+        uint64_t *v)
+{
+    const unsigned char *s = *p;
+    int                 shift = 0;
+
+    *v = 0;
+    while (s != end && shift < 64) {
+        *v |= (uint64_t) (*s & 0x7f) << shift;
+        if ((*s ++ & 0x80) == 0) {
+            *p = s;
+            return true;
+        }
+        shift += 7;
+    }
+
+    return false;
+}
+
+/*
+ * Write data to the capture file
+ */
+static void
+ctc_output (capture *c, const unsigned char *data, size_t size)
+{
+    aw_write(&c->aw, data, size);
+    c->offset += size;
+}
+
+/*
+ * Write current block and its index entry
+ */
+static void
+ctc_flush (capture *c)
+{
+    unsigned char       *hdr = c->block;
+
+    if (c->records == 0) {
+        return;
+    }
+
+    ctc_put_le(hdr, CTC_BLOCK_MAGIC, 4);
+    ctc_put_le(hdr + 4, c->len - CTC_BLOCK_HEADER_SIZE, 4);
+    ctc_put_le(hdr + 8, c->records, 4);
+    ctc_put_le(hdr + 12, 0, 4);
+    ctc_put_le(hdr + 16, c->first, 8);
+
+    if (c->index_len == c->index_cap) {
+        c->index_cap = c->index_cap * 2;
+        c->index = mem_realloc(c->index, c->index_cap * sizeof(ctc_index));
+    }
+
+    c->index[c->index_len].offset = c->offset;
+    c->index[c->index_len].first = c->first;
+    c->index[c->index_len].last = c->last;
+    c->index_len ++;
+
+    ctc_output(c, c->block, c->len);
+
+    c->len = CTC_BLOCK_HEADER_SIZE;
+    c->records = 0;
+}
+
+/*
+ * Open capture file and start its writer
+ */
+static void
+ctc_open (capture *c, const char *name, aw_policy policy,
+          unsigned long speed)
+{
+    unsigned char       hdr[CTC_HEADER_SIZE];
+    struct timespec     now;
+    int                 fd;
+
+    fd = open(name, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (fd == -1) {
+        panic_perror( "can't open %s", name );
+    }
+
+    /* Dropping would break file structure */
+    if (policy == AW_DROP) {
+        policy = AW_BLOCK;
+    }
+
+    c->name = name;
+    c->base = now_ns();
+    c->block = mem_alloc(CTC_BLOCK);
+    c->len = CTC_BLOCK_HEADER_SIZE;
+
+    /* Enough for an hour or more, so doesn't grow usually */
+    c->index_cap = CTC_INDEX_INITIAL;
+    c->index = mem_realloc(NULL, c->index_cap * sizeof(ctc_index));
+    aw_start(&c->aw, fd, name, opt_tee_buffer, policy);
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    memcpy(hdr, CTC_MAGIC, 8);
+    ctc_put_le(hdr + 8, (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec, 8);
+    ctc_put_le(hdr + 16, speed, 8);
+    ctc_output(c, hdr, sizeof(hdr));
+}
+
+/*
+ * Add record to the capture file, received or sent at time t
+ * (now_ns() clock). Large data is split into multiple records
+ *
+ * RX data, read by the RX thread, may be older than the last
+ * record; such data is recorded at the last record time, so
+ * deltas never go negative
+ */
+static void
+ctc_record (capture *c, ctc_dir dir, const unsigned char *data, size_t size,
+            uint64_t t)
+{
+    uint64_t    now = t > c->base ? t - c->base : 0;
+
+    now = now > c->last ? now : c->last;
+
+    if (c->records != 0 && now - c->first >= CTC_BLOCK_NS) {
+        ctc_flush(c);
+    }
+
+    while (size != 0) {
+        size_t  space = CTC_BLOCK - c->len;
+        size_t  len;
+
+        if (space <= CTC_RECORD_MAX_HEADER) {
+            ctc_flush(c);
+            continue;
+        }
+
+        len = space - CTC_RECORD_MAX_HEADER;
+        len = len < size ? len : size;
+
+        if (c->records == 0) {
+            c->first = c->last = now;
+        }
+
+        c->len += ctc_put_varint(c->block + c->len, now - c->last);
+        c->len += ctc_put_varint(c->block + c->len, (len << 1) | dir);
+        memcpy(c->block + c->len, data, len);
+        c->len += len;
+        c->records ++;
+        c->last = now;
+
+        data += len;
+        size -= len;
+    }
+}
+
+/*
+ * Get time (now_ns() clock), when current block must be flushed
+ * by CTC_BLOCK_NS limit. Returns 0, if block is empty
+ */
+static uint64_t
+ctc_deadline (capture *c)
+{
+    return c->records != 0 ? c->base + c->first + CTC_BLOCK_NS : 0;
+}
+
+/*
+ * Flush pending data, write index and stop writer
+ */
+static void
+ctc_close (capture *c)
+{
+    unsigned char       buf[CTC_INDEX_ENTRY_SIZE];
+    uint64_t            index_offset;
+    size_t              i;
+
+    ctc_flush(c);
+
+    index_offset = c->offset;
+    for (i = 0; i < c->index_len; i ++) {
+        ctc_put_le(buf, c->index[i].offset, 8);
+        ctc_put_le(buf + 8, c->index[i].first, 8);
+        ctc_put_le(buf + 16, c->index[i].last, 8);
+        ctc_output(c, buf, CTC_INDEX_ENTRY_SIZE);
+    }
+
+    ctc_put_le(buf, index_offset, 8);
+    ctc_put_le(buf + 8, c->index_len, 8);
+    memcpy(buf + 16, CTC_INDEX_MAGIC, 8);
+    ctc_output(c, buf, CTC_TRAILER_SIZE);
+
+    aw_stop(&c->aw);
+    close(c->aw.fd);
+}
+
+/***** Capture replay *****/
+/*
+ * Print record in the human-readable form
+ */
+static void
+ctc_print_record (uint64_t t, ctc_dir dir, const unsigned char *data,
+        size_t size)
+{
+    size_t      i;
+
+    printf("[%5llu.%06llu] %s %5zu \"",
+        (unsigned long long) (t / 1000000000ULL),
+        (unsigned long long) (t % 1000000000ULL / 1000),
+        dir == CTC_RX ? "rx" : "tx", size);
+
+    for (i = 0; i < size; i ++) {
+        unsigned char   c = data[i];
+
+        switch (c) {
+        case '\r':  fputs("\\r", stdout); break;
+        case '\n':  fputs("\\n", stdout); break;
+        case '\t':  fputs("\\t", stdout); break;
+        case '\\':  fputs("\\\\", stdout); break;
+        case '"':   fputs("\\\"", stdout); break;
+        default:
+            if (c < 0x20 || c >= 0x7f) {
+                printf("\\x%2.2x", c);
+            } else {
+                putchar(c);
+            }
+        }
+    }
+
+    printf("\"\n");
+}
+
+/*
+ * Print data as hex dump (--hex option). hd are dumps of both
+ * directions; on direction change, partial row of the other
+ * direction is finished, so rows are never mixed
+ */
+static void
+ctc_print_hex (hexd *hd, ctc_dir dir, const unsigned char *data,
+        size_t size)
+{
+    static unsigned char        buf[HEXD_MAX_LEN(TS_CHUNK)];
+
+    fwrite(buf, 1, hexd_flush(&hd[!dir], buf), stdout);
+
+    while (size != 0) {
+        size_t  n = size < TS_CHUNK ? size : TS_CHUNK;
+
+        fwrite(buf, 1, hexd_format(&hd[dir], data, n, buf), stdout);
+        data += n;
+        size -= n;
+    }
+}
+
+/*
+ * Find the first block that may contain records at or after
+ * the from time, using the index. Returns 0 if index is missed
+ */
+static uint64_t
+ctc_index_lookup (const unsigned char *map, uint64_t size, uint64_t from)
+{
+    const unsigned char *trailer, *index;
+    uint64_t            index_offset, count, lo, hi;
+
+    if (size < CTC_HEADER_SIZE + CTC_TRAILER_SIZE) {
+        return 0;
+    }
+
+    trailer = map + size - CTC_TRAILER_SIZE;
+    if (memcmp(trailer + 16, CTC_INDEX_MAGIC, 8)) {
+        return 0;
+    }
+
+    index_offset = ctc_get_le(trailer, 8);
+    count = ctc_get_le(trailer + 8, 8);
+    if (index_offset < CTC_HEADER_SIZE ||
+        index_offset > size - CTC_TRAILER_SIZE ||
+        count != (size - CTC_TRAILER_SIZE - index_offset) /
+                 CTC_INDEX_ENTRY_SIZE) {
+        return 0;
+    }
+
+    if (count == 0) {
+        return index_offset;
+    }
+
+    /* Find the first block with last record time >= from */
+    index = map + index_offset;
+    lo = 0;
+    hi = count;
+    while (lo < hi) {
+        uint64_t    mid = lo + (hi - lo) / 2;
+
+        if (ctc_get_le(index + mid * CTC_INDEX_ENTRY_SIZE + 16, 8) < from) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo == count) {
+        return index_offset;
+    }
+
+    return ctc_get_le(index + lo * CTC_INDEX_ENTRY_SIZE, 8);
+}
+
+/*
+ * Replay capture file (--replay option)
+ */
+static void
+ctc_replay (const char *name)
+{
+    int                 fd;
+    struct stat         st;
+    const unsigned char *map;
+    uint64_t            size, off, page;
+    hexd                hd[2];
+    unsigned char       tail[2 * HEXD_LINE_MAX];
+
+    hexd_start(&hd[CTC_RX], "rx", false);
+    hexd_start(&hd[CTC_TX], "tx", false);
+
+    fd = open(name, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        panic_perror( "can't open %s", name );
+    }
+
+    size = (uint64_t) st.st_size;
+    if (size < CTC_HEADER_SIZE) {
+        panic( "%s: not a capture file", name );
+    }
+
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        panic_perror( "mmap(%s)", name );
+    }
+
+    if (memcmp(map, CTC_MAGIC, 8)) {
+        panic( "%s: not a capture file", name );
+    }
+
+    off = ctc_index_lookup(map, size, opt_replay_from);
+    if (off == 0) {
+        off = CTC_HEADER_SIZE;
+    }
+
+    /* madvise() wants page-aligned address */
+    page = off & ~((uint64_t) sysconf(_SC_PAGESIZE) - 1);
+    madvise((void*) (map + page), size - page, MADV_SEQUENTIAL);
+
+    while (off + CTC_BLOCK_HEADER_SIZE <= size) {
+        const unsigned char *hdr = map + off, *p, *end;
+        uint64_t            len, records, t;
+
+        if (ctc_get_le(hdr, 4) != CTC_BLOCK_MAGIC) {
+            break; /* Reached the index */
+        }
+
+        len = ctc_get_le(hdr + 4, 4);
+        records = ctc_get_le(hdr + 8, 4);
+        t = ctc_get_le(hdr + 16, 8);
+        if (len > size - off - CTC_BLOCK_HEADER_SIZE) {
+            fprintf(stderr, "%s: %s: truncated block at %llu\n",
+                program_name, name, (unsigned long long) off);
+            break;
+        }
+
+        if (t > opt_replay_to) {
+            break;
+        }
+
+        p = hdr + CTC_BLOCK_HEADER_SIZE;
+        end = p + len;
+        while (records --) {
+            uint64_t    delta, hdr2;
+            size_t      n;
+            ctc_dir     dir;
+
+            if (!ctc_get_varint(&p, end, &delta) ||
+                !ctc_get_varint(&p, end, &hdr2) ||
+                (hdr2 >> 1) > (uint64_t) (end - p)) {
+                panic( "%s: corrupted block at %llu", name,
+                       (unsigned long long) off );
+            }
+
+            t += delta;
+            n = hdr2 >> 1;
+            dir = hdr2 & 1;
+
+            if (t > opt_replay_to) {
+                goto DONE;
+            }
+
+            if (t >= opt_replay_from) {
+                if (opt_replay_records) {
+                    ctc_print_record(t, dir, p, n);
+                } else if (opt_hex) {
+                    ctc_print_hex(hd, dir, p, n);
+                } else if (dir == CTC_RX) {
+                    fwrite(p, 1, n, stdout);
+                }
+            }
+
+            p += n;
+        }
+
+        off += CTC_BLOCK_HEADER_SIZE + len;
+    }
+
+DONE:
+    fwrite(tail, 1, hexd_flush(&hd[CTC_RX], tail), stdout);
+    fwrite(tail, 1, hexd_flush(&hd[CTC_TX], tail), stdout);
+    fflush(stdout);
+    munmap((void*) map, size);
+    close(fd);
+}
+
+/***** Event engine *****/
+/*
+ * Event types
+ */
+#define EV_READ         0x01
+#define EV_WRITE        0x02
+
+/*
+ * ev_source represents a file descriptor, registered with
+ * the event engine
+ *
+ * The engine tracks two event masks per source:
+ *   interest - events the owner currently wants to handle
+ *   ready    - events the file descriptor was reported ready for
+ *
+ * Callback is called when (interest & ready) != 0. Semantics
+ * is edge-triggered: callback is expected to perform I/O until
+ * it gets EAGAIN, and then to call ev_clear(). If callback stops
+ * earlier (i.e., because buffer is full), it must drop interest
+ * instead; it will be called again, without waiting for the next
+ * event, as soon as interest is restored
+ *
+ * This works uniformly for the edge-triggered epoll, for the
+ * (level-triggered) poll and for files that can't be polled at
+ * all (regular files), which are considered always ready
+ */
+typedef struct ev_source ev_source;
+struct ev_source {
+    int             fd;                 /* File descriptor */
+    unsigned int    interest;           /* Interest mask */
+    unsigned int    ready;              /* Readiness mask */
+    bool            always_ready;       /* File can't be polled */
+    unsigned int    done;               /* Events of always ready file,
+                                           that will never come (EOF) */
+    int             index;              /* Index in ev_loop.sources */
+    unsigned int    events;             /* Events source is registered for */
+    unsigned int    polled;             /* Events io_uring polls for */
+    size_t          (*read_buf)(ev_source *src, unsigned char **ptr);
+                                        /* Buffer for io_uring reads */
+    void            (*read_done)(ev_source *src, ssize_t res);
+                                        /* io_uring read completion */
+    int             read_fixed;         /* Registered buffer, -1 if none */
+    bool            read_poll;          /* Read is linked to poll */
+    bool            read_again;         /* Read got EAGAIN, needs poll */
+    bool            read_stop;          /* Read got EOF or error */
+    void            (*callback)(ev_source *src, unsigned int events);
+    void            *data;              /* Callback's private data */
+};
+
+/*
+ * ev_timer represents a one-shot timer. Deadline is
+ * absolute CLOCK_MONOTONIC time, in nanoseconds
+ */
+typedef struct ev_timer ev_timer;
+struct ev_timer {
+    uint64_t        deadline;           /* Expiration time */
+    bool            active;             /* Timer is running */
+    ev_timer        *next;              /* Next active timer */
+    void            (*callback)(ev_timer *timer);
+    void            *data;              /* Callback's private data */
+};
+
+typedef struct ev_uring ev_uring;
+
+/*
+ * ev_loop represents the event engine
+ *
+ * On Linux, timers are driven by timerfd, which gives the
+ * nanosecond resolution. Otherwise, poll() timeout is used,
+ * rounded up to milliseconds
+ */
+typedef struct {
+    int             epfd;               /* epoll fd, -1 if poll() in use */
+    int             tfd;                /* timerfd, -1 if not available */
+    ev_source       src_timer;          /* tfd event source */
+    uint64_t        tfd_armed;          /* Deadline tfd is armed for */
+    ev_timer        *timers;            /* Active timers */
+    ev_source       **sources;          /* Registered sources */
+    struct pollfd   *pollfds;           /* For poll() */
+    int             count;              /* Count of registered sources */
+    int             capacity;           /* Capacity of sources array */
+#ifdef  HAVE_IO_URING
+    ev_uring        *uring;             /* io_uring, NULL if not in use */
+#endif
+} ev_loop;
+
+static void
+ev_add (ev_loop *loop, ev_source *src, int fd, unsigned int events,
+        void (*callback)(ev_source *src, unsigned int events), void *data);
+
+static inline void
+ev_clear (ev_source *src, unsigned int events);
+
+/*
+ * Translate EV_XXX event mask into poll() events
+ */
+static short
+ev_to_poll (unsigned int events)
+{
+    short   pe = 0;
+
+    if (events & EV_READ) {
+        pe |= POLLIN;
+    }
+
+    if (events & EV_WRITE) {
+        pe |= POLLOUT;
+    }
+
+    return pe;
+}
+
+#ifdef  HAVE_IO_URING
+/*
+ * io_uring backend
+ *
+ * When I/O on a source returns EAGAIN (see ev_clear()), one-shot
+ * poll request is posted for the events that are not ready anymore.
+ * Requests are submitted by the same io_uring_enter() that waits
+ * for completions and for the nearest timer, with nanosecond timeout
+ * (no timerfd and no read() to reset it). So each loop iteration
+ * costs a single system call
+ *
+ * Multishot poll is not used: unlike epoll, that re-checks readiness
+ * when events are harvested, io_uring reports the mask computed at
+ * the wakeup time, which often appears stale by the time it is handled
+ * (i.e., POLLOUT on console that is filled again), causing a lot of
+ * useless writes that fail with EAGAIN. One-shot poll is checked
+ * when it is submitted, so it works like the edge-triggered epoll
+ *
+ * Source may have a read kept posted instead of the EV_READ poll
+ * (see ev_read_start()), so data is moved by the kernel while the
+ * loop is busy, and a completion both wakes the loop and delivers
+ * the data. Buffer is registered with io_uring when possible, and
+ * read is then posted as IORING_OP_READ_FIXED. For O_NONBLOCK files
+ * io_uring returns EAGAIN instead of waiting, so after EAGAIN the
+ * next read is linked to a one-shot poll (IOSQE_IO_LINK), and both
+ * go by the same submission
+ *
+ * Multishot read is not used: it needs buffers, provided in advance
+ * (IOSQE_BUFFER_SELECT), and each read, even of a single character,
+ * consumes a whole buffer, so data would not stay contiguous in the
+ * ring buffer, which the rest of the data path expects
+ */
+#define EV_URING_ENTRIES        256
+#define EV_URING_BUFFERS        64
+#define EV_URING_LINK_POLL      3       /* user_data tag of linked poll */
+
+struct ev_uring {
+    int                 fd;             /* io_uring fd */
+    unsigned int        *sq_head;       /* SQ head, moved by kernel */
+    unsigned int        *sq_tail;       /* SQ tail */
+    unsigned int        sq_mask;        /* SQ index mask */
+    unsigned int        *sq_array;      /* SQ indices array */
+    struct io_uring_sqe *sqes;          /* SQ entries */
+    unsigned int        sq_entries;     /* Count of SQ entries */
+    unsigned int        *cq_head;       /* CQ head */
+    unsigned int        *cq_tail;       /* CQ tail, moved by kernel */
+    unsigned int        cq_mask;        /* CQ index mask */
+    struct io_uring_cqe *cqes;          /* CQ entries */
+    unsigned int        pending;        /* Count of unsubmitted SQEs */
+    void                *buffers[EV_URING_BUFFERS]; /* Registered memory */
+    int                 nbuffers;       /* Count of registered buffers */
+    int                 maxbuffers;     /* Buffer table size, 0 if none */
+};
+
+/*
+ * Submit pending SQEs and wait for CQEs
+ */
+static int
+ev_uring_enter (ev_uring *r, unsigned int min_complete,
+                struct __kernel_timespec *ts)
+{
+    struct io_uring_getevents_arg       arg;
+    unsigned int                        flags = IORING_ENTER_EXT_ARG;
+    int                                 rc;
+
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uintptr_t) ts;
+
+    if (min_complete != 0) {
+        flags |= IORING_ENTER_GETEVENTS;
+    }
+
+    rc = syscall(__NR_io_uring_enter, r->fd, r->pending, min_complete,
+        flags, &arg, sizeof(arg));
+
+    if (rc >= 0) {
+        r->pending -= rc;
+    } else if (errno != EINTR && errno != ETIME) {
+        panic_perror("io_uring_enter()");
+    }
+
+    return rc;
+}
+
+/*
+ * Get next free SQE. Pending SQEs are submitted, if SQ is full
+ */
+static struct io_uring_sqe*
+ev_uring_sqe (ev_uring *r)
+{
+    unsigned int        tail = *r->sq_tail, idx;
+    struct io_uring_sqe *sqe;
+
+    while (tail - atomic_load_explicit((_Atomic unsigned int*) r->sq_head,
+        memory_order_acquire) == r->sq_entries) {
+        ev_uring_enter(r, 0, NULL);
+    }
+
+    idx = tail & r->sq_mask;
+    sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+
+    return sqe;
+}
+
+/*
+ * Commit SQE, obtained from ev_uring_sqe()
+ */
+static void
+ev_uring_commit (ev_uring *r)
+{
+    atomic_store_explicit((_Atomic unsigned int*) r->sq_tail, *r->sq_tail + 1,
+        memory_order_release);
+    r->pending ++;
+}
+
+/*
+ * Post poll request for a single event (EV_READ or EV_WRITE).
+ * Event is encoded in low bits of the user_data, so read and
+ * write requests can be posted and removed independently
+ */
+static void
+ev_uring_poll (ev_uring *r, ev_source *src, unsigned int event)
+{
+    struct io_uring_sqe *sqe = ev_uring_sqe(r);
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = src->fd;
+    sqe->poll32_events = ev_to_poll(event);
+    sqe->user_data = (uintptr_t) src | event;
+
+    ev_uring_commit(r);
+    src->polled |= event;
+}
+
+/*
+ * Post read for the source, if it is not posted yet and there
+ * is room in the buffer. After EAGAIN, read is linked to poll
+ */
+static void
+ev_uring_read (ev_uring *r, ev_source *src)
+{
+    struct io_uring_sqe *sqe;
+    unsigned char       *ptr;
+    size_t              len;
+
+    if ((src->polled & EV_READ) || src->read_stop) {
+        return;
+    }
+
+    len = src->read_buf(src, &ptr);
+    if (len == 0) {
+        return;
+    }
+
+    if (src->read_again) {
+        sqe = ev_uring_sqe(r);
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->fd = src->fd;
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = (uintptr_t) src | EV_URING_LINK_POLL;
+        ev_uring_commit(r);
+        src->read_poll = true;
+        src->read_again = false;
+    }
+
+    sqe = ev_uring_sqe(r);
+    sqe->opcode = src->read_fixed >= 0 ?
+        IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = src->fd;
+    sqe->off = (uint64_t) -1;
+    sqe->addr = (uintptr_t) ptr;
+    sqe->len = len > UINT_MAX ? UINT_MAX : len;
+    sqe->buf_index = src->read_fixed >= 0 ? src->read_fixed : 0;
+    sqe->user_data = (uintptr_t) src | EV_READ;
+
+    ev_uring_commit(r);
+    src->polled |= EV_READ;
+}
+
+/*
+ * Handle read completion
+ */
+static void
+ev_uring_read_done (ev_source *src, int res)
+{
+    if (res == -EAGAIN) {
+        src->read_again = true;
+    } else if (res != -ECANCELED && res != -EINTR) {
+        src->read_done(src, res);
+        src->read_stop = res <= 0;
+        src->ready |= EV_READ;
+    }
+}
+
+/*
+ * Handle completed CQEs. Returns true, if CQE for the
+ * removed source was seen
+ */
+static bool
+ev_uring_reap (ev_uring *r, ev_source *removed)
+{
+    unsigned int    head = *r->cq_head;
+    unsigned int    tail = atomic_load_explicit(
+                            (_Atomic unsigned int*) r->cq_tail,
+                            memory_order_acquire);
+    bool            done = false;
+
+    for (; head != tail; head ++) {
+        struct io_uring_cqe *cqe = &r->cqes[head & r->cq_mask];
+        uintptr_t           ud = cqe->user_data;
+        ev_source           *src = (ev_source*) (ud & ~(uintptr_t) 3);
+
+        if (src == NULL) {
+            continue; /* POLL_REMOVE completion */
+        }
+
+        if ((ud & 3) == EV_URING_LINK_POLL) {
+            src->read_poll = false;
+        } else {
+            src->polled &= ~(ud & 3);
+        }
+
+        if (src == removed) {
+            done = src->polled == 0 && !src->read_poll;
+            continue;
+        }
+
+        if ((ud & 3) == EV_URING_LINK_POLL) {
+            continue; /* Read follows */
+        } else if ((ud & 3) == EV_READ && src->read_buf != NULL) {
+            ev_uring_read_done(src, cqe->res);
+        } else if (cqe->res >= 0) {
+            short   pe = cqe->res;
+
+            if (pe & (POLLERR | POLLHUP | POLLNVAL)) {
+                pe |= POLLIN | POLLOUT;
+            }
+
+            src->ready |= (pe & POLLIN) ? EV_READ : 0;
+            src->ready |= (pe & POLLOUT) ? EV_WRITE : 0;
+        } else if (cqe->res != -ECANCELED) {
+            /* Can't be polled; let callback to handle it */
+            src->always_ready = true;
+            src->ready = EV_READ | EV_WRITE;
+        }
+    }
+
+    atomic_store_explicit((_Atomic unsigned int*) r->cq_head, head,
+        memory_order_release);
+
+    return done;
+}
+
+/*
+ * Wait for events. Timeout is in milliseconds, -1 means infinite;
+ * nearest timer deadline is considered with nanosecond resolution
+ */
+static void
+ev_uring_wait (ev_loop *loop, int timeout)
+{
+    ev_uring                    *r = loop->uring;
+    struct __kernel_timespec    ts, *pts = NULL;
+    uint64_t                    deadline = 0, now, wait = 0;
+    ev_timer                    *t;
+    int                         i;
+
+    for (i = 0; i < loop->count; i ++) {
+        ev_source       *src = loop->sources[i];
+
+        unsigned int    missed = src->events & ~src->ready & ~src->polled;
+
+        if (src->always_ready) {
+            continue;
+        }
+
+        if (src->read_buf != NULL) {
+            ev_uring_read(r, src);
+        } else if (missed & EV_READ) {
+            ev_uring_poll(r, src, EV_READ);
+        }
+
+        if (missed & EV_WRITE) {
+            ev_uring_poll(r, src, EV_WRITE);
+        }
+    }
+
+    for (t = loop->timers; t != NULL; t = t->next) {
+        if (deadline == 0 || t->deadline < deadline) {
+            deadline = t->deadline;
+        }
+    }
+
+    if (deadline != 0 || timeout >= 0) {
+        wait = timeout >= 0 ? (uint64_t) timeout * 1000000ULL : UINT64_MAX;
+
+        if (deadline != 0) {
+            now = now_ns();
+            deadline = deadline > now ? deadline - now : 0;
+            wait = deadline < wait ? deadline : wait;
+        }
+
+        ts.tv_sec = wait / 1000000000ULL;
+        ts.tv_nsec = wait % 1000000000ULL;
+        pts = &ts;
+    }
+
+    ev_uring_enter(r, pts != NULL && wait == 0 ? 0 : 1, pts);
+    ev_uring_reap(r, NULL);
+}
+
+/*
+ * Register source with io_uring. Source is initially ready,
+ * so nothing is posted until it reports EAGAIN
+ */
+static void
+ev_uring_add (ev_loop *loop, ev_source *src)
+{
+    struct stat     st;
+
+    (void) loop;
+
+    /* Regular files are not pollable and always ready */
+    if (fstat(src->fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        src->always_ready = true;
+    }
+}
+
+/*
+ * Register memory for reads of the source. Memory, registered
+ * already (the source is re-added), gets the same buffer index.
+ * If buffer table is full or registration fails (i.e., because
+ * of RLIMIT_MEMLOCK), plain reads are used
+ */
+static void
+ev_uring_register (ev_uring *r, ev_source *src, void *mem, size_t size)
+{
+    struct iovec                    iov = {.iov_base = mem, .iov_len = size};
+    struct io_uring_rsrc_update2    up;
+    int                             i;
+
+    src->read_fixed = -1;
+
+    for (i = 0; i < r->nbuffers; i ++) {
+        if (r->buffers[i] == mem) {
+            src->read_fixed = i;
+            return;
+        }
+    }
+
+    if (r->nbuffers == r->maxbuffers) {
+        return;
+    }
+
+    memset(&up, 0, sizeof(up));
+    up.offset = r->nbuffers;
+    up.data = (uintptr_t) &iov;
+    up.nr = 1;
+
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS_UPDATE,
+        &up, sizeof(up)) == 1) {
+        r->buffers[r->nbuffers] = mem;
+        src->read_fixed = r->nbuffers ++;
+    }
+}
+
+/*
+ * Unregister source. Waits until its poll request is finished,
+ * so source memory may be released after return
+ */
+static void
+ev_uring_del (ev_loop *loop, ev_source *src)
+{
+    ev_uring            *r = loop->uring;
+    struct io_uring_sqe *sqe;
+
+    if (src->polled == 0 && !src->read_poll) {
+        return;
+    }
+
+    /* Read, linked to poll, is canceled with the poll */
+    if (src->read_poll) {
+        sqe = ev_uring_sqe(r);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = (uintptr_t) src | EV_URING_LINK_POLL;
+        ev_uring_commit(r);
+    } else if ((src->polled & EV_READ) && src->read_buf != NULL) {
+        sqe = ev_uring_sqe(r);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = (uintptr_t) src | EV_READ;
+        ev_uring_commit(r);
+    } else if (src->polled & EV_READ) {
+        sqe = ev_uring_sqe(r);
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->addr = (uintptr_t) src | EV_READ;
+        ev_uring_commit(r);
+    }
+
+    if (src->polled & EV_WRITE) {
+        sqe = ev_uring_sqe(r);
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->addr = (uintptr_t) src | EV_WRITE;
+        ev_uring_commit(r);
+    }
+
+    do {
+        ev_uring_enter(r, 1, NULL);
+    } while (!ev_uring_reap(r, src));
+}
+
+/*
+ * Setup io_uring. Returns false, if io_uring is not available or
+ * too old (IORING_ENTER_EXT_ARG is required, 5.11+)
+ */
+static bool
+ev_uring_init (ev_loop *loop)
+{
+    struct io_uring_params      p;
+    struct io_uring_rsrc_register rr;
+    ev_uring                    *r;
+    size_t                      sq_size, cq_size;
+    unsigned char               *rings;
+    void                        *sqes;
+    int                         fd;
+
+    memset(&p, 0, sizeof(p));
+    fd = syscall(__NR_io_uring_setup, EV_URING_ENTRIES, &p);
+    if (fd < 0) {
+        return false;
+    }
+
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(p.features & IORING_FEAT_EXT_ARG)) {
+        close(fd);
+        return false;
+    }
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    rings = mmap(NULL, sq_size > cq_size ? sq_size : cq_size,
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        fd, IORING_OFF_SQ_RING);
+    sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        fd, IORING_OFF_SQES);
+
+    if (rings == MAP_FAILED || sqes == MAP_FAILED) {
+        panic_perror("io_uring mmap()");
+    }
+
+    r = mem_alloc(sizeof(ev_uring));
+    memset(r, 0, sizeof(*r));
+    r->fd = fd;
+    r->sq_head = (unsigned int*) (rings + p.sq_off.head);
+    r->sq_tail = (unsigned int*) (rings + p.sq_off.tail);
+    r->sq_mask = *(unsigned int*) (rings + p.sq_off.ring_mask);
+    r->sq_array = (unsigned int*) (rings + p.sq_off.array);
+    r->sq_entries = p.sq_entries;
+    r->sqes = sqes;
+    r->cq_head = (unsigned int*) (rings + p.cq_off.head);
+    r->cq_tail = (unsigned int*) (rings + p.cq_off.tail);
+    r->cq_mask = *(unsigned int*) (rings + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*) (rings + p.cq_off.cqes);
+
+    /* Sparse table of buffers for ev_read_start(), 5.19+ */
+    memset(&rr, 0, sizeof(rr));
+    rr.nr = EV_URING_BUFFERS;
+    rr.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS2,
+        &rr, sizeof(rr)) == 0) {
+        r->maxbuffers = EV_URING_BUFFERS;
+    }
+
+    loop->uring = r;
+
+    return true;
+}
+#endif
+
+#ifdef  __linux__
+/*
+ * timerfd callback. Just resets timerfd; expired timers are
+ * handled by ev_run()
+ */
+static void
+ev_timerfd_callback (ev_source *src, unsigned int events)
+{
+    uint64_t    cnt;
+
+    (void) events;
+
+    while (read(src->fd, &cnt, sizeof(cnt)) > 0)
+        ;
+
+    ev_clear(src, EV_READ);
+}
+#endif
+
+/*
+ * Initialize the event engine. Uses epoll if possible,
+ * falls back to poll
+ */
+static void
+ev_init (ev_loop *loop)
+{
+    memset(loop, 0, sizeof(*loop));
+    loop->epfd = -1;
+    loop->tfd = -1;
+
+#ifdef  HAVE_IO_URING
+    if (ev_uring_init(loop)) {
+        return;
+    }
+#endif
+
+#ifdef  __linux__
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd >= 0) {
+        loop->tfd = timerfd_create(CLOCK_MONOTONIC,
+            TFD_NONBLOCK | TFD_CLOEXEC);
+    }
+
+    if (loop->tfd >= 0) {
+        ev_add(loop, &loop->src_timer, loop->tfd, EV_READ,
+            ev_timerfd_callback, loop);
+    }
+#endif
+}
+
+/*
+ * Make room for at least count sources, so sources may be
+ * added later without memory allocation
+ */
+static void
+ev_reserve (ev_loop *loop, int count)
+{
+    if (count <= loop->capacity) {
+        return;
+    }
+
+    loop->sources = mem_realloc(loop->sources,
+        count * sizeof(*loop->sources));
+    loop->pollfds = mem_realloc(loop->pollfds,
+        count * sizeof(*loop->pollfds));
+
+    loop->capacity = count;
+}
+
+/*
+ * Register file descriptor with the event engine. Events
+ * is the initial interest mask, and it also defines the
+ * set of events the source will ever be interested in
+ */
+static void
+ev_add (ev_loop *loop, ev_source *src, int fd, unsigned int events,
+        void (*callback)(ev_source *src, unsigned int events), void *data)
+{
+    src->fd = fd;
+    src->interest = events;
+    src->events = events;
+    src->ready = EV_READ | EV_WRITE;
+    src->always_ready = false;
+    src->done = 0;
+    src->polled = 0;
+    src->read_buf = NULL;
+    src->read_done = NULL;
+    src->read_fixed = -1;
+    src->read_poll = false;
+    src->read_again = false;
+    src->read_stop = false;
+    src->callback = callback;
+    src->data = data;
+
+    if (loop->count == loop->capacity) {
+        ev_reserve(loop, loop->capacity ? loop->capacity * 2 : 8);
+    }
+
+    src->index = loop->count ++;
+    loop->sources[src->index] = src;
+    loop->pollfds[src->index].fd = fd;
+    loop->pollfds[src->index].events = ev_to_poll(events);
+    loop->pollfds[src->index].revents = 0;
+
+#ifdef  HAVE_IO_URING
+    if (loop->uring != NULL) {
+        ev_uring_add(loop, src);
+        return;
+    }
+#endif
+
+#ifdef  __linux__
+    if (loop->epfd >= 0) {
+        struct epoll_event      ev;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLET;
+        ev.events |= (events & EV_READ) ? EPOLLIN : 0;
+        ev.events |= (events & EV_WRITE) ? EPOLLOUT : 0;
+        ev.data.ptr = src;
+
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            if (errno != EPERM) {
+                panic_perror("epoll_ctl()");
+            }
+
+            /* Regular files are not pollable and always ready */
+            src->always_ready = true;
+        }
+    }
+#endif
+}
+
+/*
+ * Unregister file descriptor. May be called from the callback
+ * of the source being removed
+ */
+static void
+ev_del (ev_loop *loop, ev_source *src)
+{
+    int     last = -- loop->count;
+
+#ifdef  HAVE_IO_URING
+    if (loop->uring != NULL) {
+        ev_uring_del(loop, src);
+    }
+#endif
+
+#ifdef  __linux__
+    if (loop->epfd >= 0 && !src->always_ready) {
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, src->fd, NULL);
+    }
+#endif
+
+    if (src->index != last) {
+        loop->sources[src->index] = loop->sources[last];
+        loop->pollfds[src->index] = loop->pollfds[last];
+        loop->sources[src->index]->index = src->index;
+    }
+}
+
+/*
+ * Change source interest mask
+ */
+static inline void
+ev_want (ev_loop *loop, ev_source *src, unsigned int events)
+{
+    events &= ~src->done;
+
+    if (src->interest != events) {
+        src->interest = events;
+        loop->pollfds[src->index].events = ev_to_poll(events);
+    }
+}
+
+/*
+ * Source owner reports that fd is not ready anymore for
+ * the specified events (i.e., I/O has returned EAGAIN)
+ *
+ * File that can't be polled never returns EAGAIN, so for it this
+ * means end of file: events are done, and the next ev_want() drops
+ * them from interest, so loop doesn't spin on read() returning 0
+ */
+static inline void
+ev_clear (ev_source *src, unsigned int events)
+{
+    if (src->always_ready) {
+        src->done |= events;
+    }
+
+    src->ready &= ~events;
+}
+
+/*
+ * Keep a read posted on the source (io_uring only), instead of
+ * polling it for EV_READ. Data is read into the region, returned
+ * by buf(), which must be within [mem, mem + size); this memory
+ * is registered with io_uring, if possible. For each completed read
+ * done() is called with the read() result (-errno on error), and
+ * source becomes ready for EV_READ. After EOF or error, nothing is
+ * posted until the source is re-added
+ *
+ * Returns false, if reads can't be posted; then the source is
+ * polled as usual. Must be called again, when source is re-added
+ */
+static bool
+ev_read_start (ev_loop *loop, ev_source *src, void *mem, size_t size,
+               size_t (*buf)(ev_source *src, unsigned char **ptr),
+               void (*done)(ev_source *src, ssize_t res))
+{
+#ifdef  HAVE_IO_URING
+    if (loop->uring != NULL && !src->always_ready) {
+        ev_uring_register(loop->uring, src, mem, size);
+        src->read_buf = buf;
+        src->read_done = done;
+        return true;
+    }
+#else
+    (void) loop;
+    (void) src;
+    (void) mem;
+    (void) size;
+    (void) buf;
+    (void) done;
+#endif
+
+    return false;
+}
+
+/*
+ * Tell if ev_read_start() is supported by the loop
+ */
+static inline bool
+ev_can_read (ev_loop *loop)
+{
+#ifdef  HAVE_IO_URING
+    return loop->uring != NULL;
+#else
+    (void) loop;
+    return false;
+#endif
+}
+
+/*
+ * Start the timer. If timer is already active, it is restarted
+ */
+static void
+ev_timer_start (ev_loop *loop, ev_timer *timer, uint64_t deadline,
+                void (*callback)(ev_timer *timer), void *data)
+{
+    timer->deadline = deadline;
+    timer->callback = callback;
+    timer->data = data;
+
+    if (!timer->active) {
+        timer->active = true;
+        timer->next = loop->timers;
+        loop->timers = timer;
+    }
+}
+
+/*
+ * Stop the timer
+ */
+static void
+ev_timer_stop (ev_loop *loop, ev_timer *timer)
+{
+    ev_timer    **pp;
+
+    if (!timer->active) {
+        return;
+    }
+
+    for (pp = &loop->timers; *pp != timer; pp = &(*pp)->next)
+        ;
+
+    *pp = timer->next;
+    timer->active = false;
+}
+
+/*
+ * Compute wait timeout, considering active timers. Timeout is in
+ * milliseconds, -1 means infinite
+ */
+static int
+ev_timers_timeout (ev_loop *loop, int timeout)
+{
+    ev_timer    *t;
+    uint64_t    deadline = 0, now;
+    int         ms;
+
+#ifdef  HAVE_IO_URING
+    if (loop->uring != NULL) {
+        return timeout; /* See ev_uring_wait() */
+    }
+#endif
+
+    for (t = loop->timers; t != NULL; t = t->next) {
+        if (deadline == 0 || t->deadline < deadline) {
+            deadline = t->deadline;
+        }
+    }
+
+#ifdef  __linux__
+    if (loop->tfd >= 0) {
+        if (deadline != loop->tfd_armed) {
+            struct itimerspec   its;
+
+            memset(&its, 0, sizeof(its));
+            its.it_value.tv_sec = deadline / 1000000000ULL;
+            its.it_value.tv_nsec = deadline % 1000000000ULL;
+            timerfd_settime(loop->tfd, TFD_TIMER_ABSTIME, &its, NULL);
+            loop->tfd_armed = deadline;
+        }
+
+        return timeout;
+    }
+#endif
+
+    if (deadline == 0) {
+        return timeout;
+    }
+
+    now = now_ns();
+    ms = deadline > now ? (int) ((deadline - now + 999999) / 1000000) : 0;
+
+    return (timeout < 0 || ms < timeout) ? ms : timeout;
+}
+
+/*
+ * Call callbacks of expired timers
+ */
+static void
+ev_timers_expire (ev_loop *loop)
+{
+    ev_timer    *t;
+    uint64_t    now;
+
+    if (loop->timers == NULL) {
+        return;
+    }
+
+    now = now_ns();
+    t = loop->timers;
+    while (t != NULL) {
+        if (t->deadline <= now) {
+            ev_timer_stop(loop, t);
+            t->callback(t);
+            t = loop->timers; /* List may change */
+        } else {
+            t = t->next;
+        }
+    }
+}
+
+/*
+ * Wait for events and dispatch them. Timeout is in
+ * milliseconds, -1 means infinite
+ */
+static void
+ev_run (ev_loop *loop, int timeout)
+{
+    int     i, rc;
+
+    timeout = ev_timers_timeout(loop, timeout);
+
+    /* Don't sleep if something is already pending */
+    for (i = 0; i < loop->count; i ++) {
+        ev_source       *src = loop->sources[i];
+        if (src->interest & src->ready) {
+            timeout = 0;
+            break;
+        }
+    }
+
+    /* Wait for events */
+#ifdef  HAVE_IO_URING
+    if (loop->uring != NULL) {
+        ev_uring_wait(loop, timeout);
+    } else
+#endif
+    if (loop->epfd >= 0) {
+#ifdef  __linux__
+        struct epoll_event      events[64];
+
+        rc = epoll_wait(loop->epfd, events, 64, timeout);
+        if (rc < 0 && errno != EINTR) {
+            panic_perror("epoll_wait()");
+        }
+
+        for (i = 0; i < rc; i ++) {
+            ev_source       *src = events[i].data.ptr;
+            uint32_t        e = events[i].events;
+
+            if (e & (EPOLLERR | EPOLLHUP)) {
+                /* Let callback to discover the error */
+                e |= EPOLLIN | EPOLLOUT;
+            }
+
+            src->ready |= (e & EPOLLIN) ? EV_READ : 0;
+            src->ready |= (e & EPOLLOUT) ? EV_WRITE : 0;
+        }
+#endif
+    } else {
+        rc = poll(loop->pollfds, loop->count, timeout);
+        if (rc < 0 && errno != EINTR) {
+            panic_perror("poll()");
+        }
+
+        for (i = 0; rc > 0 && i < loop->count; i ++) {
+            struct pollfd   *pfd = &loop->pollfds[i];
+            ev_source       *src = loop->sources[i];
+
+            if (pfd->revents & (POLLERR | POLLHUP | POLLNVAL)) {
+                pfd->revents |= POLLIN | POLLOUT;
+            }
+
+            src->ready |= (pfd->revents & POLLIN) ? EV_READ : 0;
+            src->ready |= (pfd->revents & POLLOUT) ? EV_WRITE : 0;
+            src->ready &= ~src->done;
+        }
+    }
+
+    /* Dispatch events */
+    for (i = 0; i < loop->count; i ++) {
+        ev_source       *src = loop->sources[i];
+        unsigned int    events = src->interest & src->ready;
+
+        if (events) {
+            src->callback(src, events);
+
+            /* Source was removed, other one took its place */
+            if (i < loop->count && loop->sources[i] != src) {
+                i --;
+            }
+        }
+    }
+
+    ev_timers_expire(loop);
+}
+
+/***** Statistics *****/
+/*
+ * stats_io counts I/O on a single file descriptor in a single
+ * direction. It is updated on the hot path, so only plain counters
+ * are used; clock is read only when output gets blocked and when
+ * it is unblocked
+ */
+typedef struct {
+    unsigned long long  bytes;          /* Bytes transferred */
+    unsigned long long  calls;          /* Count of I/O calls */
+    unsigned long long  shorts;         /* Count of short writes */
+    uint64_t            blocked_ns;     /* Time spent blocked (EAGAIN) */
+    uint64_t            blocked_since;  /* Blocked since, 0 if not */
+} stats_io;
+
+/*
+ * Account completed I/O operation
+ */
+static inline void
+stats_io_done (stats_io *st, size_t requested, size_t done)
+{
+    st->calls ++;
+    st->bytes += done;
+
+    if (done < requested) {
+        st->shorts ++;
+    }
+
+    if (st->blocked_since != 0) {
+        st->blocked_ns += now_ns() - st->blocked_since;
+        st->blocked_since = 0;
+    }
+}
+
+/*
+ * Account I/O operation, failed with EAGAIN
+ */
+static inline void
+stats_io_blocked (stats_io *st)
+{
+    st->calls ++;
+
+    if (st->blocked_since == 0) {
+        st->blocked_since = now_ns();
+    }
+}
+
+/*
+ * Get time, spent blocked, in milliseconds
+ */
+static unsigned long long
+stats_io_blocked_ms (const stats_io *st)
+{
+    uint64_t    ns = st->blocked_ns;
+
+    if (st->blocked_since != 0) {
+        ns += now_ns() - st->blocked_since;
+    }
+
+    return ns / 1000000;
+}
+
+/*
+ * stats_entry is the single named counter, used for formatting
+ */
+typedef struct {
+    const char          *group;         /* Group name, i.e., "tty" */
+    const char          *name;          /* Counter name */
+    unsigned long long  value;          /* Counter value */
+} stats_entry;
+
+#define STATS_MAX_ENTRIES       64
+
+#define STATS_BUF_SIZE          8192
+
+static char         *stats_buf;         /* STATS_BUF_SIZE, from the arena */
+
+/*
+ * Append formatted text at buf + off, snprintf() style: nothing is
+ * written past size, but the full length is counted. Returns the
+ * new offset
+ */
+static size_t
+stats_put (char *buf, size_t size, size_t off, const char *fmt, ...)
+{
+    va_list     ap;
+    int         n;
+
+    va_start(ap, fmt);
+    n = off < size ? vsnprintf(buf + off, size - off, fmt, ap) :
+        vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+
+    return off + (n > 0 ? n : 0);
+}
+
+/*
+ * Format statistics entries, either as human-readable text
+ * (one line per group) or as JSON object. Returns length of the
+ * text, which is truncated, if it is size or more
+ */
+static size_t
+stats_format (char *buf, size_t size, const stats_entry *e, int cnt,
+        bool json)
+{
+    int         i;
+    size_t      off = 0;
+    const char  *group = NULL;
+
+    for (i = 0; i < cnt; i ++) {
+        bool    new_group = group == NULL || strcmp(group, e[i].group);
+
+        if (json) {
+            if (new_group) {
+                off = stats_put(buf, size, off, "%s\"%s\": {",
+                    group ? "}, " : "{", e[i].group);
+            } else {
+                off = stats_put(buf, size, off, ", ");
+            }
+            off = stats_put(buf, size, off, "\"%s\": %llu", e[i].name,
+                e[i].value);
+        } else {
+            if (new_group) {
+                off = stats_put(buf, size, off, "%s%s: %s:",
+                    group ? "\n" : "", program_name, e[i].group);
+            } else {
+                off = stats_put(buf, size, off, ",");
+            }
+            off = stats_put(buf, size, off, " %s %llu", e[i].name,
+                e[i].value);
+        }
+
+        group = e[i].group;
+    }
+
+    if (json) {
+        off = stats_put(buf, size, off, "%s\n", group ? "}}" : "{}");
+    } else if (group != NULL) {
+        off = stats_put(buf, size, off, "\n");
+    }
+
+    return off;
+}
+
+/*
+ * Format statistics into stats_buf, so reports don't touch heap
+ * (see mem_alloc()). Longer text goes to heap, and is counted in
+ * late_allocs. Returns the text, to be released by stats_text_free()
+ */
+static char*
+stats_text (const stats_entry *e, int cnt, bool json, size_t *len)
+{
+    char    *buf = stats_buf;
+
+    *len = stats_format(buf, buf != NULL ? STATS_BUF_SIZE : 0, e, cnt, json);
+    if (buf == NULL || *len >= STATS_BUF_SIZE) {
+        buf = mem_alloc(*len + 1);
+        stats_format(buf, *len + 1, e, cnt, json);
+    }
+
+    return buf;
+}
+
+/*
+ * Release text of stats_text()
+ */
+static void
+stats_text_free (char *buf)
+{
+    if (buf != stats_buf) {
+        mem_free(buf);
+    }
+}
+
+/***** Main loop *****/
+/*
+ * Received chunk, as it goes through the pipeline stages.
+ * Without formatting, out is the same buffer as raw
+ */
+typedef struct {
+    unsigned char       *raw;           /* Received data */
+    size_t              raw_len;        /* Its length */
+    unsigned char       *out;           /* Data for console */
+    size_t              out_len;        /* Its length */
+    uint64_t            t;              /* Read time, now_ns() clock */
+} rx_chunk;
+
+/*
+ * Read time of data in rx_ring (--rx-thread): one slot per
+ * read, which ends at rx_ring position end
+ */
+typedef struct {
+    size_t              end;            /* rx_ring tail after read */
+    uint64_t            ns;             /* Read time, now_ns() clock */
+} rx_time;
+
+/*
+ * Pipeline stage. Gets the whole chunk and main loop state
+ */
+typedef void (*rx_stage)(void *data, rx_chunk *c);
+
+#define RX_STAGES_MAX           8
+
+/*
+ * Main loop state
+ */
+typedef struct {
+    ev_loop             *loop;          /* Event engine */
+    const char          *line;          /* TTY line name */
+    atomic_ulong        speed;          /* Effective line speed, bps */
+    const char          *tee_name;      /* Tee file name, NULL if none */
+    const char          *capture_name;  /* Capture file name, NULL if none */
+    ev_source           src_con_in;     /* Console input */
+    ev_source           src_con_out;    /* Console output */
+    ev_source           src_tty;        /* TTY line */
+    int                 fd_tee;         /* Tee file, -1 if none */
+    awriter             tee;            /* Tee writer */
+    ring                con2tty;        /* console->tty data */
+    ring                tty2con;        /* tty->console data */
+    unsigned char       con_hold[CON_HOLD_SIZE]; /* Console input read
+                                           while con2tty is full, so the
+                                           exit char is still seen */
+    size_t              con_hold_len;   /* Bytes in con_hold */
+    unsigned char       *tx_buf;        /* Translated console->tty data */
+    size_t              tx_len;         /* Bytes in tx_buf */
+    size_t              tx_off;         /* Bytes of tx_buf written */
+    bool                tx_eol;         /* tx_buf ends at end of line */
+    uint64_t            tx_next;        /* Time of the next paced send */
+    ev_timer            tx_timer;       /* Pacer timer */
+    ev_timer            vtime_timer;    /* Partial read timer (--vtime) */
+    void                (*tx_fill)(void *data); /* con2tty->tx_buf */
+
+    /* Received data pipeline, see uterm_pipe_setup() */
+    rx_stage            rx_line[RX_STAGES_MAX]; /* For all data */
+    int                 rx_nline;               /* Count of them */
+    rx_stage            rx_con[RX_STAGES_MAX];  /* For console data */
+    int                 rx_ncon;                /* Count of them */
+
+    /* Zero-copy mode, see uterm_splice_pump() */
+    bool                splice;         /* Zero-copy mode is active */
+    bool                splice_con;     /* Console accepts splice() */
+    int                 pipe_in[2];     /* tty->pipe_in */
+    int                 pipe_con[2];    /* pipe_in->console */
+    int                 fd_tee_pipe;    /* pipe_in->tee writer */
+    int                 fd_null;        /* /dev/null, for dropped data */
+    ev_source           src_tee_pipe;   /* Tee pipe, write end */
+    size_t              in_pending;     /* Bytes in pipe_in */
+    size_t              in_teed;        /* pipe_in bytes already in pipe_con */
+    size_t              con_pending;    /* Bytes in pipe_con */
+    unsigned long long  tee_dropped;    /* Bytes dropped from tee */
+
+    /* Statistics */
+    stats_io            st_tty_in;      /* TTY reads */
+    stats_io            st_tty_out;     /* TTY writes */
+    stats_io            st_con_in;      /* Console reads */
+    stats_io            st_con_out;     /* Console writes */
+    unsigned long long  st_tee_bytes;   /* Bytes queued to tee */
+    ev_source           src_signal;     /* Signals self-pipe */
+    ev_source           src_stats;      /* Statistics socket */
+    capture             cap;            /* Capture file */
+    bool                capturing;      /* Capture file is open */
+    ev_timer            cap_timer;      /* Capture block age limit */
+
+    /* Bulk upload (--send) */
+    bool                sending;        /* Upload in progress */
+    const unsigned char *send_data;     /* Mapped file */
+    size_t              send_size;      /* File size */
+    size_t              send_pos;       /* Bytes of file expanded */
+    unsigned char       *send_buf;      /* Expanded chunk */
+    size_t              send_len;       /* Bytes in send_buf */
+    size_t              send_off;       /* Bytes of send_buf written */
+    bool                send_eol;       /* Chunk ends at end of line */
+    bool                send_drain;     /* Waiting for driver queue drain */
+    bool                send_wait;      /* Waiting for prompt */
+    size_t              *prompt_fail;   /* Prompt KMP failure function */
+    size_t              prompt_len;     /* Prompt length */
+    size_t              prompt_match;   /* Prompt bytes matched */
+    uint64_t            send_start;     /* Upload start time */
+    uint64_t            char_ns;        /* Character time on the line */
+    unsigned long long  send_wire;      /* Bytes written to the line */
+    uint64_t            send_held;      /* Hold-off time at upload start */
+
+    /* Line timestamps */
+    tstamp              ts;             /* Timestamps formatter */
+    bool                ts_bol;         /* At the beginning of line */
+    unsigned char       *ts_in;         /* Received chunk */
+    unsigned char       *ts_out;        /* Stamped chunk */
+    size_t              ts_out_len;     /* Bytes in ts_out */
+    size_t              ts_out_pos;     /* Bytes moved to tty2con */
+    hexd                hex;            /* Hex dump, uses ts_in/ts_out */
+
+    /* Line reconnect (--reconnect) */
+    bool                tty_lost;       /* Line is lost, waiting for it */
+    uint64_t            tty_lost_at;    /* When line was lost */
+    ev_timer            reconnect_timer; /* Reopen retry timer */
+    ev_source           src_watch;      /* inotify on line directory */
+    int                 watch_wd;       /* inotify watch, -1 if none */
+    unsigned long long  reconnects;     /* Count of reconnects */
+
+    /* Modem lines watch (--flow rtscts) */
+    int                 modem_pipe[2];  /* Watcher->loop pipe */
+    ev_source           src_modem;      /* Its read end */
+    pthread_t           modem_thread;   /* Watcher thread */
+    bool                modem_watch;    /* Watcher is running */
+    atomic_bool         modem_stop;     /* Watcher must exit */
+    atomic_bool         modem_exited;   /* Watcher is about to exit */
+    int                 modem_fd;       /* Line, watched by the thread */
+    int                 modem;          /* Modem lines, TIOCM_xxx */
+    uint64_t            held_since;     /* CTS is down since, 0 if up */
+    uint64_t            held_ns;        /* Total CTS down time */
+    unsigned long long  holds;          /* Count of CTS drops */
+    unsigned long long  modem_changes;  /* Count of DSR/DCD changes */
+
+    /* RX thread (--rx-thread) */
+    ring                rx_ring;        /* RX thread->loop ring */
+    rx_time             rx_times[RX_TIMES]; /* Read times of rx_ring */
+    atomic_size_t       rx_time_head;   /* Oldest slot, loop side */
+    atomic_size_t       rx_time_tail;   /* Next slot, thread side */
+    pthread_t           rx_tid;         /* RX thread */
+    bool                rx_running;     /* RX thread is started */
+    bool                rx_uring;       /* Line is read by io_uring */
+    int                 rx_fd;          /* Line, read by the thread */
+    int                 rx_wake[2];     /* Thread->loop wakeup pipe */
+    int                 rx_ctl[2];      /* Loop->thread control pipe */
+    ev_source           src_rx;         /* Read end of rx_wake */
+    atomic_bool         rx_notified;    /* Wakeup is in the pipe */
+    atomic_bool         rx_waiting;     /* Thread waits for ring space */
+    atomic_bool         rx_done;        /* Thread exited on read error */
+    int                 rx_err;         /* Its errno, 0 for EOF */
+    atomic_ullong       rx_reads;       /* Count of reads */
+    atomic_ullong       rx_max_read;    /* Largest read, bytes */
+    atomic_ullong       rx_max_late;    /* Worst wakeup latency, ns */
+    atomic_ullong       rx_full;        /* Count of ring full waits */
+
+    /* Scrollback search (--scrollback) */
+    scrollback          sb;             /* Console output history */
+    ring                con_ui;         /* Search output to console */
+    bool                searching;      /* Search is active */
+    char                query[SB_QUERY_MAX]; /* Search query */
+    size_t              query_len;      /* Its length */
+    uint64_t            match;          /* Current match, or UINT64_MAX */
+
+    /* Pattern triggers (--on) */
+    unsigned int        trig_state;     /* Automaton state */
+    unsigned long long  trig_hits;      /* Count of matches */
+    const trig_rule     *trig_pending[TRIG_PENDING_MAX]; /* Send rules,
+                                           waiting for con2tty space */
+    int                 trig_npending;  /* Count of them */
+    unsigned long long  trig_dropped;   /* Sends lost, queue was full */
+
+    /* Latency probe (--latency-probe) */
+    uint64_t            *probe_lat;     /* Round trip times, ns */
+    int                 probe_sent;     /* Count of probes sent */
+    int                 probe_echoed;   /* Count of echoes received */
+    unsigned char       probe_seq;      /* Byte of the probe in flight */
+    uint64_t            probe_time;     /* When it was sent, 0 if echoed */
+    ev_timer            probe_timer;    /* Next probe, or echo timeout */
+
+    /* Orderly shutdown, see uterm_exit() */
+    bool                exiting;        /* Draining buffers before exit */
+    int                 exit_code;      /* Exit code */
+    ev_timer            exit_timer;     /* Drain time limit */
+    void                (*done)(void *data); /* Called instead of exit()
+                                                (-m and --listen, set
+                                                before uterm_setup()) */
+    bool                finished;       /* done() was called */
+
+    /* Console rendering (--render-fps) */
+    bool                render_frame;   /* Frame is being written */
+    ev_timer            render_timer;   /* Next frame timer */
+    unsigned char       *skip_buf;      /* Skipped data */
+    unsigned long long  render_skipped; /* Skipped, not reported yet */
+    unsigned long long  st_skipped;     /* Skipped, total */
+
+    /* Batch mode (--batch) */
+    bool                con_data;       /* Console input is data, not
+                                           keystrokes: no exit char,
+                                           no search (set before
+                                           uterm_setup()) */
+    bool                con_eof;        /* Console input has ended */
+    bool                batch_drained;  /* Input is on the wire */
+    ev_timer            batch_timer;    /* Drain poll, then exit timer */
+} uterm_state;
+
+static uterm_state      uterm_ctx;
+
+/*
+ * Make file descriptor non-blocking
+ */
+static void
+fd_nonblock (int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        panic_perror("fcntl(O_NONBLOCK)");
+    }
+}
+
+/*
+ * Make pipe with both ends non-blocking and close-on-exec
+ */
+static void
+fd_pipe (int fds[2])
+{
+    if (pipe(fds) == -1) {
+        panic_perror("pipe()");
+    }
+
+    fd_nonblock(fds[0]);
+    fd_nonblock(fds[1]);
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+}
+
+/*
+ * Put data into the ring buffer. Caller must check space
+ */
+static void
+uterm_ring_put (ring *r, const unsigned char *p, size_t len)
+{
+    while (len != 0) {
+        unsigned char   *dst;
+        size_t          n = ring_write_ptr(r, &dst);
+
+        n = n < len ? n : len;
+        memcpy(dst, p, n);
+        ring_produce(r, n);
+        p += n;
+        len -= n;
+    }
+}
+
+/*
+ * Check, if received data may be skipped for console, when tty2con
+ * is full: with --render-fps, and while scrollback search holds
+ * console output. Line stages still get everything
+ */
+static inline bool
+uterm_render_can_skip (uterm_state *u)
+{
+    return opt_render_fps || u->searching;
+}
+
+/*
+ * Put skip marker into tty2con, if data was skipped and marker
+ * fits. Returns true, if marker was put
+ */
+static bool
+uterm_render_marker (uterm_state *u)
+{
+    char    marker[64];
+    int     len;
+
+    if (u->render_skipped == 0) {
+        return false;
+    }
+
+    len = snprintf(marker, sizeof(marker),
+        "\r\n[%s: %llu bytes skipped]\r\n", program_name, u->render_skipped);
+    if (ring_space(&u->tty2con) < (size_t) len) {
+        return false;
+    }
+
+    uterm_ring_put(&u->tty2con, (unsigned char*) marker, len);
+    u->render_skipped = 0;
+
+    return true;
+}
+
+/*
+ * Move held console input to con2tty, as space allows
+ */
+static void
+uterm_con_unhold (uterm_state *u)
+{
+    size_t  n = ring_space(&u->con2tty);
+
+    if (u->con_hold_len == 0 || n == 0) {
+        return;
+    }
+
+    n = n < u->con_hold_len ? n : u->con_hold_len;
+    uterm_ring_put(&u->con2tty, u->con_hold, n);
+    u->con_hold_len -= n;
+    memmove(u->con_hold, u->con_hold + n, u->con_hold_len);
+}
+
+/*
+ * Finish orderly shutdown. Embedded data path (-m and --listen)
+ * tells its owner, which exits when its own buffers are drained;
+ * after that the data path is idle
+ */
+static void
+uterm_done (uterm_state *u)
+{
+    if (u->done == NULL) {
+        exit(u->exit_code);
+    }
+
+    if (!u->finished) {
+        u->finished = true;
+        ev_timer_stop(u->loop, &u->exit_timer);
+        u->done(u);
+    }
+}
+
+/*
+ * Recompute interest masks after buffers state was changed
+ */
+static void
+uterm_update (uterm_state *u)
+{
+    unsigned int        tty = 0;
+
+    if (u->finished) {
+        return;
+    }
+
+    uterm_con_unhold(u);
+
+    /* Exit waits until received data is on console and typed on line */
+    if (u->exiting && ring_count(&u->tty2con) == 0 &&
+        u->ts_out_pos == u->ts_out_len && u->con_pending == 0 &&
+        u->in_pending == 0 && u->in_teed == 0 &&
+        (u->tty_lost ||
+         (ring_count(&u->con2tty) == 0 && u->con_hold_len == 0 &&
+          u->tx_off == u->tx_len))) {
+        uterm_done(u);
+        return;
+    }
+
+    if (u->splice) {
+        tty |= u->in_pending == 0 && !u->exiting ? EV_READ : 0;
+        if (u->fd_tee_pipe >= 0) {
+            ev_want(u->loop, &u->src_tee_pipe, u->in_teed ? EV_WRITE : 0);
+        }
+    } else if ((ring_space(&u->tty2con) != 0 || uterm_render_can_skip(u)) &&
+               !u->exiting) {
+        tty |= EV_READ;
+    }
+
+    if (u->sending) {
+        tty |= u->send_wait || u->tx_timer.active ? 0 : EV_WRITE;
+    } else if ((ring_count(&u->con2tty) != 0 || u->tx_off != u->tx_len) &&
+               !u->tx_timer.active) {
+        tty |= EV_WRITE;
+    }
+
+    if (opt_rx_thread) {
+        ev_want(u->loop, &u->src_rx, tty & EV_READ);
+        tty &= ~EV_READ;
+    }
+
+    if (!u->tty_lost) {
+        ev_want(u->loop, &u->src_tty, tty);
+    }
+
+    /* Interactive console is read into con_hold, when line is behind */
+    ev_want(u->loop, &u->src_con_in,
+        (ring_space(&u->con2tty) != 0 ||
+         (!u->con_data && u->con_hold_len < CON_HOLD_SIZE)) &&
+        !u->exiting && !u->con_eof ? EV_READ : 0);
+
+    ev_want(u->loop, &u->src_con_out,
+        (ring_count(&u->tty2con) != 0 && !u->searching &&
+         (u->render_frame || !u->render_timer.active)) ||
+        ring_count(&u->con_ui) != 0 ||
+        u->con_pending != 0 ? EV_WRITE : 0);
+}
+
+/*
+ * Exit timer callback: buffers were not drained in time
+ */
+static void
+uterm_exit_callback (ev_timer *timer)
+{
+    uterm_state *u = timer->data;
+
+    uterm_done(u);
+}
+
+/*
+ * Start orderly shutdown (exit char, exit trigger, end of batch,
+ * SIGTERM and friends). Line and console are not read anymore;
+ * exit (see uterm_done()) happens in uterm_update(), when received
+ * data (including --splice pipes) is written to console and tee and
+ * typed data to the line, or after SHUTDOWN_DRAIN_NS, if they don't
+ * drain (e.g., console is stopped with ctrl-S). Then atexit handlers
+ * flush and sync tee and capture, print statistics and restore
+ * console and line settings
+ */
+static void
+uterm_exit (uterm_state *u, int code)
+{
+    if (u->exiting) {
+        return;
+    }
+
+    u->exiting = true;
+    u->exit_code = code;
+    uterm_render_marker(u);
+    ev_timer_start(u->loop, &u->exit_timer, now_ns() + SHUTDOWN_DRAIN_NS,
+        uterm_exit_callback, u);
+}
+
+/*
+ * Get total time transmit was held off by CTS, in nanoseconds
+ */
+static uint64_t
+uterm_modem_held (uterm_state *u)
+{
+    return u->held_ns + (u->held_since ? now_ns() - u->held_since : 0);
+}
+
+/*
+ * Collect statistics. Returns count of entries
+ */
+static int
+uterm_stats (uterm_state *u, stats_entry *e)
+{
+    int                         cnt = 0;
+    unsigned long long          tee_pending = 0, tee_max = 0;
+#if     defined(__linux__) && defined(TIOCGICOUNT)
+    struct serial_icounter_struct   ic;
+#endif
+
+#define STAT(g,n,v)     \
+    do {                \
+        e[cnt].group = g; e[cnt].name = n; e[cnt].value = v; cnt ++; \
+    } while (0)
+
+    STAT("tty", "read_bytes", u->st_tty_in.bytes);
+    STAT("tty", "reads", u->st_tty_in.calls);
+    STAT("tty", "write_bytes", u->st_tty_out.bytes);
+    STAT("tty", "writes", u->st_tty_out.calls);
+    STAT("tty", "short_writes", u->st_tty_out.shorts);
+    STAT("tty", "blocked_ms", stats_io_blocked_ms(&u->st_tty_out));
+    if (opt_reconnect) {
+        STAT("tty", "reconnects", u->reconnects);
+    }
+    if (trig.nrules != 0) {
+        STAT("triggers", "hits", u->trig_hits);
+        STAT("triggers", "send_dropped", u->trig_dropped);
+    }
+    if (opt_flow == FLOW_RTSCTS) {
+        STAT("flow", "holds", u->holds);
+        STAT("flow", "held_ms", uterm_modem_held(u) / 1000000);
+        STAT("flow", "cts", !!(u->modem & TIOCM_CTS));
+        STAT("flow", "dsr", !!(u->modem & TIOCM_DSR));
+        STAT("flow", "dcd", !!(u->modem & TIOCM_CD));
+        STAT("flow", "dsr_dcd_changes", u->modem_changes);
+    }
+
+    STAT("console", "read_bytes", u->st_con_in.bytes);
+    STAT("console", "reads", u->st_con_in.calls);
+    STAT("console", "write_bytes", u->st_con_out.bytes);
+    STAT("console", "writes", u->st_con_out.calls);
+    STAT("console", "short_writes", u->st_con_out.shorts);
+    STAT("console", "blocked_ms", stats_io_blocked_ms(&u->st_con_out));
+    if (opt_render_fps) {
+        STAT("console", "skipped_bytes", u->st_skipped);
+    }
+
+    if (u->fd_tee >= 0) {
+        if (u->splice) {
+            int     n = 0;
+            ioctl(u->tee.pipe[0], FIONREAD, &n);
+            tee_pending = n;
+        } else {
+            tee_pending = ring_count(&u->tee.ring);
+            tee_max = u->tee.ring.hwm;
+        }
+
+        STAT("tee", "bytes", u->st_tee_bytes);
+        STAT("tee", "pending", tee_pending);
+        STAT("tee", "pending_max", tee_max);
+        STAT("tee", "dropped", u->tee.dropped + u->tee_dropped);
+        STAT("tee", "spilled_max", u->tee.spilled_max);
+    }
+
+    if (opt_rx_thread || u->rx_uring) {
+        STAT("rx", "reads", atomic_load(&u->rx_reads));
+        STAT("rx", "max_read", atomic_load(&u->rx_max_read));
+        STAT("rx", "max_latency_us", atomic_load(&u->rx_max_late) / 1000);
+        STAT("rx", "ring_full", atomic_load(&u->rx_full));
+    }
+
+    STAT("buffers", "tty2con_hwm", u->tty2con.hwm);
+    STAT("buffers", "tty2con_size", u->tty2con.size);
+    STAT("buffers", "con2tty_hwm", u->con2tty.hwm);
+    STAT("buffers", "con2tty_size", u->con2tty.size);
+
+    STAT("memory", "arena_size", mem_arena.size);
+    STAT("memory", "arena_used", atomic_load(&mem_arena.used));
+    STAT("memory", "hugepages", mem_arena.huge);
+    STAT("memory", "overflows", atomic_load(&mem_arena.overflows));
+    STAT("memory", "late_allocs", atomic_load(&mem_arena.late));
+    if (mem_arena.lib_heap != 0) {
+        STAT("memory", "lib_heap", mem_arena.lib_heap);
+    }
+
+#if     defined(__linux__) && defined(TIOCGICOUNT)
+    if (ioctl(u->src_tty.fd, TIOCGICOUNT, &ic) == 0) {
+        STAT("driver", "rx", ic.rx);
+        STAT("driver", "tx", ic.tx);
+        STAT("driver", "frame", ic.frame);
+        STAT("driver", "overrun", ic.overrun);
+        STAT("driver", "parity", ic.parity);
+        STAT("driver", "brk", ic.brk);
+        STAT("driver", "buf_overrun", ic.buf_overrun);
+    }
+#endif
+
+#undef  STAT
+
+    return cnt;
+}
+
+/*
+ * Print statistics entries to stderr
+ *
+ * stderr may share non-blocking file with the console, and its
+ * flags belong to the console code, so statistics is formatted
+ * into memory and written with STATS_PRINT_RETRIES waits of
+ * STATS_PRINT_TIMEOUT ms at most, if stderr is not writable
+ */
+static void
+stats_print (const stats_entry *e, int cnt)
+{
+    size_t      size, off = 0;
+    int         retries = STATS_PRINT_RETRIES;
+    char        *buf = stats_text(e, cnt, false, &size);
+
+    fflush(stderr);
+
+    while (off < size) {
+        ssize_t rc = write(2, buf + off, size - off);
+
+        if (rc > 0) {
+            off += rc;
+        } else if (rc < 0 && errno == EINTR) {
+            continue;
+        } else if (rc < 0 && errno == EAGAIN && retries-- > 0) {
+            struct pollfd   pfd = {.fd = 2, .events = POLLOUT};
+            poll(&pfd, 1, STATS_PRINT_TIMEOUT);
+        } else {
+            break;
+        }
+    }
+
+    stats_text_free(buf);
+}
+
+/*
+ * Print statistics of the uterm to stderr
+ */
+static void
+uterm_stats_print (uterm_state *u)
+{
+    stats_entry e[STATS_MAX_ENTRIES];
+
+    stats_print(e, uterm_stats(u, e));
+}
+
+/*
+ * Report statistics. Called at exit, after console mode is restored
+ */
+static void
+uterm_report (void)
+{
+    uterm_state *u = &uterm_ctx;
+
+    if (u->tty2con.size == 0) {
+        return;
+    }
+
+    uterm_stats_print(u);
+}
+
+/*
+ * Statistics socket callback: each connected client gets
+ * JSON statistics, and connection is closed
+ */
+static void
+uterm_stats_callback (ev_source *src, unsigned int events)
+{
+    uterm_state *u = src->data;
+    int         fd;
+
+    (void) events;
+
+    for (;;) {
+        stats_entry e[STATS_MAX_ENTRIES];
+        char        *buf;
+        size_t      size;
+
+        fd = accept(src->fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+
+            /* EAGAIN or out of descriptors: wait for the next event */
+            break;
+        }
+
+        buf = stats_text(e, uterm_stats(u, e), true, &size);
+        send(fd, buf, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+        stats_text_free(buf);
+        close(fd);
+    }
+
+    ev_clear(src, EV_READ);
+}
+
+/*
+ * Remove statistics socket. Called at exit
+ */
+static void
+uterm_stats_cleanup (void)
+{
+    unlink(opt_stats_socket);
+}
+
+/*
+ * Open statistics socket
+ */
+static int
+uterm_stats_open (void)
+{
+    struct sockaddr_un  addr;
+    int                 fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(opt_stats_socket) >= sizeof(addr.sun_path)) {
+        panic("%s: socket path too long", opt_stats_socket);
+    }
+    strcpy(addr.sun_path, opt_stats_socket);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        panic_perror("socket()");
+    }
+
+    unlink(opt_stats_socket);
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1 ||
+        listen(fd, 8) == -1) {
+        panic_perror("%s", opt_stats_socket);
+    }
+
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fd_nonblock(fd);
+    atexit(uterm_stats_cleanup);
+
+    return fd;
+}
+
+/***** Signals *****/
+/*
+ * Signals are delivered into the main loop via self-pipe
+ *
+ * SIGTERM, SIGHUP and SIGINT start orderly shutdown. If another one
+ * comes while it is in progress, the main loop is not trusted: the
+ * handler restores console mode and line driver settings, which is
+ * async-signal-safe, and exits at once
+ */
+static int                      sig_pipe[2] = {-1, -1};
+static volatile sig_atomic_t    sig_exiting = 0;
+
+/*
+ * Signal handler
+ */
+static void
+sig_handler (int signo)
+{
+    int             saved_errno = errno;
+    unsigned char   c = signo;
+
+    if (signo != SIGUSR1) {
+        if (sig_exiting) {
+            console_restore();
+            tty_tune_reset();
+            _exit(128 + signo);
+        }
+        sig_exiting = 1;
+    }
+
+    write(sig_pipe[1], &c, 1);
+    errno = saved_errno;
+}
+
+/*
+ * Setup signal handling. Returns read end of the self-pipe
+ */
+static int
+sig_init (void)
+{
+    struct sigaction    act;
+
+    if (pipe(sig_pipe) == -1) {
+        panic_perror("pipe()");
+    }
+
+    fd_nonblock(sig_pipe[0]);
+    fd_nonblock(sig_pipe[1]);
+    fcntl(sig_pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(sig_pipe[1], F_SETFD, FD_CLOEXEC);
+
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = sig_handler;
+    act.sa_flags = SA_RESTART;
+    sigemptyset(&act.sa_mask);
+    sigaction(SIGUSR1, &act, NULL);
+    sigaction(SIGTERM, &act, NULL);
+    sigaction(SIGHUP, &act, NULL);
+    sigaction(SIGINT, &act, NULL);
+
+    /* Closed stdout pipe is an error, so exit is orderly */
+    act.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &act, NULL);
+
+    return sig_pipe[0];
+}
+
+/*
+ * Signals self-pipe callback
+ */
+static void
+uterm_signal_callback (ev_source *src, unsigned int events)
+{
+    uterm_state     *u = src->data;
+    unsigned char   sigs[64];
+    ssize_t         rc, i;
+
+    (void) events;
+
+    while ((rc = read(src->fd, sigs, sizeof(sigs))) > 0) {
+        for (i = 0; i < rc; i ++) {
+            if (sigs[i] == SIGUSR1) {
+                uterm_stats_print(u);
+            } else {
+                uterm_exit(u, 128 + sigs[i]);
+            }
+        }
+    }
+
+    ev_clear(src, EV_READ);
+    uterm_update(u);
+}
+
+/*
+ * Modem lines watch (--flow rtscts)
+ *
+ * TIOCMIWAIT blocks until CTS, DSR or DCD changes, so it runs in
+ * a small watcher thread, which only pokes the event loop through
+ * a pipe. Lines are read with TIOCMGET and accounted in the loop:
+ * while CTS is down, transmit is held off by the driver
+ *
+ * Watcher exits when ioctl fails; it happens when line doesn't
+ * support modem lines (i.e., pseudo-terminal). When line is lost,
+ * watcher is stopped before the line is closed: TIOCMIWAIT is
+ * interrupted by SIGURG (see uterm_modem_stop()). After reconnect,
+ * watcher is restarted
+ */
+#ifdef  TIOCMIWAIT
+static void*
+uterm_modem_thread (void *arg)
+{
+    uterm_state *u = arg;
+
+    while (!atomic_load(&u->modem_stop)) {
+        if (ioctl(u->modem_fd, TIOCMIWAIT,
+                  TIOCM_CTS | TIOCM_DSR | TIOCM_CD) == 0) {
+            write(u->modem_pipe[1], "c", 1);
+        } else if (errno != EINTR) {
+            break;
+        }
+    }
+
+    atomic_store(&u->modem_exited, true);
+    write(u->modem_pipe[1], "x", 1);
+    return NULL;
+}
+
+/*
+ * SIGURG handler: does nothing, only interrupts TIOCMIWAIT
+ */
+static void
+uterm_modem_wake (int sig)
+{
+    (void) sig;
+}
+#endif
+
+/*
+ * Update modem lines state
+ */
+static void
+uterm_modem_update (uterm_state *u)
+{
+    int         lines;
+    uint64_t    now = now_ns();
+
+    if (u->tty_lost || ioctl(u->src_tty.fd, TIOCMGET, &lines) == -1) {
+        return;
+    }
+
+    if ((lines ^ u->modem) & (TIOCM_DSR | TIOCM_CD)) {
+        u->modem_changes ++;
+    }
+
+    if (!(lines & TIOCM_CTS) && u->held_since == 0) {
+        u->held_since = now;
+        u->holds ++;
+    } else if ((lines & TIOCM_CTS) && u->held_since != 0) {
+        u->held_ns += now - u->held_since;
+        u->held_since = 0;
+    }
+
+    u->modem = lines;
+}
+
+/*
+ * Modem watcher pipe callback
+ */
+static void
+uterm_modem_callback (ev_source *src, unsigned int events)
+{
+    uterm_state *u = src->data;
+    char        buf[64];
+    ssize_t     rc, i;
+
+    (void) events;
+
+    while ((rc = read(src->fd, buf, sizeof(buf))) > 0) {
+        for (i = 0; i < rc; i ++) {
+            if (buf[i] == 'x' && u->modem_watch) {
+                pthread_join(u->modem_thread, NULL);
+                u->modem_watch = false;
+            }
+        }
+    }
+
+    ev_clear(src, EV_READ);
+    uterm_modem_update(u);
+}
+
+/*
+ * Start modem lines watch, if not running. Pipe must be added
+ * by uterm_setup()
+ */
+static void
+uterm_modem_start (uterm_state *u)
+{
+#ifdef  TIOCMIWAIT
+    static bool wake_set;
+    int         rc;
+
+    if (u->modem_watch) {
+        return;
+    }
+
+    uterm_modem_update(u);
+
+    if (!wake_set) {
+        struct sigaction    act;
+
+        /* No SA_RESTART, so TIOCMIWAIT fails with EINTR */
+        memset(&act, 0, sizeof(act));
+        act.sa_handler = uterm_modem_wake;
+        sigaction(SIGURG, &act, NULL);
+        wake_set = true;
+    }
+
+    u->modem_fd = u->src_tty.fd;
+    atomic_store(&u->modem_stop, false);
+    atomic_store(&u->modem_exited, false);
+    rc = pthread_create(&u->modem_thread, NULL, uterm_modem_thread, u);
+    if (rc != 0) {
+        errno = rc;
+        panic_perror("pthread_create()");
+    }
+
+    u->modem_watch = true;
+#else
+    (void) u;
+#endif
+}
+
+/*
+ * Stop modem lines watch, if running, before the line is closed.
+ * Signal may come just before the thread enters TIOCMIWAIT, so it
+ * is repeated until the thread exits. Its pipe is drained, so
+ * stale exit notice doesn't join the next watcher
+ */
+static void
+uterm_modem_stop (uterm_state *u)
+{
+#ifdef  TIOCMIWAIT
+    char    buf[64];
+
+    if (!u->modem_watch) {
+        return;
+    }
+
+    atomic_store(&u->modem_stop, true);
+    while (!atomic_load(&u->modem_exited)) {
+        pthread_kill(u->modem_thread, SIGURG);
+        poll(NULL, 0, 1);
+    }
+
+    pthread_join(u->modem_thread, NULL);
+    while (read(u->modem_pipe[0], buf, sizeof(buf)) > 0)
+        ;
+
+    u->modem_watch = false;
+#else
+    (void) u;
+#endif
+}
+
+/*
+ * RX thread (--rx-thread)
+ *
+ * Line is read by a dedicated thread, optionally pinned to a CPU
+ * and running SCHED_FIFO, so neither console, nor tee, nor triggers
+ * may delay the read. The thread only moves data into rx_ring, and
+ * uterm_tty_recv() takes it from there instead of read(); the rest
+ * of the data path is the same. Time of each read is kept in the
+ * rx_times slot next to its data, so timestamps and capture get
+ * the read time, not the time the loop came to process it
+ *
+ * Thread wakes the loop through the rx_wake pipe, once until the
+ * loop finds the ring empty (rx_notified). When the ring is full,
+ * thread sleeps on the rx_ctl pipe, and the loop pokes it after
+ * taking data (rx_waiting). The same pipe stops the thread
+ *
+ * Wakeup latency is estimated from the backlog found by each read:
+ * thread is woken by VMIN bytes, so the rest arrived while it was
+ * not running yet, one character time each. Bytes that device
+ * delivers at once (UART FIFO trigger level, USB packet) are counted
+ * too, so this is the upper bound
+ */
+
+/*
+ * Drain a non-blocking pipe. Returns true, if stop request ('x')
+ * was seen
+ */
+static bool
+uterm_rx_drain (int fd)
+{
+    char        buf[64];
+    ssize_t     rc, i;
+    bool        stop = false;
+
+    while ((rc = read(fd, buf, sizeof(buf))) > 0) {
+        for (i = 0; i < rc; i ++) {
+            stop = stop || buf[i] == 'x';
+        }
+    }
+
+    return stop;
+}
+
+/*
+ * Wake the loop, if not woken yet (RX thread side)
+ */
+static void
+uterm_rx_notify (uterm_state *u)
+{
+    if (!atomic_exchange(&u->rx_notified, true)) {
+        write(u->rx_wake[1], "", 1);
+    }
+}
+
+/*
+ * Get free space for the next read (RX thread side). Returns 0
+ * when either rx_ring or rx_times is full
+ */
+static size_t
+uterm_rx_space (uterm_state *u, unsigned char **data)
+{
+    size_t      used = atomic_load_explicit(&u->rx_time_tail,
+                           memory_order_relaxed) -
+                       atomic_load_explicit(&u->rx_time_head,
+                           memory_order_acquire);
+
+    return used < RX_TIMES ? ring_write_ptr(&u->rx_ring, data) : 0;
+}
+
+/*
+ * Add len bytes, read at time t, to rx_ring. Time slot is
+ * published before data, so loop always finds it
+ */
+static void
+uterm_rx_produce (uterm_state *u, size_t len, uint64_t t)
+{
+    ring        *r = &u->rx_ring;
+    size_t      slot = atomic_load_explicit(&u->rx_time_tail,
+                           memory_order_relaxed);
+
+    u->rx_times[slot % RX_TIMES].end = len +
+        atomic_load_explicit(&r->tail, memory_order_relaxed);
+    u->rx_times[slot % RX_TIMES].ns = t;
+    atomic_store_explicit(&u->rx_time_tail, slot + 1, memory_order_release);
+
+    atomic_fetch_add_explicit(&u->rx_reads, 1, memory_order_relaxed);
+    if ((unsigned long long) len >
+        atomic_load_explicit(&u->rx_max_read, memory_order_relaxed)) {
+        atomic_store_explicit(&u->rx_max_read, len, memory_order_relaxed);
+    }
+
+    ring_produce(r, len);
+}
+
+/*
+ * RX thread
+ */
+static void*
+uterm_rx_thread (void *arg)
+{
+    uterm_state         *u = arg;
+    uint64_t            now;
+    int                 timeout = opt_vtime != 0 && opt_vmin > 1 ?
+                            opt_vtime * 100 : -1;
+
+    for (;;) {
+        struct pollfd   fds[2] = {
+            {.fd = u->rx_ctl[0], .events = POLLIN},
+            {.fd = u->rx_fd, .events = POLLIN}
+        };
+        unsigned char   *data;
+        size_t          space = uterm_rx_space(u, &data);
+        unsigned long   speed = atomic_load_explicit(&u->speed,
+                                    memory_order_relaxed);
+        ssize_t         rc;
+
+        if (space == 0) {
+            atomic_store(&u->rx_waiting, true);
+            atomic_thread_fence(memory_order_seq_cst);
+            space = uterm_rx_space(u, &data);
+            if (space == 0) {
+                atomic_fetch_add_explicit(&u->rx_full, 1,
+                    memory_order_relaxed);
+            }
+        }
+
+        /* With --vtime, data below VMIN is read after timeout */
+        rc = poll(fds, space != 0 ? 2 : 1, timeout);
+        if (rc == -1) {
+            continue;
+        }
+
+        if (fds[0].revents != 0 && uterm_rx_drain(u->rx_ctl[0])) {
+            return NULL;
+        }
+
+        if (space == 0 || (fds[1].revents == 0 && rc != 0)) {
+            continue;
+        }
+
+        rc = read(u->rx_fd, data, space);
+        if (rc < 0 && (errno == EINTR || errno == EAGAIN)) {
+            continue;
+        } else if (rc <= 0) {
+            u->rx_err = rc < 0 ? errno : 0;
+            atomic_store(&u->rx_done, true);
+            uterm_rx_notify(u);
+            return NULL;
+        }
+
+        now = now_ns();
+
+        if (rc > opt_vmin && speed != 0) {
+            unsigned long long late = (rc - opt_vmin) * 10000000000ULL / speed;
+
+            if (late > atomic_load_explicit(&u->rx_max_late,
+                                            memory_order_relaxed)) {
+                atomic_store_explicit(&u->rx_max_late, late,
+                    memory_order_relaxed);
+            }
+        }
+
+        uterm_rx_produce(u, rc, now);
+        uterm_rx_notify(u);
+    }
+}
+
+/*
+ * Apply --rx-cpu and --rx-fifo to the RX thread. Failures are
+ * reported only once
+ */
+static void
+uterm_rx_tune (uterm_state *u)
+{
+    static bool         reported;
+    int                 rc;
+
+    if (opt_rx_cpu >= 0) {
+#ifdef  __linux__
+        cpu_set_t       set;
+
+        CPU_ZERO(&set);
+        CPU_SET(opt_rx_cpu, &set);
+        rc = pthread_setaffinity_np(u->rx_tid, sizeof(set), &set);
+#else
+        rc = ENOTSUP;
+#endif
+        if (rc != 0 && !reported) {
+            fprintf(stderr, "%s: RX thread CPU %d: %s\n",
+                program_name, opt_rx_cpu, strerror(rc));
+        }
+    }
+
+    if (opt_rx_prio != 0) {
+        struct sched_param      sp = {.sched_priority = opt_rx_prio};
+
+        rc = pthread_setschedparam(u->rx_tid, SCHED_FIFO, &sp);
+        if (rc != 0 && !reported) {
+            fprintf(stderr, "%s: RX thread SCHED_FIFO: %s\n",
+                program_name, strerror(rc));
+        }
+    }
+
+    reported = true;
+}
+
+/*
+ * Lock memory, when RX thread is real-time. Called once the data
+ * path is set up, so its buffers and thread stacks are locked (and
+ * prefaulted). Only current mappings are locked: with limited
+ * RLIMIT_MEMLOCK, MCL_FUTURE would make later allocations fail
+ */
+static void
+uterm_rx_lock (void)
+{
+    static bool         locked;
+
+    if (opt_rx_prio == 0 || locked) {
+        return;
+    }
+
+    if (mlockall(MCL_CURRENT) == -1) {
+        fprintf(stderr, "%s: mlockall(): %s\n", program_name, strerror(errno));
+    }
+
+    locked = true;
+}
+
+/*
+ * Start RX thread, if not running. Pipes and rx_ring must be
+ * set up by uterm_setup()
+ */
+static void
+uterm_rx_start (uterm_state *u)
+{
+    int         rc;
+
+    if (u->rx_running) {
+        return;
+    }
+
+    u->rx_fd = u->src_tty.fd;
+    rc = pthread_create(&u->rx_tid, NULL, uterm_rx_thread, u);
+    if (rc != 0) {
+        errno = rc;
+        panic_perror("pthread_create()");
+    }
+
+    u->rx_running = true;
+    uterm_rx_tune(u);
+}
+
+/*
+ * Stop RX thread, if running. Data already in rx_ring is kept
+ */
+static void
+uterm_rx_stop (uterm_state *u)
+{
+    if (!u->rx_running) {
+        return;
+    }
+
+    write(u->rx_ctl[1], "x", 1);
+    pthread_join(u->rx_tid, NULL);
+    uterm_rx_drain(u->rx_ctl[0]);
+
+    atomic_store(&u->rx_waiting, false);
+    atomic_store(&u->rx_done, false);
+    u->rx_running = false;
+}
+
+/*
+ * io_uring reads
+ *
+ * With io_uring event engine, and when neither RX thread, nor splice,
+ * nor --vtime timer is used, line is read by the read request that
+ * the engine keeps posted (see ev_read_start()). Kernel moves data
+ * into rx_ring while the loop is busy with console or tee, and the
+ * rest goes the same way as with the RX thread, only the producer
+ * is the loop itself. Read time is the time of completion
+ */
+
+/*
+ * Get buffer for the next io_uring read
+ */
+static size_t
+uterm_rx_uring_buf (ev_source *src, unsigned char **ptr)
+{
+    return uterm_rx_space(src->data, ptr);
+}
+
+/*
+ * io_uring read completion. EOF and errors are returned by
+ * uterm_tty_recv() after the ring is drained
+ */
+static void
+uterm_rx_uring_done (ev_source *src, ssize_t res)
+{
+    uterm_state *u = src->data;
+
+    if (res > 0) {
+        uterm_rx_produce(u, res, now_ns());
+    } else {
+        u->rx_err = res < 0 ? (int) -res : 0;
+        atomic_store(&u->rx_done, true);
+    }
+}
+
+/*
+ * Start io_uring reads of the line, if possible
+ */
+static void
+uterm_rx_uring_start (uterm_state *u)
+{
+    if (!u->rx_uring) {
+        return;
+    }
+
+    if (!ev_read_start(u->loop, &u->src_tty, u->rx_ring.data,
+        u->rx_ring.size, uterm_rx_uring_buf, uterm_rx_uring_done)) {
+        u->rx_uring = false;
+    }
+}
+
+/*
+ * Receive data from the line. Returns read() result, and time
+ * of the read (now_ns() clock) in *t: with --rx-thread or io_uring
+ * reads data is taken from rx_ring, and errors and EOF, seen by the
+ * thread or by io_uring, are returned after the ring is drained
+ *
+ * Data of one call never crosses a rx_times slot, so it all
+ * has the same read time
+ */
+static ssize_t
+uterm_tty_recv (uterm_state *u, unsigned char *buf, size_t size,
+                uint64_t *t)
+{
+    ring                *r = &u->rx_ring;
+    unsigned char       *data;
+    size_t              len, head, slot;
+    rx_time             *tm;
+    ssize_t             rc;
+
+    if (!opt_rx_thread && !u->rx_uring) {
+        rc = read(u->src_tty.fd, buf, size);
+        *t = now_ns();
+        return rc;
+    }
+
+    len = ring_read_ptr(r, &data);
+    if (len == 0 && opt_rx_thread) {
+        uterm_rx_drain(u->rx_wake[0]);
+        atomic_store(&u->rx_notified, false);
+        len = ring_read_ptr(r, &data);
+    }
+
+    if (len == 0) {
+        if (u->rx_running && atomic_load(&u->rx_done) &&
+            ring_count(r) == 0) {
+            uterm_rx_stop(u);
+            errno = u->rx_err;
+            return u->rx_err != 0 ? -1 : 0;
+        }
+
+        if (u->rx_uring && atomic_exchange(&u->rx_done, false)) {
+            errno = u->rx_err;
+            return u->rx_err != 0 ? -1 : 0;
+        }
+
+        if (opt_rx_thread) {
+            ev_clear(&u->src_rx, EV_READ);
+        }
+
+        errno = EAGAIN;
+        return -1;
+    }
+
+    head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    slot = atomic_load_explicit(&u->rx_time_head, memory_order_relaxed);
+    tm = &u->rx_times[slot % RX_TIMES];
+
+    len = len < size ? len : size;
+    len = len < tm->end - head ? len : tm->end - head;
+    *t = tm->ns;
+
+    memcpy(buf, data, len);
+    ring_consume(r, len);
+
+    if (head + len == tm->end) {
+        atomic_store_explicit(&u->rx_time_head, slot + 1,
+            memory_order_release);
+    }
+
+    if (!opt_rx_thread) {
+        return len;
+    }
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_exchange(&u->rx_waiting, false)) {
+        write(u->rx_ctl[1], "s", 1);
+    }
+
+    return len;
+}
+
+/*
+ * Line reconnect (--reconnect)
+ *
+ * When line disappears (read returns EOF, or I/O fails with EIO,
+ * ENXIO or ENODEV, that is what USB serial gives on disconnect), it
+ * is closed and removed from the event loop, and catterm waits for
+ * the device node to return. On Linux, inotify on the node directory
+ * reports within milliseconds, when node is created or udev fixes its
+ * permissions. Retry timer covers the rest (i.e., /dev/serial/by-id
+ * directory, that disappears with the last device)
+ *
+ * Line is reopened without flush, so the very first bytes after
+ * board reset are not lost. Console input is kept in con2tty while
+ * line is lost, up to the buffer size
+ */
+static void
+uterm_tty_callback (ev_source *src, unsigned int events);
+
+static void
+uterm_reconnect_try (uterm_state *u);
+
+/*
+ * Reconnect retry timer callback
+ */
+static void
+uterm_reconnect_callback (ev_timer *timer)
+{
+    uterm_reconnect_try(timer->data);
+}
+
+/*
+ * Watch line directory for the node to appear
+ */
+static void
+uterm_reconnect_watch (uterm_state *u)
+{
+#ifdef  __linux__
+    char    dir[PATH_MAX], *slash;
+
+    if (u->watch_wd >= 0 || u->src_watch.fd < 0) {
+        return;
+    }
+
+    snprintf(dir, sizeof(dir), "%s", u->line);
+    slash = strrchr(dir, '/');
+    if (slash == NULL) {
+        strcpy(dir, ".");
+    } else if (slash == dir) {
+        slash[1] = '\0';
+    } else {
+        *slash = '\0';
+    }
+
+    u->watch_wd = inotify_add_watch(u->src_watch.fd, dir,
+        IN_CREATE | IN_ATTRIB | IN_MOVED_TO);
+#else
+    (void) u;
+#endif
+}
+
+/*
+ * Try to reopen lost line. On failure, retry timer is started
+ */
+static void
+uterm_reconnect_try (uterm_state *u)
+{
+    char        err[PATH_MAX + 64];
+    int         fd;
+    unsigned long speed;
+
+    uterm_reconnect_watch(u);
+
+    fd = tty_open(u->line, false, err, sizeof(err), &speed);
+    if (fd == -1) {
+        ev_timer_start(u->loop, &u->reconnect_timer,
+            now_ns() + RECONNECT_RETRY_NS, uterm_reconnect_callback, u);
+        return;
+    }
+
+    ev_timer_stop(u->loop, &u->reconnect_timer);
+    u->speed = speed;
+    ev_add(u->loop, &u->src_tty, fd,
+        opt_rx_thread ? EV_WRITE : EV_READ | EV_WRITE, uterm_tty_callback, u);
+
+    u->tty_lost = false;
+    u->reconnects ++;
+
+    if (opt_rx_thread) {
+        uterm_rx_start(u);
+    }
+
+    uterm_rx_uring_start(u);
+
+    if (opt_flow == FLOW_RTSCTS) {
+        uterm_modem_start(u);
+    }
+
+    fprintf(stderr, "%s: %s: reconnected in %llu ms\n", program_name,
+        u->line, (unsigned long long) (now_ns() - u->tty_lost_at) / 1000000);
+
+    uterm_update(u);
+}
+
+/*
+ * Handle line loss. Returns false, if error is not recoverable
+ * (or reconnect is not enabled); err is errno value or 0 for EOF
+ */
+static bool
+uterm_tty_lost (uterm_state *u, int err)
+{
+    if (!opt_reconnect) {
+        return false;
+    }
+
+    if (err != 0 && err != EIO && err != ENXIO && err != ENODEV) {
+        return false;
+    }
+
+    fprintf(stderr, "%s: %s: %s, waiting for the line\n", program_name,
+        u->line, err ? strerror(err) : "end of input");
+
+    uterm_rx_stop(u);
+    uterm_modem_stop(u);
+    ev_del(u->loop, &u->src_tty);
+    close(u->src_tty.fd);
+    u->src_tty.fd = -1;
+    u->tty_lost = true;
+    u->tty_lost_at = now_ns();
+
+    uterm_reconnect_try(u);
+
+    return true;
+}
+
+#ifdef  __linux__
+/*
+ * inotify callback: line directory was changed
+ */
+static void
+uterm_watch_callback (ev_source *src, unsigned int events)
+{
+    uterm_state         *u = src->data;
+    _Alignas(struct inotify_event) char buf[4096];
+    const char          *base = strrchr(u->line, '/');
+    bool                retry = false;
+    ssize_t             rc, off;
+
+    (void) events;
+
+    base = base ? base + 1 : u->line;
+
+    while ((rc = read(src->fd, buf, sizeof(buf))) > 0) {
+        for (off = 0; off < rc; ) {
+            struct inotify_event    *ev = (struct inotify_event*) (buf + off);
+
+            if (ev->mask & IN_IGNORED) {
+                u->watch_wd = -1;  /* Directory is gone */
+            } else if (ev->len != 0 && !strcmp(ev->name, base)) {
+                retry = true;
+            }
+
+            off += sizeof(*ev) + ev->len;
+        }
+    }
+
+    ev_clear(src, EV_READ);
+
+    if (retry && u->tty_lost) {
+        uterm_reconnect_try(u);
+    }
+}
+#endif
+
+#ifdef  __linux__
+/*
+ * Zero-copy mode pump
+ *
+ * In this mode data is never copied into the user space:
+ *   1. Data is spliced from TTY into pipe_in, but only when
+ *      pipe_in is empty
+ *   2. Data is duplicated from pipe_in into pipe_con with tee().
+ *      In pipe_con it waits to be spliced to console
+ *   3. Duplicated part of pipe_in is moved to the tee writer
+ *      pipe, or discarded into /dev/null with the drop policy
+ *
+ * tee() always starts from the beginning of the pipe, so step 2
+ * is performed only when step 3 was completed. Without tee file,
+ * steps 2 and 3 are replaced with splice from pipe_in to pipe_con
+ *
+ * Each step may stop when destination pipe is full; pump is called
+ * again when destination makes some progress
+ */
+static void
+uterm_splice_pump (uterm_state *u)
+{
+    ssize_t     rc;
+
+    for (;;) {
+        /* Step 1: tty->pipe_in; on exit, only pipes are drained */
+        if (u->in_pending == 0) {
+            if (u->tty_lost || u->exiting) {
+                break;
+            }
+
+            rc = splice(u->src_tty.fd, NULL, u->pipe_in[1], NULL,
+                        SPLICE_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (rc < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                if (errno == EAGAIN) {
+                    u->st_tty_in.calls ++;
+                    ev_clear(&u->src_tty, EV_READ);
+                    break;
+                }
+
+                /* Hung up TTY doesn't splice, it means end of input */
+                if (uterm_tty_lost(u, errno == EINVAL ? 0 : errno)) {
+                    break;
+                }
+
+                panic_perror( "read(tty)" );
+            } else if (!rc) {
+                if (uterm_tty_lost(u, 0)) {
+                    break;
+                }
+
+                panic( "read(tty): end of input" );
+            }
+
+            stats_io_done(&u->st_tty_in, rc, rc);
+            u->in_pending = rc;
+        }
+
+        /* No tee: pipe_in->pipe_con */
+        if (u->fd_tee_pipe < 0) {
+            rc = splice(u->pipe_in[0], NULL, u->pipe_con[1], NULL,
+                        u->in_pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (rc < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                if (errno == EAGAIN) {
+                    break;
+                }
+
+                panic_perror( "splice()" );
+            }
+
+            u->in_pending -= rc;
+            u->con_pending += rc;
+            continue;
+        }
+
+        /* Step 2: pipe_in->pipe_con */
+        if (u->in_teed == 0) {
+            rc = tee(u->pipe_in[0], u->pipe_con[1], u->in_pending,
+                     SPLICE_F_NONBLOCK);
+            if (rc < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                if (errno == EAGAIN) {
+                    break;
+                }
+
+                panic_perror( "tee()" );
+            }
+
+            u->in_teed = rc;
+            u->con_pending += rc;
+        }
+
+        /* Step 3: pipe_in->tee writer */
+        rc = splice(u->pipe_in[0], NULL, u->fd_tee_pipe, NULL,
+                    u->in_teed, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (rc < 0 && errno == EAGAIN && opt_tee_policy == AW_DROP) {
+            rc = splice(u->pipe_in[0], NULL, u->fd_null, NULL,
+                        u->in_teed, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (rc > 0) {
+                u->tee_dropped += rc;
+            }
+        } else if (rc > 0) {
+            u->st_tee_bytes += rc;
+        }
+
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN) {
+                ev_clear(&u->src_tee_pipe, EV_WRITE);
+                break;
+            }
+
+            panic_perror( "write(%s)", u->tee_name );
+        }
+
+        u->in_teed -= rc;
+        u->in_pending -= rc;
+    }
+}
+
+/*
+ * Move data from pipe_con to console
+ *
+ * If console doesn't support splice(), data is read from
+ * pipe_con into the tty2con ring and written from there
+ */
+static void
+uterm_splice_con (uterm_state *u)
+{
+    unsigned char       *data;
+    size_t              space;
+
+    while (u->con_pending != 0) {
+        ssize_t     rc;
+
+        if (u->splice_con) {
+            rc = splice(u->pipe_con[0], NULL, u->src_con_out.fd, NULL,
+                        u->con_pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (rc < 0 && errno == EINVAL) {
+                u->splice_con = false;
+                continue;
+            }
+        } else {
+            if (ring_count(&u->tty2con) != 0) {
+                break;
+            }
+
+            space = ring_write_ptr(&u->tty2con, &data);
+            space = space < u->con_pending ? space : u->con_pending;
+            rc = read(u->pipe_con[0], data, space);
+            if (rc > 0) {
+                ring_produce(&u->tty2con, rc);
+            }
+        }
+
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN) {
+                if (u->splice_con) {
+                    stats_io_blocked(&u->st_con_out);
+                }
+                ev_clear(&u->src_con_out, EV_WRITE);
+                break;
+            }
+
+            panic_perror( "write(console)" );
+        }
+
+        if (u->splice_con) {
+            stats_io_done(&u->st_con_out, u->con_pending, rc);
+        }
+
+        u->con_pending -= rc;
+    }
+}
+
+/*
+ * Tee pipe events callback
+ */
+static void
+uterm_tee_pipe_callback (ev_source *src, unsigned int events)
+{
+    uterm_state *u = src->data;
+
+    (void) events;
+
+    uterm_splice_pump(u);
+    uterm_update(u);
+}
+
+/*
+ * Setup zero-copy mode. Returns false, if not possible
+ */
+static bool
+uterm_splice_setup (uterm_state *u)
+{
+    ssize_t     rc;
+
+    if (pipe2(u->pipe_in, O_CLOEXEC | O_NONBLOCK) == -1 ||
+        pipe2(u->pipe_con, O_CLOEXEC | O_NONBLOCK) == -1) {
+        panic_perror("pipe()");
+    }
+
+    /* Probe, if TTY supports splice. Note, data may be received */
+    rc = splice(u->src_tty.fd, NULL, u->pipe_in[1], NULL, SPLICE_CHUNK,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (rc < 0 && errno != EAGAIN) {
+        close(u->pipe_in[0]);
+        close(u->pipe_in[1]);
+        close(u->pipe_con[0]);
+        close(u->pipe_con[1]);
+        return false;
+    }
+
+    u->in_pending = rc > 0 ? rc : 0;
+    u->splice = u->splice_con = true;
+
+    /* May fail because of pipe-max-size limit; it's not fatal */
+    fcntl(u->pipe_con[1], F_SETPIPE_SZ, (int) opt_ring_size);
+
+    if (u->fd_tee >= 0) {
+        u->fd_tee_pipe = aw_start_pipe(&u->tee, u->fd_tee, u->tee_name,
+            opt_tee_buffer);
+
+        u->fd_null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        if (u->fd_null == -1) {
+            panic_perror("can't open /dev/null");
+        }
+
+        ev_add(u->loop, &u->src_tee_pipe, u->fd_tee_pipe, EV_WRITE,
+            uterm_tee_pipe_callback, u);
+    }
+
+    return true;
+}
+#endif
+
+/*
+ * Capture timer callback: flush the block, when it gets CTC_BLOCK_NS
+ * old, even if no more data comes
+ */
+static void
+uterm_capture_callback (ev_timer *timer)
+{
+    uterm_state *u = timer->data;
+    uint64_t    deadline = ctc_deadline(&u->cap);
+
+    if (deadline != 0 && deadline <= now_ns()) {
+        ctc_flush(&u->cap);
+    } else if (deadline != 0) {
+        /* Block was flushed by size, and the new one started */
+        ev_timer_start(u->loop, &u->cap_timer, deadline,
+            uterm_capture_callback, u);
+    }
+}
+
+/*
+ * Record data into the capture file, with time t (now_ns() clock).
+ * Block age timer is armed by the first record of the block
+ */
+static void
+uterm_capture (uterm_state *u, ctc_dir dir, const unsigned char *data,
+               size_t size, uint64_t t)
+{
+    ctc_record(&u->cap, dir, data, size, t);
+
+    if (!u->cap_timer.active && u->cap.records != 0) {
+        ev_timer_start(u->loop, &u->cap_timer, ctc_deadline(&u->cap),
+            uterm_capture_callback, u);
+    }
+}
+
+/*
+ * Check received data for upload prompt
+ */
+static void
+uterm_send_rx (uterm_state *u, const unsigned char *data, size_t size)
+{
+    size_t      i, k = u->prompt_match;
+
+    for (i = 0; i < size; i ++) {
+        while (k > 0 && (char) data[i] != opt_send_prompt[k]) {
+            k = u->prompt_fail[k - 1];
+        }
+        if ((char) data[i] == opt_send_prompt[k]) {
+            k ++;
+        }
+        if (k == u->prompt_len) {
+            u->send_wait = false;
+            u->prompt_match = 0;
+            ev_timer_stop(u->loop, &u->tx_timer);
+            u->tx_next = 0;
+            return;
+        }
+    }
+
+    u->prompt_match = k;
+}
+
+/*
+ * Move pending send triggers to con2tty, in order, as space allows
+ */
+static void
+uterm_trig_flush (uterm_state *u)
+{
+    int     n = 0;
+
+    while (n < u->trig_npending &&
+           ring_space(&u->con2tty) >= u->trig_pending[n]->arg_len) {
+        uterm_ring_put(&u->con2tty, u->trig_pending[n]->arg,
+            u->trig_pending[n]->arg_len);
+        n ++;
+    }
+
+    u->trig_npending -= n;
+    memmove(u->trig_pending, u->trig_pending + n,
+        u->trig_npending * sizeof(*u->trig_pending));
+}
+
+/*
+ * Trigger callback: perform action of the matched rule
+ */
+static void
+uterm_trigger (void *data, const trig_rule *rule)
+{
+    uterm_state         *u = data;
+    const unsigned char *p = rule->arg;
+    size_t              len = rule->arg_len;
+
+    u->trig_hits ++;
+
+    switch (rule->action) {
+    case TRIG_SEND:
+        /* Goes the same way as typed on console; if line is behind,
+         * waits in trig_pending, see uterm_tty_write() */
+        if (u->trig_npending < TRIG_PENDING_MAX) {
+            u->trig_pending[u->trig_npending ++] = rule;
+            uterm_trig_flush(u);
+        } else if (u->trig_dropped ++ == 0) {
+            fprintf(stderr, "%s: %s: line is behind, trigger sends "
+                "are dropped\n", program_name, u->line);
+        }
+        break;
+
+    case TRIG_MARK:
+        aw_write(&u->tee, (const unsigned char*) "\n*** ", 5);
+        aw_write(&u->tee, p, len);
+        aw_write(&u->tee, (const unsigned char*) " ***\n", 5);
+        u->st_tee_bytes += len + 10;
+        break;
+
+    case TRIG_EXIT:
+        uterm_exit(u, rule->code);
+        break;
+    }
+}
+
+/*
+ * Scrollback search (--scrollback)
+ *
+ * Search char starts the search. While it is active, console
+ * input edits the query, and received data is held in tty2con;
+ * when it is full, line is still read, and data is skipped for
+ * console, as with --render-fps. Search status goes to console
+ * through con_ui. Keys are:
+ *   any printable  - add to the query and find the newest match
+ *   BS, DEL        - remove from the query and find again
+ *   search char    - find the next older match
+ *   Enter          - show lines around the match and leave; if they
+ *                    don't fit into con_ui, they are cut around the
+ *                    match, and cuts are marked
+ *   ESC, ctrl-G    - leave
+ */
+#define SB_UI_SIZE              65536
+#define SB_UI_RESERVE           1024
+#define SB_CONTEXT              10
+#define SB_EXCERPT              60
+
+/*
+ * Write search UI output to console, if there is space
+ */
+static void
+uterm_ui_put (uterm_state *u, const void *data, size_t len)
+{
+    if (ring_space(&u->con_ui) >= len) {
+        uterm_ring_put(&u->con_ui, data, len);
+    }
+}
+
+/*
+ * Write formatted search UI output to console
+ */
+static void
+uterm_ui_printf (uterm_state *u, const char *fmt, ...)
+{
+    char        buf[256];
+    va_list     ap;
+    int         len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+
+    if (len > 0) {
+        uterm_ui_put(u, buf, (size_t) len < sizeof(buf) ?
+            (size_t) len : sizeof(buf) - 1);
+    }
+}
+
+/*
+ * Show search status: query and excerpt of the matched line
+ */
+static void
+uterm_search_show (uterm_state *u)
+{
+    scrollback          *sb = &u->sb;
+    unsigned char       buf[SB_EXCERPT];
+    uint64_t            n, from, to;
+    size_t              i;
+
+    uterm_ui_printf(u, "\r\033[K(search) '%.*s': ",
+        (int) u->query_len, u->query);
+
+    if (u->match == UINT64_MAX) {
+        uterm_ui_printf(u, "%s", u->query_len ? "not found" : "");
+        return;
+    }
+
+    n = sb_line(sb, u->match);
+    from = sb_line_start(sb, n);
+    to = sb_line_end(sb, n);
+    if (u->match - from > SB_EXCERPT / 3) {
+        from = u->match - SB_EXCERPT / 3;
+    }
+    to = to - from > SB_EXCERPT ? from + SB_EXCERPT : to;
+
+    sb_copy(sb, from, buf, to - from);
+    while (to > from && (buf[to - from - 1] == '\r' ||
+                         buf[to - from - 1] == '\n')) {
+        to --;
+    }
+
+    for (i = 0; i < to - from; i ++) {
+        buf[i] = buf[i] < 0x20 || buf[i] == 0x7f ? '.' : buf[i];
+    }
+
+    uterm_ui_printf(u, "line %llu: ", (unsigned long long) n + 1);
+    uterm_ui_put(u, buf, to - from);
+}
+
+/*
+ * Find the newest match of the query
+ */
+static void
+uterm_search_find (uterm_state *u)
+{
+    u->match = sb_find_last(&u->sb, u->query, u->query_len, u->sb.end);
+    uterm_search_show(u);
+}
+
+/*
+ * Leave the search. With jump, lines around the match are shown
+ */
+static void
+uterm_search_stop (uterm_state *u, bool jump)
+{
+    scrollback  *sb = &u->sb;
+
+    uterm_ui_put(u, "\r\n", 2);
+
+    if (jump && u->match != UINT64_MAX) {
+        uint64_t    n = sb_line(sb, u->match);
+        uint64_t    first = sb->first, last = sb->next - 1;
+        uint64_t    off, end, start, tail = 0;
+        size_t      limit = ring_space(&u->con_ui);
+
+        first = n - first > SB_CONTEXT ? n - SB_CONTEXT : first;
+        last = last - n > SB_CONTEXT ? n + SB_CONTEXT : last;
+        off = sb_line_start(sb, first);
+        end = sb_line_end(sb, last);
+
+        uterm_ui_printf(u, "(search) lines %llu-%llu:\r\n",
+            (unsigned long long) first + 1, (unsigned long long) last + 1);
+
+        /* Room for cut marks and the final message is reserved */
+        limit = limit > SB_UI_RESERVE ? limit - SB_UI_RESERVE : 0;
+        if (end - off > limit) {
+            start = sb_line_start(sb, n);
+            start = start - off > limit / 2 ? start - limit / 2 : off;
+            if (start != off) {
+                uterm_ui_printf(u, "[%llu bytes not shown]\r\n",
+                    (unsigned long long) (start - off));
+                off = start;
+            }
+
+            if (end - off > limit) {
+                tail = end - off - limit;
+                end = off + limit;
+            }
+        }
+
+        while (off != end) {
+            size_t  len = end - off < SB_BLOCK ? end - off : SB_BLOCK;
+
+            sb_copy(sb, off, sb->tmp, len);
+            uterm_ui_put(u, sb->tmp, len);
+            off += len;
+        }
+
+        uterm_ui_put(u, "\r\n", 2);
+        if (tail != 0) {
+            uterm_ui_printf(u, "[%llu bytes not shown]\r\n",
+                (unsigned long long) tail);
+        }
+    }
+
+    uterm_ui_printf(u, "(search) back to live output\r\n");
+    u->searching = false;
+}
+
+/*
+ * Handle search key
+ */
+static void
+uterm_search_key (uterm_state *u, unsigned char c)
+{
+    if (c == opt_search_char) {
+        uint64_t    match = UINT64_MAX;
+
+        if (u->match != UINT64_MAX) {
+            match = sb_find_last(&u->sb, u->query, u->query_len,
+                u->match + u->query_len - 1);
+        }
+
+        if (match == UINT64_MAX) {
+            uterm_ui_put(u, "\a", 1);
+        } else {
+            u->match = match;
+            uterm_search_show(u);
+        }
+    } else if (c == '\r' || c == '\n') {
+        uterm_search_stop(u, true);
+    } else if (c == 0x1b || c == 0x07) {
+        uterm_search_stop(u, false);
+    } else if (c == 0x7f || c == 0x08) {
+        if (u->query_len != 0) {
+            u->query_len --;
+            uterm_search_find(u);
+        }
+    } else if (c >= 0x20 && u->query_len < sizeof(u->query)) {
+        u->query[u->query_len ++] = c;
+        uterm_search_find(u);
+    }
+}
+
+/*
+ * Filter console input for the search. Search char starts the
+ * search, and keys go to the search while it is active. Returns
+ * count of bytes left for the line, they are moved to the
+ * beginning of data
+ */
+static size_t
+uterm_search_input (uterm_state *u, unsigned char *data, size_t size)
+{
+    size_t      i, out = 0;
+
+    for (i = 0; i < size; i ++) {
+        if (u->searching) {
+            uterm_search_key(u, data[i]);
+        } else if (data[i] == opt_search_char) {
+            u->searching = true;
+            u->query_len = 0;
+            u->match = UINT64_MAX;
+            uterm_ui_put(u, "\r\n", 2);
+            uterm_search_show(u);
+        } else {
+            data[out ++] = data[i];
+        }
+    }
+
+    return out;
+}
+
+/*
+ * Get space for received data in tty2con ring. If data was
+ * skipped before, skip marker goes first; until it fits,
+ * there is no space
+ */
+static size_t
+uterm_render_space (uterm_state *u, unsigned char **data)
+{
+    uterm_render_marker(u);
+    if (u->render_skipped != 0) {
+        return 0;
+    }
+
+    return ring_write_ptr(&u->tty2con, data);
+}
+
+/*
+ * Count skipped received data
+ */
+static void
+uterm_render_skip (uterm_state *u, size_t len)
+{
+    u->render_skipped += len;
+    u->st_skipped += len;
+}
+
+/*
+ * Received data pipeline
+ *
+ * Options are checked once: uterm_pipe_setup() chooses the stages,
+ * and read loops just run them on each received chunk. Line stages
+ * get all received data, in order: capture, prompt watch, formatting
+ * (hex dump or timestamps), tee and triggers. Console stages work
+ * in place on the data that goes to console, after formatting, and
+ * are not run for skipped data
+ *
+ * Without any stages, data is read directly into the tty2con ring,
+ * and read loop is just read() and ring_produce()
+ */
+/*
+ * Line stage: record received data into the capture file
+ */
+static void
+uterm_stage_capture (void *data, rx_chunk *c)
+{
+    uterm_state *u = data;
+
+    uterm_capture(u, CTC_RX, c->raw, c->raw_len, c->t);
+}
+
+/*
+ * Line stage: watch for --send-prompt
+ */
+static void
+uterm_stage_prompt (void *data, rx_chunk *c)
+{
+    uterm_state *u = data;
+
+    if (u->send_wait) {
+        uterm_send_rx(u, c->raw, c->raw_len);
+    }
+}
+
+/*
+ * Line stage: format hex dump for console
+ */
+static void
+uterm_stage_hex (void *data, rx_chunk *c)
+{
+    uterm_state *u = data;
+
+    c->out_len = hexd_format(&u->hex, c->raw, c->raw_len, c->out);
+}
+
+/*
+ * Line stage: prepend timestamps to lines
+ */
+static void
+uterm_stage_tstamp (void *data, rx_chunk *c)
+{
+    uterm_state *u = data;
+
+    c->out_len = tstamp_lines(&u->ts, &u->ts_bol, c->raw, c->raw_len,
+        c->out, c->t);
+}
+
+/*
+ * Line stage: write received data to tee. Tee gets timestamps,
+ * but not hex dump, see uterm_stage_tee_out()
+ */
+static void
+uterm_stage_tee_raw (void *data, rx_chunk *c)
+{
+    uterm_state *u = data;
+
+    aw_write(&u->tee, c->raw, c->raw_len);
+    u->st_tee_bytes += c->raw_len;
+}
+
+/*
+ * Line stage: write timestamped data to tee
+ */
+static void
+uterm_stage_tee_out (void *data, rx_chunk *c)
+{
+    uterm_state *u = data;
+
+    aw_write(&u->tee, c->out, c->out_len);
+    u->st_tee_bytes += c->out_len;
+}
+
+/*
+ * Line stage: scan for trigger patterns
+ */
+static void
+uterm_stage_trig (void *data, rx_chunk *c)
+{
+    uterm_state *u = data;
+
+    trig_scan(&u->trig_state, c->raw, c->raw_len, uterm_trigger, u);
+}
+
+/*
+ * Line stage: match echo of the latency probe in flight. The next
+ * probe is sent by its timer, see probe_callback()
+ */
+static void
+uterm_stage_probe (void *data, rx_chunk *c)
+{
+    uterm_state *u = data;
+
+    if (u->probe_time != 0 &&
+        memchr(c->raw, u->probe_seq, c->raw_len) != NULL) {
+        u->probe_lat[u->probe_echoed ++] = now_ns() - u->probe_time;
+        u->probe_time = 0;
+        ev_timer_start(u->loop, &u->probe_timer, now_ns(),
+            u->probe_timer.callback, u);
+    }
+}
+
+/*
+ * Console stage: suppress control characters
+ */
+static void
+uterm_stage_ctrls (void *data, rx_chunk *c)
+{
+    (void) data;
+
+    c->out_len = suppress_ctrls(c->out, c->out_len);
+}
+
+/*
+ * Console stage: keep console data in scrollback
+ */
+static void
+uterm_stage_sb (void *data, rx_chunk *c)
+{
+    uterm_state *u = data;
+
+    sb_put(&u->sb, c->out, c->out_len);
+}
+
+/*
+ * Build the received data pipeline from options
+ */
+static void
+uterm_pipe_setup (uterm_state *u)
+{
+    u->rx_nline = u->rx_ncon = 0;
+
+    if (u->capturing) {
+        u->rx_line[u->rx_nline ++] = uterm_stage_capture;
+    }
+
+    if (opt_send_file != NULL && opt_send_pace == SEND_PACE_PROMPT) {
+        u->rx_line[u->rx_nline ++] = uterm_stage_prompt;
+    }
+
+    if (opt_hex) {
+        u->rx_line[u->rx_nline ++] = uterm_stage_hex;
+    } else if (opt_timestamp != TS_NONE) {
+        u->rx_line[u->rx_nline ++] = uterm_stage_tstamp;
+    }
+
+    if (u->fd_tee >= 0) {
+        u->rx_line[u->rx_nline ++] = opt_timestamp != TS_NONE ?
+            uterm_stage_tee_out : uterm_stage_tee_raw;
+    }
+
+    if (trig.nrules != 0) {
+        u->rx_line[u->rx_nline ++] = uterm_stage_trig;
+    }
+
+    if (opt_latency_probe != 0) {
+        u->rx_line[u->rx_nline ++] = uterm_stage_probe;
+    }
+
+    if (opt_supress_ctrls) {
+        u->rx_con[u->rx_ncon ++] = uterm_stage_ctrls;
+    }
+
+    if (u->sb.size != 0) {
+        u->rx_con[u->rx_ncon ++] = uterm_stage_sb;
+    }
+}
+
+/*
+ * Run pipeline stages on the chunk
+ */
+static inline void
+uterm_pipe_run (uterm_state *u, rx_stage *stages, int n, rx_chunk *c)
+{
+    int i;
+
+    for (i = 0; i < n; i ++) {
+        stages[i](u, c);
+    }
+}
+
+/*
+ * Read from TTY as much as possible
+ *
+ * With --render-fps or while search is active, line is read even
+ * when tty2con is full; then data goes to line stages, but is
+ * skipped for console. To not starve others, only one chunk is
+ * skipped per call
+ */
+static void
+uterm_tty_read (uterm_state *u)
+{
+    unsigned char       *data;
+    size_t              space;
+    bool                skip = false;
+    rx_chunk            c;
+
+    for (;;) {
+        ssize_t         rc;
+
+        space = uterm_render_space(u, &data);
+        if (space == 0) {
+            if (!uterm_render_can_skip(u) || skip) {
+                break;
+            }
+
+            data = u->skip_buf;
+            space = RENDER_CHUNK;
+            skip = true;
+        }
+
+        rc = uterm_tty_recv(u, data, space, &c.t);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN) {
+                u->st_tty_in.calls ++;
+                ev_clear(&u->src_tty, EV_READ);
+                break;
+            }
+
+            if (uterm_tty_lost(u, errno)) {
+                break;
+            }
+
+            panic_perror( "read(tty)" );
+        } else if (!rc) {
+            if (uterm_tty_lost(u, 0)) {
+                break;
+            }
+
+            panic( "read(tty): end of input" );
+        }
+
+        stats_io_done(&u->st_tty_in, rc, rc);
+
+        c.raw = c.out = data;
+        c.raw_len = c.out_len = rc;
+        uterm_pipe_run(u, u->rx_line, u->rx_nline, &c);
+
+        if (data == u->skip_buf) {
+            uterm_render_skip(u, rc);
+            continue;
+        }
+
+        uterm_pipe_run(u, u->rx_con, u->rx_ncon, &c);
+        ring_produce(&u->tty2con, c.out_len);
+    }
+}
+
+/*
+ * Read from TTY as much as possible, with line timestamps
+ * or as hex dump
+ *
+ * Received chunk is formatted into ts_out, which is then moved
+ * into tty2con ring as space allows. TTY is not read until
+ * ts_out is completely moved, so ts_out is never overflowed.
+ * With --render-fps or while searching, rest of ts_out is skipped
+ * instead, once per call, as in uterm_tty_read()
+ */
+static void
+uterm_tty_read_stamped (uterm_state *u)
+{
+    unsigned char       *data;
+    size_t              space, len;
+    ssize_t             rc;
+    bool                skip = false;
+    rx_chunk            c;
+
+    for (;;) {
+        while (u->ts_out_pos != u->ts_out_len) {
+            space = uterm_render_space(u, &data);
+            if (space == 0) {
+                if (!uterm_render_can_skip(u) || skip) {
+                    return;
+                }
+
+                uterm_render_skip(u, u->ts_out_len - u->ts_out_pos);
+                u->ts_out_pos = u->ts_out_len;
+                skip = true;
+                break;
+            }
+
+            len = u->ts_out_len - u->ts_out_pos;
+            len = len < space ? len : space;
+            memcpy(data, u->ts_out + u->ts_out_pos, len);
+            ring_produce(&u->tty2con, len);
+            u->ts_out_pos += len;
+        }
+
+        rc = uterm_tty_recv(u, u->ts_in, TS_CHUNK, &c.t);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN) {
+                u->st_tty_in.calls ++;
+                ev_clear(&u->src_tty, EV_READ);
+                break;
+            }
+
+            if (uterm_tty_lost(u, errno)) {
+                break;
+            }
+
+            panic_perror( "read(tty)" );
+        } else if (!rc) {
+            if (uterm_tty_lost(u, 0)) {
+                break;
+            }
+
+            panic( "read(tty): end of input" );
+        }
+
+        stats_io_done(&u->st_tty_in, rc, rc);
+
+        c.raw = u->ts_in;
+        c.raw_len = rc;
+        c.out = u->ts_out;
+        c.out_len = 0;
+        uterm_pipe_run(u, u->rx_line, u->rx_nline, &c);
+        uterm_pipe_run(u, u->rx_con, u->rx_ncon, &c);
+
+        u->ts_out_len = c.out_len;
+        u->ts_out_pos = 0;
+    }
+}
+
+/*
+ * Transmit pacer timer callback
+ */
+static void
+uterm_pacer_callback (ev_timer *timer)
+{
+    uterm_state *u = timer->data;
+
+    if (u->send_wait) {
+        fprintf(stderr, "%s: %s: prompt timeout\n", program_name,
+            opt_send_file);
+        u->send_wait = false;
+    }
+
+    uterm_update(u);
+}
+
+/*
+ * Check, if transmit pacer allows to send now. If not,
+ * pacer timer is started
+ */
+static bool
+uterm_pacer_check (uterm_state *u)
+{
+    if (u->tx_next != 0 && now_ns() < u->tx_next) {
+        ev_timer_start(u->loop, &u->tx_timer, u->tx_next,
+            uterm_pacer_callback, u);
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Schedule the next transmission after delay
+ *
+ * If we are late less than one delay period, next deadline is
+ * counted from the previous one, so average rate is kept exact,
+ * regardless of wake up latency
+ */
+static void
+uterm_pacer_schedule (uterm_state *u, uint64_t delay)
+{
+    uint64_t    now = now_ns();
+
+    if (u->tx_next != 0 && now - u->tx_next < delay) {
+        u->tx_next += delay;
+    } else {
+        u->tx_next = now + delay;
+    }
+}
+
+/*
+ * Start bulk upload (--send option)
+ *
+ * File is memory-mapped and sent in large chunks, which new lines
+ * are translated in advance. Console input is held while upload
+ * is in progress
+ */
+static void
+uterm_send_start (uterm_state *u)
+{
+    struct stat st;
+    int         fd;
+    size_t      i, k;
+
+    fd = open(opt_send_file, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        panic_perror( "can't open %s", opt_send_file );
+    }
+
+    u->send_size = (size_t) st.st_size;
+    if (u->send_size != 0) {
+        u->send_data = mmap(NULL, u->send_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (u->send_data == MAP_FAILED) {
+            panic_perror( "mmap(%s)", opt_send_file );
+        }
+        madvise((void*) u->send_data, u->send_size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    u->send_buf = mem_alloc(SEND_CHUNK);
+    u->char_ns = 10000000000ULL / u->speed;
+    u->send_start = now_ns();
+    u->send_held = uterm_modem_held(u);
+    u->sending = true;
+
+    /* Prepare KMP failure function for the prompt */
+    if (opt_send_pace == SEND_PACE_PROMPT) {
+        u->prompt_len = strlen(opt_send_prompt);
+        u->prompt_fail = mem_alloc(u->prompt_len * sizeof(size_t));
+        for (i = 1, k = 0; i < u->prompt_len; i ++) {
+            while (k > 0 && opt_send_prompt[i] != opt_send_prompt[k]) {
+                k = u->prompt_fail[k - 1];
+            }
+            if (opt_send_prompt[i] == opt_send_prompt[k]) {
+                k ++;
+            }
+            u->prompt_fail[i] = k;
+        }
+    }
+}
+
+/*
+ * Fill send_buf with the next chunk of file, translating new lines.
+ * With line or prompt pacing, chunk never crosses end of line
+ */
+static void
+uterm_send_fill (uterm_state *u)
+{
+    size_t      len = 0;
+
+    u->send_eol = false;
+
+    while (u->send_pos != u->send_size && !u->send_eol) {
+        const unsigned char *in = u->send_data + u->send_pos;
+        size_t              avail = u->send_size - u->send_pos;
+        const unsigned char *nl = memchr(in, '\n', avail);
+        size_t              n = nl ? (size_t) (nl - in) : avail;
+
+        if (n > SEND_CHUNK - len) {
+            n = SEND_CHUNK - len;
+            nl = NULL;
+        }
+
+        memcpy(u->send_buf + len, in, n);
+        len += n;
+        u->send_pos += n;
+
+        if (nl == NULL) {
+            break;
+        }
+
+        if (opt_nl_size > SEND_CHUNK - len) {
+            break;
+        }
+
+        memcpy(u->send_buf + len, opt_nl_sequence, opt_nl_size);
+        len += opt_nl_size;
+        u->send_pos ++;
+
+        u->send_eol = opt_send_pace != SEND_PACE_OUTQ;
+    }
+
+    u->send_len = len;
+    u->send_off = 0;
+}
+
+/*
+ * Get count of bytes in the driver output queue.
+ * Returns 0, if driver can't tell
+ */
+static int
+uterm_send_outq (uterm_state *u)
+{
+    int     q = 0;
+
+    if (ioctl(u->src_tty.fd, TIOCOUTQ, &q) == -1) {
+        q = 0;
+    }
+
+    return q;
+}
+
+/*
+ * Report upload throughput
+ */
+static void
+uterm_send_report (uterm_state *u)
+{
+    double      t = (double) (now_ns() - u->send_start) / 1e9;
+    double      rate = t > 0 ? (double) u->send_wire / t : 0;
+    double      line = (double) u->speed / 10;
+
+    fprintf(stderr, "%s: %s: %zu bytes (%llu on the line) sent in %.2f s, "
+        "%.0f B/s, %.1f%% of %lu bps line rate",
+        program_name, opt_send_file, u->send_size, u->send_wire, t,
+        rate, rate * 100 / line, (unsigned long) u->speed);
+
+    if (opt_flow == FLOW_RTSCTS) {
+        fprintf(stderr, ", held off by CTS %.2f s",
+            (double) (uterm_modem_held(u) - u->send_held) / 1e9);
+    }
+
+    fprintf(stderr, "\n");
+}
+
+/*
+ * Write next part of the uploaded file to TTY
+ */
+static void
+uterm_send_write (uterm_state *u)
+{
+    while (u->sending && !u->send_wait) {
+        size_t      sz;
+        ssize_t     rc;
+        int         q;
+
+        if (!uterm_pacer_check(u)) {
+            break;
+        }
+
+        /* Wait until driver transmits everything */
+        if (u->send_drain) {
+            q = uterm_send_outq(u);
+            if (q > 0) {
+                u->tx_next = now_ns() + (uint64_t) q * u->char_ns;
+                continue;
+            }
+
+            u->send_drain = false;
+            if (opt_send_pace == SEND_PACE_LINE && opt_line_delay) {
+                uterm_pacer_schedule(u, opt_line_delay);
+                continue;
+            }
+        }
+
+        if (u->send_off == u->send_len) {
+            if (u->send_pos == u->send_size) {
+                uterm_send_report(u);
+                u->sending = false;
+                break;
+            }
+
+            uterm_send_fill(u);
+        }
+
+        sz = u->send_len - u->send_off;
+
+        /* Don't let driver queue grow, so pacing is precise. With
+         * flow control, driver paces itself, so queue is filled */
+        if (opt_send_pace == SEND_PACE_OUTQ && opt_flow == FLOW_NONE) {
+            q = uterm_send_outq(u);
+            if (q >= SEND_OUTQ_MAX) {
+                u->tx_next = now_ns() +
+                    (uint64_t) (q - SEND_OUTQ_MAX / 2) * u->char_ns;
+                continue;
+            }
+
+            sz = sz < (size_t) (SEND_OUTQ_MAX - q) ?
+                sz : (size_t) (SEND_OUTQ_MAX - q);
+        }
+
+        rc = write(u->src_tty.fd, u->send_buf + u->send_off, sz);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN) {
+                stats_io_blocked(&u->st_tty_out);
+                ev_clear(&u->src_tty, EV_WRITE);
+                break;
+            }
+
+            if (uterm_tty_lost(u, errno)) {
+                break;
+            }
+
+            panic_perror( "write(tty)" );
+        }
+
+        stats_io_done(&u->st_tty_out, sz, rc);
+
+        if (u->capturing) {
+            uterm_capture(u, CTC_TX, u->send_buf + u->send_off, rc,
+                now_ns());
+        }
+
+        u->send_off += rc;
+        u->send_wire += rc;
+
+        if (u->send_off != u->send_len) {
+            continue;
+        }
+
+        if (u->send_pos == u->send_size) {
+            /* Report when everything is on the line */
+            u->send_drain = true;
+        } else if (u->send_eol && opt_send_pace == SEND_PACE_LINE) {
+            u->send_drain = true;
+        } else if (u->send_eol && opt_send_pace == SEND_PACE_PROMPT) {
+            u->send_wait = true;
+            u->prompt_match = 0;
+            u->tx_next = now_ns() + SEND_PROMPT_TIMEOUT;
+            uterm_pacer_check(u);
+        }
+    }
+}
+
+/*
+ * Translate pending console->tty data into tx_buf, replacing
+ * '\n' with opt_nl_sequence, so everything pending goes out
+ * with a single write(). Translated data is consumed from
+ * the con2tty ring
+ *
+ * With line delay, translation stops at the end of line,
+ * so each line is paced separately
+ */
+static void
+uterm_tx_fill (void *arg)
+{
+    uterm_state         *u = arg;
+    unsigned char       *data;
+    size_t              avail, len = 0;
+
+    u->tx_eol = false;
+
+    while (!u->tx_eol && (avail = ring_read_ptr(&u->con2tty, &data)) != 0) {
+        size_t          used = 0;
+
+        while (used < avail) {
+            unsigned char   *nl = memchr(data + used, '\n', avail - used);
+            size_t          n = nl ? (size_t) (nl - data) - used : avail - used;
+
+            if (n > TX_CHUNK - len) {
+                n = TX_CHUNK - len;
+                nl = NULL;
+            }
+
+            memcpy(u->tx_buf + len, data + used, n);
+            len += n;
+            used += n;
+
+            if (nl == NULL || opt_nl_size > TX_CHUNK - len) {
+                break;
+            }
+
+            memcpy(u->tx_buf + len, opt_nl_sequence, opt_nl_size);
+            len += opt_nl_size;
+            used ++;
+
+            if (opt_line_delay) {
+                u->tx_eol = true;
+                break;
+            }
+        }
+
+        ring_consume(&u->con2tty, used);
+
+        if (used < avail) {
+            break; /* tx_buf is full */
+        }
+    }
+
+    u->tx_len = len;
+    u->tx_off = 0;
+}
+
+/*
+ * Move pending console->tty data into tx_buf as is. Used instead
+ * of uterm_tx_fill(), when new line is sent as '\n' and lines
+ * are not paced, so there is nothing to translate
+ */
+static void
+uterm_tx_copy (void *arg)
+{
+    uterm_state         *u = arg;
+    unsigned char       *data;
+    size_t              avail, len = 0;
+
+    while (len < TX_CHUNK &&
+           (avail = ring_read_ptr(&u->con2tty, &data)) != 0) {
+        avail = avail < TX_CHUNK - len ? avail : TX_CHUNK - len;
+        memcpy(u->tx_buf + len, data, avail);
+        ring_consume(&u->con2tty, avail);
+        len += avail;
+    }
+
+    u->tx_eol = false;
+    u->tx_len = len;
+    u->tx_off = 0;
+}
+
+/*
+ * Write pending console->tty data to TTY
+ */
+static void
+uterm_tty_write (uterm_state *u)
+{
+    if (u->sending) {
+        uterm_send_write(u);
+        return;
+    }
+
+    for (;;) {
+        size_t              sz;
+        ssize_t             rc;
+
+        if (u->tx_off == u->tx_len) {
+            uterm_trig_flush(u);
+            if (ring_count(&u->con2tty) == 0) {
+                break;
+            }
+
+            u->tx_fill(u);
+        }
+
+        if ((opt_send_delay || opt_line_delay) && !uterm_pacer_check(u)) {
+            break;
+        }
+
+        sz = u->tx_len - u->tx_off;
+        if (opt_send_delay) {
+            sz = 1;
+        }
+
+        rc = write(u->src_tty.fd, u->tx_buf + u->tx_off, sz);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN) {
+                stats_io_blocked(&u->st_tty_out);
+                ev_clear(&u->src_tty, EV_WRITE);
+                break;
+            }
+
+            if (uterm_tty_lost(u, errno)) {
+                break;
+            }
+
+            panic_perror( "write(tty)" );
+        }
+
+        stats_io_done(&u->st_tty_out, sz, rc);
+
+        if (u->capturing) {
+            uterm_capture(u, CTC_TX, u->tx_buf + u->tx_off, rc,
+                now_ns());
+        }
+
+        u->tx_off += rc;
+
+        if (opt_send_delay) {
+            uterm_pacer_schedule(u, opt_send_delay);
+        }
+
+        if (u->tx_off == u->tx_len && u->tx_eol && opt_line_delay) {
+            uterm_pacer_schedule(u, opt_line_delay);
+        }
+    }
+}
+
+/*
+ * TTY events callback
+ */
+static void
+uterm_tty_callback (ev_source *src, unsigned int events)
+{
+    uterm_state *u = src->data;
+
+    if (events & EV_READ) {
+#ifdef  __linux__
+        if (u->splice) {
+            uterm_splice_pump(u);
+        } else
+#endif
+        if (u->ts_in != NULL) {
+            uterm_tty_read_stamped(u);
+        } else {
+            uterm_tty_read(u);
+        }
+    }
+
+    if ((events & EV_WRITE) && !u->tty_lost) {
+        uterm_tty_write(u);
+    }
+
+    uterm_update(u);
+}
+
+/*
+ * Partial read timer callback (--vtime). With VMIN > 1, line
+ * becomes readable only when VMIN bytes are received, so fewer
+ * bytes are picked up here: line is marked readable, and
+ * non-blocking read() returns whatever is there
+ */
+static void
+uterm_vtime_callback (ev_timer *timer)
+{
+    uterm_state *u = timer->data;
+
+    if (!u->tty_lost) {
+        u->src_tty.ready |= EV_READ;
+    }
+
+    ev_timer_start(u->loop, &u->vtime_timer,
+        now_ns() + (uint64_t) opt_vtime * 100000000ULL,
+        uterm_vtime_callback, u);
+}
+
+/*
+ * RX thread wakeup callback
+ */
+static void
+uterm_rx_callback (ev_source *src, unsigned int events)
+{
+    uterm_state *u = src->data;
+
+    (void) events;
+
+    if (u->ts_in != NULL) {
+        uterm_tty_read_stamped(u);
+    } else {
+        uterm_tty_read(u);
+    }
+
+    uterm_update(u);
+}
+
+/*
+ * Batch timer callback. After console EOF, polls until console
+ * input is written and the driver output queue is empty, then
+ * waits --batch-timeout for the replies and exits the same way
+ * as the exit trigger, after received data is on console
+ */
+static void
+uterm_batch_callback (ev_timer *timer)
+{
+    uterm_state *u = timer->data;
+    uint64_t    wait = BATCH_POLL_NS;
+
+    if (u->batch_drained) {
+        uterm_exit(u, 0);
+        uterm_update(u);
+        return;
+    }
+
+    if (!u->sending && ring_count(&u->con2tty) == 0 &&
+        u->tx_off == u->tx_len && !u->tty_lost) {
+        int     q = uterm_send_outq(u);
+
+        if (q == 0) {
+            u->batch_drained = true;
+            wait = opt_batch_timeout;
+        } else {
+            uint64_t    t = (uint64_t) q * 10000000000ULL / u->speed;
+
+            wait = t > wait ? t : wait;
+        }
+    }
+
+    ev_timer_start(u->loop, &u->batch_timer, now_ns() + wait,
+        uterm_batch_callback, u);
+}
+
+/*
+ * Console input callback
+ */
+static void
+uterm_con_in_callback (ev_source *src, unsigned int events)
+{
+    uterm_state         *u = src->data;
+    unsigned char       *data, *esc;
+    size_t              space;
+    bool                hold;
+
+    (void) events;
+
+    for (;;) {
+        ssize_t         rc;
+
+        /* Line is behind: keep reading a little, to see the exit char */
+        uterm_con_unhold(u);
+        space = ring_write_ptr(&u->con2tty, &data);
+        hold = u->con_hold_len != 0 || space == 0;
+        if (hold) {
+            if (u->con_data || u->con_hold_len == CON_HOLD_SIZE) {
+                break;
+            }
+
+            data = u->con_hold + u->con_hold_len;
+            space = CON_HOLD_SIZE - u->con_hold_len;
+        }
+
+        rc = read(src->fd, data, space);
+
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN) {
+                u->st_con_in.calls ++;
+                ev_clear(src, EV_READ);
+                break;
+            }
+
+            panic_perror( "read(console)" );
+        } else if (!rc) {
+            /* Console EOF, nothing more to read */
+            ev_clear(src, EV_READ);
+            if (!u->con_eof) {
+                u->con_eof = true;
+                if (opt_batch) {
+                    u->batch_timer.data = u;
+                    uterm_batch_callback(&u->batch_timer);
+                } else if (u->done != NULL) {
+                    /* Owner closes console input to stop data path */
+                    uterm_exit(u, 0);
+                }
+            }
+            break;
+        }
+
+        stats_io_done(&u->st_con_in, rc, rc);
+
+        esc = u->con_data ? NULL : memchr(data, opt_esc_char, rc);
+        if (esc != NULL) {
+            rc = esc - data;
+        }
+
+        if (!u->con_data && u->sb.size != 0) {
+            rc = uterm_search_input(u, data, rc);
+        }
+
+        /* What was typed before the exit char still goes out */
+        if (hold) {
+            u->con_hold_len += rc;
+        } else {
+            ring_produce(&u->con2tty, rc);
+        }
+
+        if (esc != NULL) {
+            uterm_exit(u, 0);
+            break;
+        }
+    }
+
+    uterm_update(u);
+}
+
+/*
+ * Render timer callback: next frame may be written
+ */
+static void
+uterm_render_callback (ev_timer *timer)
+{
+    uterm_update(timer->data);
+}
+
+/*
+ * Write pending tty->console data to console
+ *
+ * With --render-fps, data is written in frames. Frame starts
+ * at most once per frame interval and lasts until everything
+ * accumulated is written, so bursts are coalesced into large
+ * writes, and fast console is not slowed down
+ *
+ * Skip marker is put here too, as soon as it fits, so it is shown
+ * even if the line stays silent after the skipped data
+ */
+static void
+uterm_con_write (uterm_state *u)
+{
+    unsigned char       *data;
+    size_t              avail;
+
+    /* Search output goes first; received data waits for the search */
+    while ((avail = ring_read_ptr(&u->con_ui, &data)) != 0) {
+        ssize_t rc = write(u->src_con_out.fd, data, avail);
+
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN) {
+                ev_clear(&u->src_con_out, EV_WRITE);
+                return;
+            }
+
+            panic_perror( "write(console)" );
+        }
+
+        ring_consume(&u->con_ui, rc);
+    }
+
+    if (u->searching) {
+        return;
+    }
+
+    uterm_render_marker(u);
+
+    if (opt_render_fps && !u->render_frame) {
+        if (ring_count(&u->tty2con) == 0 || u->render_timer.active) {
+            return;
+        }
+
+        u->render_frame = true;
+        ev_timer_start(u->loop, &u->render_timer,
+            now_ns() + 1000000000ULL / opt_render_fps,
+            uterm_render_callback, u);
+    }
+
+    do {
+        while ((avail = ring_read_ptr(&u->tty2con, &data)) != 0) {
+            ssize_t rc = write(u->src_con_out.fd, data, avail);
+
+            if (rc < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                if (errno == EAGAIN) {
+                    stats_io_blocked(&u->st_con_out);
+                    ev_clear(&u->src_con_out, EV_WRITE);
+                    break;
+                }
+
+                panic_perror( "write(console)" );
+            }
+
+            stats_io_done(&u->st_con_out, avail, rc);
+            ring_consume(&u->tty2con, rc);
+        }
+    } while (avail == 0 && uterm_render_marker(u));
+
+    if (ring_count(&u->tty2con) == 0) {
+        u->render_frame = false;
+    }
+}
+
+/*
+ * Console output callback
+ */
+static void
+uterm_con_out_callback (ev_source *src, unsigned int events)
+{
+    uterm_state         *u = src->data;
+
+    (void) events;
+
+    uterm_con_write(u);
+
+#ifdef  __linux__
+    if (u->splice && (src->ready & EV_WRITE) != 0) {
+        uterm_splice_con(u);
+        uterm_splice_pump(u);
+        uterm_con_write(u);
+    }
+#endif
+
+    uterm_update(u);
+}
+
+/*
+ * Setup uterm data path on the event loop. u->line, u->tee_name
+ * and u->capture_name must be set by caller
+ */
+static void
+uterm_setup (uterm_state *u, ev_loop *loop,
+             int fd_con_in, int fd_con_out, int fd_tty, int fd_tee)
+{
+    fd_nonblock(fd_con_in);
+    fd_nonblock(fd_con_out);
+    fd_nonblock(fd_tty);
+
+    u->fd_tee = fd_tee;
+    u->fd_tee_pipe = -1;
+
+    ring_init(&u->con2tty, opt_ring_size);
+    ring_init(&u->tty2con, opt_ring_size);
+    u->tx_buf = mem_alloc(TX_CHUNK);
+    u->tx_fill = opt_nl_size == 1 && opt_nl_sequence[0] == '\n' &&
+        !opt_line_delay ? uterm_tx_copy : uterm_tx_fill;
+    if (opt_render_fps || opt_scrollback != 0) {
+        u->skip_buf = mem_alloc(RENDER_CHUNK);
+    }
+
+    tstamp_init(&u->ts, opt_timestamp);
+    if (opt_timestamp != TS_NONE) {
+        u->ts_bol = true;
+        u->ts_in = mem_alloc(TS_CHUNK);
+        u->ts_out = mem_alloc(TS_CHUNK * (TS_MAX_LEN + 1));
+    }
+
+    if (opt_scrollback != 0) {
+        sb_init(&u->sb, opt_scrollback);
+        ring_init(&u->con_ui, SB_UI_SIZE);
+    }
+
+    if (opt_hex) {
+        hexd_start(&u->hex, NULL, true);
+        u->ts_in = mem_alloc(TS_CHUNK);
+        u->ts_out = mem_alloc(HEXD_MAX_LEN(TS_CHUNK));
+    }
+
+    u->loop = loop;
+    ev_add(u->loop, &u->src_con_in, fd_con_in, EV_READ,
+        uterm_con_in_callback, u);
+    ev_add(u->loop, &u->src_con_out, fd_con_out, EV_WRITE,
+        uterm_con_out_callback, u);
+    ev_add(u->loop, &u->src_tty, fd_tty,
+        opt_rx_thread ? EV_WRITE : EV_READ | EV_WRITE, uterm_tty_callback, u);
+
+    if (opt_rx_thread) {
+        ring_init(&u->rx_ring, opt_ring_size);
+        atomic_init(&u->rx_time_head, 0);
+        atomic_init(&u->rx_time_tail, 0);
+        fd_pipe(u->rx_wake);
+        fd_pipe(u->rx_ctl);
+        ev_add(u->loop, &u->src_rx, u->rx_wake[0], EV_READ,
+            uterm_rx_callback, u);
+        uterm_rx_start(u);
+    }
+
+    if (opt_vtime != 0 && opt_vmin > 1 && !opt_rx_thread) {
+        u->vtime_timer.data = u;
+        uterm_vtime_callback(&u->vtime_timer);
+    }
+
+    if (opt_flow == FLOW_RTSCTS) {
+        u->modem = TIOCM_CTS | TIOCM_DSR | TIOCM_CD;
+        fd_pipe(u->modem_pipe);
+        ev_add(u->loop, &u->src_modem, u->modem_pipe[0], EV_READ,
+            uterm_modem_callback, u);
+        uterm_modem_start(u);
+    }
+
+    u->watch_wd = -1;
+#ifdef  __linux__
+    if (opt_reconnect) {
+        int     fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+        if (fd >= 0) {
+            ev_add(u->loop, &u->src_watch, fd, EV_READ,
+                uterm_watch_callback, u);
+        } else {
+            u->src_watch.fd = -1;
+        }
+    }
+#endif
+
+    if (fd_tee >= 0 && (opt_tee_max_size || opt_tee_rotate_interval ||
+        opt_tee_compress != SEG_COMPRESS_NONE)) {
+        aw_set_segments(&u->tee, fd_tee, u->tee_name, opt_tee_max_size,
+            opt_tee_rotate_interval, opt_tee_compress);
+    }
+
+#ifdef  __linux__
+    if (opt_splice && !opt_supress_ctrls && opt_timestamp == TS_NONE &&
+        !opt_hex &&
+        u->capture_name == NULL && trig.nrules == 0 && !opt_render_fps &&
+        !opt_rx_thread && opt_scrollback == 0 &&
+        (opt_send_file == NULL || opt_send_pace != SEND_PACE_PROMPT)) {
+        uterm_splice_setup(u);
+    }
+#endif
+
+    /* Line is read by io_uring, if possible, see uterm_rx_uring_start() */
+    if (!opt_rx_thread && !u->splice && !(opt_vtime != 0 && opt_vmin > 1) &&
+        ev_can_read(u->loop)) {
+        ring_init(&u->rx_ring, opt_ring_size);
+        atomic_init(&u->rx_time_head, 0);
+        atomic_init(&u->rx_time_tail, 0);
+        u->rx_uring = true;
+        uterm_rx_uring_start(u);
+    }
+
+    if (opt_send_file != NULL) {
+        uterm_send_start(u);
+    }
+
+    if (u->capture_name != NULL) {
+        ctc_open(&u->cap, u->capture_name, opt_tee_policy, u->speed);
+        u->capturing = true;
+    }
+
+    if (fd_tee >= 0 && !u->splice) {
+        aw_start(&u->tee, fd_tee, u->tee_name, opt_tee_buffer, opt_tee_policy);
+    }
+
+    uterm_pipe_setup(u);
+    uterm_rx_lock();
+    uterm_update(u);
+}
+
+/*
+ * Close capture file and stop tee writer
+ */
+static void
+uterm_stop (uterm_state *u)
+{
+    if (u->capturing) {
+        ctc_close(&u->cap);
+    }
+
+    if (u->fd_tee >= 0) {
+        aw_stop(&u->tee);
+
+        if (u->tee_dropped != 0) {
+            fprintf(stderr, "%s: %s: %llu bytes dropped\n",
+                program_name, u->tee_name, u->tee_dropped);
+        }
+    }
+}
+
+/*
+ * Stop uterm_ctx. Called at exit
+ */
+static void
+uterm_stop_ctx (void)
+{
+    uterm_stop(&uterm_ctx);
+}
+
+/*
+ * microterm - main loop
+ */
+static void
+uterm (int fd_con_in, int fd_con_out, int fd_tty, int fd_tee)
+{
+    static ev_loop      loop;
+    uterm_state         *u = &uterm_ctx;
+
+    u->line = opt_tty_line;
+    u->tee_name = opt_tee_file;
+    u->capture_name = opt_capture_file;
+
+    ev_init(&loop);
+    u->con_data = opt_batch;
+    uterm_setup(u, &loop, fd_con_in, fd_con_out, fd_tty, fd_tee);
+
+    ev_add(&loop, &u->src_signal, sig_init(), EV_READ,
+        uterm_signal_callback, u);
+
+    if (opt_stats_socket != NULL) {
+        ev_add(&loop, &u->src_stats, uterm_stats_open(), EV_READ,
+            uterm_stats_callback, u);
+    }
+
+    atexit(uterm_stop_ctx);
+    mem_seal();
+
+    while( 1 ) {
+        ev_run(&loop, -1);
+    }
+}
+
+/***** Multi-port mode *****/
+/*
+ * In the multi-port mode (-m option) each port runs the usual
+ * uterm data path (see uterm_setup()), but instead of the console
+ * it is connected to a pair of pipes. Ports are spread across a
+ * small pool of worker threads, each running its own event loop
+ *
+ * The main thread multiplexes console between ports: output of
+ * the active port goes to the console, output of other ports is
+ * read and discarded (so they never stall and their tee/capture
+ * files keep growing), console input goes to the active port
+ *
+ * Each port callback moves at most a ring buffer worth of data
+ * per wakeup, so a busy port can't starve others on the same worker
+ *
+ * Console commands start with the switch char (-e, ctrl-T by default):
+ *   1..9, 0    - switch to port 1..10
+ *   a..z       - switch to port 11..36
+ *   n, p       - switch to the next/previous port
+ *   l          - list ports
+ *   switch char again sends it to the port
+ *
+ * On exit, the multiplexer closes input pipes of ports, after the
+ * typed data is passed. Each port drains its buffers, as in the
+ * single-port mode, and closes its output pipe (see mport_done()).
+ * Process exits, when all ports are done and their output is on
+ * console, or after SHUTDOWN_DRAIN_NS
+ *
+ * In batch mode (--batch) console input is data for the active port,
+ * with no commands and no exit char. Console EOF closes input pipes
+ * the same way, and each port waits for its replies as usual (see
+ * uterm_batch_callback()); process exits when all ports are done
+ */
+typedef struct {
+    pthread_t           thread;         /* Worker thread */
+    ev_loop             loop;           /* Its event loop */
+    int                 wake[2];        /* Wake up pipe */
+    ev_source           src_wake;       /* Wake up pipe source */
+    atomic_bool         stop;           /* Worker must exit */
+    atomic_bool         snap;           /* Statistics snapshot requested */
+} mport_worker;
+
+typedef struct {
+    uterm_state         u;              /* Port state */
+    ev_loop             *loop;          /* Worker loop */
+    int                 in[2];          /* console->port pipe */
+    int                 out[2];         /* port->console pipe */
+    ev_source           src_in;         /* console->port, write end */
+    ev_source           src_out;        /* port->console, read end */
+    stats_entry         snap[STATS_MAX_ENTRIES]; /* Statistics snapshot */
+    int                 snap_cnt;       /* Entries in snap */
+    atomic_int          exit_code;      /* Set by mport_done() */
+    bool                eof;            /* Output pipe is closed */
+} mport;
+
+static struct {
+    mport               *ports;         /* Ports */
+    int                 nports;         /* Count of ports */
+    int                 active;         /* Active port */
+    mport_worker        *workers;       /* Worker threads */
+    int                 nworkers;       /* Count of workers */
+    ev_loop             loop;           /* Main thread loop */
+    ev_source           src_con_in;     /* Console input */
+    ev_source           src_con_out;    /* Console output */
+    ev_source           src_signal;     /* Signals self-pipe */
+    ring                con_in;         /* console->active port */
+    ring                con_out;        /* any port->console */
+    bool                cmd;            /* Switch char received */
+    pthread_mutex_t     snap_lock;      /* Protects snap_pending */
+    pthread_cond_t      snap_cond;      /* Signaled when snapshot is done */
+    int                 snap_pending;   /* Workers yet to take snapshot */
+    bool                exiting;        /* Orderly shutdown, see mux_exit() */
+    bool                con_eof;        /* Batch mode console EOF */
+    int                 exit_code;      /* Exit code */
+    ev_timer            exit_timer;     /* Drain time limit */
+} mux;
+
+/*
+ * Make per-port file name: name.line, where line is the basename
+ * of the port device
+ */
+static char*
+mport_file_name (const char *name, const char *line)
+{
+    const char  *base = strrchr(line, '/');
+    char        *s;
+
+    base = base ? base + 1 : line;
+    s = mem_alloc(strlen(name) + strlen(base) + 2);
+    sprintf(s, "%s.%s", name, base);
+
+    return s;
+}
+
+/*
+ * Add message to the console output
+ */
+static void
+mux_message (const char *fmt, ...)
+{
+    char        buf[256];
+    va_list     ap;
+    int         len, i;
+
+    va_start(ap, fmt);
+    len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+
+    if (len > (int) sizeof(buf) - 1) {
+        len = sizeof(buf) - 1;
+    }
+
+    for (i = 0; i < len; ) {
+        unsigned char   *data;
+        size_t          n = ring_write_ptr(&mux.con_out, &data);
+
+        if (n == 0) {
+            break; /* Console is stuck; message is lost */
+        }
+
+        n = n < (size_t) (len - i) ? n : (size_t) (len - i);
+        memcpy(data, buf + i, n);
+        ring_produce(&mux.con_out, n);
+        i += n;
+    }
+}
+
+/*
+ * Make port active
+ */
+static void
+mux_switch (int n)
+{
+    if (n < 0 || n >= mux.nports) {
+        mux_message("\r\n[%s: no port %d]\r\n", program_name, n + 1);
+        return;
+    }
+
+    /* Pending input belongs to the old port */
+    ring_consume(&mux.con_in, ring_count(&mux.con_in));
+
+    mux.active = n;
+    mux_message("\r\n[%s: port %d: %s]\r\n", program_name, n + 1,
+        mux.ports[n].u.line);
+}
+
+/*
+ * Execute console command
+ */
+static void
+mux_command (int c)
+{
+    int     i;
+
+    if ('1' <= c && c <= '9') {
+        mux_switch(c - '1');
+    } else if (c == '0') {
+        mux_switch(9);
+    } else if ('a' <= c && c <= 'z' && c != 'l' && c != 'n' && c != 'p') {
+        mux_switch(c - 'a' + 10);
+    } else if (c == 'n') {
+        mux_switch((mux.active + 1) % mux.nports);
+    } else if (c == 'p') {
+        mux_switch((mux.active + mux.nports - 1) % mux.nports);
+    } else if (c == 'l') {
+        for (i = 0; i < mux.nports; i ++) {
+            mux_message("\r\n[%s: %c port %d: %s]", program_name,
+                i == mux.active ? '*' : ' ', i + 1, mux.ports[i].u.line);
+        }
+        mux_message("\r\n");
+    }
+}
+
+/*
+ * Port is done after uterm_exit() (called by its worker). Output
+ * pipe is closed, so the multiplexer gets EOF after the last data
+ */
+static void
+mport_done (void *data)
+{
+    uterm_state *u = data;
+    int         i;
+
+    for (i = 0; &mux.ports[i].u != u; i ++)
+        ;
+
+    atomic_store(&mux.ports[i].exit_code, u->exit_code);
+    ev_del(u->loop, &u->src_con_out);
+    close(mux.ports[i].out[1]);
+}
+
+/*
+ * Exit timer callback: ports were not drained in time
+ */
+static void
+mux_exit_callback (ev_timer *timer)
+{
+    (void) timer;
+
+    exit(mux.exit_code);
+}
+
+/*
+ * Start orderly shutdown of all ports (exit char, port exit,
+ * SIGTERM and friends). Console is not read anymore; input pipes
+ * of ports are closed by mux_update()
+ */
+static void
+mux_exit (int code)
+{
+    if (mux.exiting) {
+        return;
+    }
+
+    mux.exiting = true;
+    mux.exit_code = code;
+    ev_timer_start(&mux.loop, &mux.exit_timer, now_ns() + SHUTDOWN_DRAIN_NS,
+        mux_exit_callback, NULL);
+}
+
+/*
+ * Recompute interest of all multiplexer sources
+ */
+static void
+mux_update (void)
+{
+    bool    closing = mux.exiting || mux.con_eof;
+    int     i, done = 0;
+
+    ev_want(&mux.loop, &mux.src_con_in,
+        ring_space(&mux.con_in) != 0 && !closing ? EV_READ : 0);
+    ev_want(&mux.loop, &mux.src_con_out,
+        ring_count(&mux.con_out) != 0 ? EV_WRITE : 0);
+
+    for (i = 0; i < mux.nports; i ++) {
+        mport   *p = &mux.ports[i];
+        bool    active = i == mux.active;
+
+        /* On exit, port input ends after the typed data */
+        if (closing && p->in[1] >= 0 &&
+            (!active || ring_count(&mux.con_in) == 0)) {
+            ev_del(&mux.loop, &p->src_in);
+            close(p->in[1]);
+            p->in[1] = -1;
+        }
+
+        if (p->in[1] >= 0) {
+            ev_want(&mux.loop, &p->src_in,
+                active && ring_count(&mux.con_in) != 0 ? EV_WRITE : 0);
+        }
+
+        ev_want(&mux.loop, &p->src_out,
+            !p->eof && (!active || ring_space(&mux.con_out) != 0) ?
+            EV_READ : 0);
+
+        done += p->eof;
+    }
+
+    if (closing && done == mux.nports &&
+        ring_count(&mux.con_out) == 0) {
+        exit(mux.exit_code);
+    }
+}
+
+/*
+ * Console input callback
+ */
+static void
+mux_con_in_callback (ev_source *src, unsigned int events)
+{
+    unsigned char       buf[4096];
+    size_t              space;
+    ssize_t             rc, i;
+
+    (void) events;
+
+    while (!mux.exiting && !mux.con_eof &&
+           (space = ring_space(&mux.con_in)) != 0) {
+        rc = read(src->fd, buf, space < sizeof(buf) ? space : sizeof(buf));
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN) {
+                ev_clear(src, EV_READ);
+                break;
+            }
+
+            panic_perror( "read(console)" );
+        } else if (!rc) {
+            ev_clear(src, EV_READ);
+            mux.con_eof = opt_batch;
+            break;
+        }
+
+        for (i = 0; i < rc; i ++) {
+            unsigned char   *data;
+            int             c = buf[i];
+
+            if (opt_batch) {
+                ring_write_ptr(&mux.con_in, &data);
+                *data = c;
+                ring_produce(&mux.con_in, 1);
+                continue;
+            }
+
+            /* What was typed before the exit char still goes out */
+            if (c == opt_esc_char) {
+                mux_exit(0);
+                break;
+            }
+
+            if (mux.cmd) {
+                mux.cmd = false;
+                if (c != opt_switch_char) {
+                    mux_command(c);
+                    continue;
+                }
+            } else if (c == opt_switch_char) {
+                mux.cmd = true;
+                continue;
+            }
+
+            ring_write_ptr(&mux.con_in, &data);
+            *data = c;
+            ring_produce(&mux.con_in, 1);
+        }
+    }
+
+    mux_update();
+}
+
+/*
+ * Console output callback
+ */
+static void
+mux_con_out_callback (ev_source *src, unsigned int events)
+{
+    unsigned char       *data;
+    size_t              avail;
+
+    (void) events;
+
+    while ((avail = ring_read_ptr(&mux.con_out, &data)) != 0) {
+        ssize_t rc = write(src->fd, data, avail);
+
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN) {
+                ev_clear(src, EV_WRITE);
+                break;
+            }
+
+            panic_perror( "write(console)" );
+        }
+
+        ring_consume(&mux.con_out, rc);
+    }
+
+    mux_update();
+}
+
+/*
+ * console->port pipe callback
+ */
+static void
+mux_port_in_callback (ev_source *src, unsigned int events)
+{
+    unsigned char       *data;
+    size_t              avail;
+
+    (void) events;
+
+    while ((avail = ring_read_ptr(&mux.con_in, &data)) != 0) {
+        ssize_t rc = write(src->fd, data, avail);
+
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN) {
+                ev_clear(src, EV_WRITE);
+                break;
+            }
+
+            panic_perror( "write(port)" );
+        }
+
+        ring_consume(&mux.con_in, rc);
+    }
+
+    mux_update();
+}
+
+/*
+ * port->console pipe callback
+ */
+static void
+mux_port_out_callback (ev_source *src, unsigned int events)
+{
+    mport               *p = src->data;
+    bool                active = p == &mux.ports[mux.active];
+    unsigned char       discard[4096], *data;
+    size_t              space;
+
+    (void) events;
+
+    for (;;) {
+        ssize_t rc;
+
+        if (active) {
+            space = ring_write_ptr(&mux.con_out, &data);
+            if (space == 0) {
+                break;
+            }
+        } else {
+            data = discard;
+            space = sizeof(discard);
+        }
+
+        rc = read(src->fd, data, space);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN) {
+                ev_clear(src, EV_READ);
+                break;
+            }
+
+            panic_perror( "read(port)" );
+        } else if (!rc) {
+            int code = atomic_load(&p->exit_code);
+
+            /* Port is done, see mport_done() */
+            ev_clear(src, EV_READ);
+            p->eof = true;
+            if (mux.con_eof && !mux.exiting) {
+                /* Batch: others still wait for replies, first error wins */
+                mux.exit_code = mux.exit_code != 0 ? mux.exit_code : code;
+            } else {
+                mux_exit(code);
+            }
+            break;
+        }
+
+        if (active) {
+            ring_produce(&mux.con_out, rc);
+        }
+    }
+
+    mux_update();
+}
+
+/*
+ * Take statistics snapshot of all ports. Port state is owned by
+ * its worker, so each worker takes snapshot of its ports, and the
+ * main thread waits for all of them
+ */
+static void
+mux_snapshot (void)
+{
+    int     i;
+
+    pthread_mutex_lock(&mux.snap_lock);
+    mux.snap_pending = mux.nworkers;
+    pthread_mutex_unlock(&mux.snap_lock);
+
+    for (i = 0; i < mux.nworkers; i ++) {
+        atomic_store(&mux.workers[i].snap, true);
+        write(mux.workers[i].wake[1], "", 1);
+    }
+
+    pthread_mutex_lock(&mux.snap_lock);
+    while (mux.snap_pending != 0) {
+        pthread_cond_wait(&mux.snap_cond, &mux.snap_lock);
+    }
+    pthread_mutex_unlock(&mux.snap_lock);
+}
+
+/*
+ * Signals callback: statistics of all ports
+ */
+static void
+mux_signal_callback (ev_source *src, unsigned int events)
+{
+    unsigned char   sigs[64];
+    ssize_t         rc, i;
+    int             n;
+
+    (void) events;
+
+    while ((rc = read(src->fd, sigs, sizeof(sigs))) > 0) {
+        for (i = 0; i < rc; i ++) {
+            if (sigs[i] != SIGUSR1) {
+                mux_exit(128 + sigs[i]);
+                continue;
+            }
+
+            mux_snapshot();
+            for (n = 0; n < mux.nports; n ++) {
+                fprintf(stderr, "%s: port %d: %s\n", program_name, n + 1,
+                    mux.ports[n].u.line);
+                stats_print(mux.ports[n].snap, mux.ports[n].snap_cnt);
+            }
+        }
+    }
+
+    ev_clear(src, EV_READ);
+    mux_update();
+}
+
+/*
+ * Worker wake up pipe callback. Takes statistics snapshot of the
+ * worker's ports, if requested by mux_snapshot()
+ */
+static void
+mport_wake_callback (ev_source *src, unsigned int events)
+{
+    mport_worker    *w = src->data;
+    char            buf[64];
+    int             n;
+
+    (void) events;
+
+    while (read(src->fd, buf, sizeof(buf)) > 0)
+        ;
+
+    ev_clear(src, EV_READ);
+
+    if (atomic_exchange(&w->snap, false)) {
+        for (n = 0; n < mux.nports; n ++) {
+            mport   *p = &mux.ports[n];
+
+            if (p->loop == &w->loop) {
+                p->snap_cnt = uterm_stats(&p->u, p->snap);
+            }
+        }
+
+        pthread_mutex_lock(&mux.snap_lock);
+        mux.snap_pending --;
+        pthread_cond_signal(&mux.snap_cond);
+        pthread_mutex_unlock(&mux.snap_lock);
+    }
+}
+
+/*
+ * Worker thread
+ */
+static void*
+mport_worker_thread (void *arg)
+{
+    mport_worker        *w = arg;
+
+    while (!atomic_load(&w->stop)) {
+        ev_run(&w->loop, -1);
+    }
+
+    return NULL;
+}
+
+/*
+ * Stop workers and ports. Called at exit
+ */
+static void
+mport_stop (void)
+{
+    int     i;
+
+    for (i = 0; i < mux.nworkers; i ++) {
+        mport_worker    *w = &mux.workers[i];
+
+        atomic_store(&w->stop, true);
+        write(w->wake[1], "", 1);
+
+        if (!pthread_equal(w->thread, pthread_self())) {
+            pthread_join(w->thread, NULL);
+        }
+    }
+
+    for (i = 0; i < mux.nports; i ++) {
+        uterm_stop(&mux.ports[i].u);
+    }
+}
+
+/*
+ * Report statistics of all ports. Called at exit
+ */
+static void
+mport_report (void)
+{
+    int     i;
+
+    for (i = 0; i < mux.nports; i ++) {
+        fprintf(stderr, "%s: port %d: %s\n", program_name, i + 1,
+            mux.ports[i].u.line);
+        uterm_stats_print(&mux.ports[i].u);
+    }
+}
+
+/*
+ * Multi-port mode main loop
+ */
+static void
+mport_run (int fd_con_in, int fd_con_out)
+{
+    int     i, rc;
+    long    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    fd_nonblock(fd_con_in);
+    fd_nonblock(fd_con_out);
+
+    ring_init(&mux.con_in, opt_ring_size);
+    ring_init(&mux.con_out, opt_ring_size);
+    ev_init(&mux.loop);
+    pthread_mutex_init(&mux.snap_lock, NULL);
+    pthread_cond_init(&mux.snap_cond, NULL);
+
+    /* Create workers */
+    mux.nworkers = opt_threads;
+    if (mux.nworkers == 0) {
+        mux.nworkers = ncpu > 0 ? (int) ncpu : 1;
+        mux.nworkers = mux.nworkers < 8 ? mux.nworkers : 8;
+    }
+    mux.nworkers = mux.nworkers < opt_nports ? mux.nworkers : opt_nports;
+
+    mux.workers = mem_alloc(mux.nworkers * sizeof(mport_worker));
+    for (i = 0; i < mux.nworkers; i ++) {
+        mport_worker    *w = &mux.workers[i];
+
+        ev_init(&w->loop);
+        fd_pipe(w->wake);
+        ev_add(&w->loop, &w->src_wake, w->wake[0], EV_READ,
+            mport_wake_callback, w);
+    }
+
+    /* Open ports and spread them across workers */
+    mux.ports = mem_alloc(opt_nports * sizeof(mport));
+    for (i = 0; i < opt_nports; i ++) {
+        mport       *p = &mux.ports[i];
+        uterm_state *u = &p->u;
+        int         fd_tty, fd_tee = -1;
+        unsigned long speed;
+
+        u->line = opt_ports[i];
+        if (opt_tee_file != NULL) {
+            u->tee_name = mport_file_name(opt_tee_file, u->line);
+            fd_tee = open_tee(u->tee_name);
+        }
+        if (opt_capture_file != NULL) {
+            u->capture_name = mport_file_name(opt_capture_file, u->line);
+        }
+
+        fd_pipe(p->in);
+        fd_pipe(p->out);
+        p->loop = &mux.workers[i % mux.nworkers].loop;
+
+        /* Exit and switch chars are handled by the multiplexer */
+        u->con_data = true;
+        u->done = mport_done;
+        fd_tty = open_tty(u->line, &speed);
+        u->speed = speed;
+        uterm_setup(u, p->loop, p->in[0], p->out[1], fd_tty, fd_tee);
+
+        ev_add(&mux.loop, &p->src_in, p->in[1], EV_WRITE,
+            mux_port_in_callback, p);
+        ev_add(&mux.loop, &p->src_out, p->out[0], EV_READ,
+            mux_port_out_callback, p);
+    }
+
+    mux.nports = opt_nports;
+    atexit(mport_stop);
+
+    /* Start workers */
+    for (i = 0; i < mux.nworkers; i ++) {
+        rc = pthread_create(&mux.workers[i].thread, NULL,
+            mport_worker_thread, &mux.workers[i]);
+        if (rc != 0) {
+            errno = rc;
+            panic_perror("pthread_create()");
+        }
+    }
+
+    /* Run console multiplexer */
+    ev_add(&mux.loop, &mux.src_con_in, fd_con_in, EV_READ,
+        mux_con_in_callback, NULL);
+    ev_add(&mux.loop, &mux.src_con_out, fd_con_out, EV_WRITE,
+        mux_con_out_callback, NULL);
+    ev_add(&mux.loop, &mux.src_signal, sig_init(), EV_READ,
+        mux_signal_callback, NULL);
+
+    mux_switch(0);
+    mux_update();
+    mem_seal();
+
+    while( 1 ) {
+        ev_run(&mux.loop, -1);
+    }
+}
+
+/***** Network bridge *****/
+/*
+ * In the network bridge mode (--listen option) the usual uterm
+ * data path is connected to a pair of pipes, as in the multi-port
+ * mode. The bridge reads data, received from the line, once and
+ * fans it out to all clients: TCP connections and local console,
+ * if it is a terminal. Input of all clients is merged
+ *
+ * Each client has own output ring. Pipe from the line is always
+ * drained; if data doesn't fit into the client's ring, it is
+ * dropped and counted for this client only, so one slow client
+ * never holds up the line or other clients
+ *
+ * With --rfc2217, clients speak telnet, and the COM-PORT-OPTION
+ * (RFC 2217) allows them to change the line speed. Data format
+ * is always 8N1, and flow control is set by --flow, as in the rest
+ * of catterm, so other settings are answered with the actual values
+ */
+#define NET_MAX_CLIENTS         16
+#define NET_CHUNK               16384
+
+#define TELNET_SE               240
+#define TELNET_SB               250
+#define TELNET_WILL             251
+#define TELNET_WONT             252
+#define TELNET_DO               253
+#define TELNET_DONT             254
+#define TELNET_IAC              255
+
+#define TELOPT_BINARY           0
+#define TELOPT_ECHO             1
+#define TELOPT_SGA              3
+#define TELOPT_COMPORT          44
+
+#define COMPORT_SET_BAUDRATE    1
+#define COMPORT_SET_DATASIZE    2
+#define COMPORT_SET_PARITY      3
+#define COMPORT_SET_STOPSIZE    4
+#define COMPORT_SET_CONTROL     5
+#define COMPORT_PURGE_DATA      12
+#define COMPORT_SERVER          100     /* Added to server replies */
+
+/*
+ * Telnet parser states
+ */
+typedef enum {
+    TN_DATA,            /* Data */
+    TN_CR,              /* Data, after CR */
+    TN_IAC,             /* After IAC */
+    TN_OPT,             /* After IAC WILL/WONT/DO/DONT */
+    TN_SB,              /* Subnegotiation data */
+    TN_SB_IAC           /* IAC in the subnegotiation */
+} tn_state;
+
+/*
+ * Bridge client
+ */
+typedef struct {
+    ev_source           src;            /* Socket, or console input */
+    ev_source           src_out;        /* Console output */
+    ev_source           *src_write;     /* Source to write to */
+    bool                console;        /* This is local console */
+    char                name[64];       /* Peer address, for messages */
+    ring                out;            /* Pending output */
+    unsigned long long  dropped;        /* Output bytes dropped */
+
+    /* Telnet protocol (--rfc2217) */
+    tn_state            tn;             /* Parser state */
+    int                 tn_cmd;         /* WILL/WONT/DO/DONT */
+    unsigned char       sb[16];         /* Subnegotiation data */
+    size_t              sb_len;         /* Bytes in sb */
+    uint64_t            opts_us;        /* Options we WILL */
+    uint64_t            opts_him;       /* Options client WILL */
+} net_client;
+
+static struct {
+    ev_loop             loop;           /* Event loop */
+    int                 in[2];          /* clients->uterm pipe */
+    int                 out[2];         /* uterm->clients pipe */
+    ev_source           src_in;         /* clients->uterm, write end */
+    ev_source           src_out;        /* uterm->clients, read end */
+    ev_source           src_listen;     /* Listening socket */
+    ring                con_in;         /* Merged clients input */
+    net_client          *clients[NET_MAX_CLIENTS + 1]; /* Clients */
+    int                 nclients;       /* Count of clients */
+    net_client          *pool[NET_MAX_CLIENTS + 1]; /* Free clients */
+    int                 npool;          /* Count of free clients */
+    int                 fd_tty;         /* The line */
+    bool                exiting;        /* Orderly shutdown, see net_exit() */
+    int                 exit_code;      /* Exit code */
+    ev_timer            exit_timer;     /* Drain time limit */
+    bool                out_eof;        /* uterm is done, see net_done() */
+} net;
+
+/*
+ * Exit timer callback: clients were not drained in time
+ */
+static void
+net_exit_callback (ev_timer *timer)
+{
+    (void) timer;
+
+    exit(net.exit_code);
+}
+
+/*
+ * Start orderly shutdown (exit char on console, uterm exit). Clients
+ * are not read anymore; merged input is passed to uterm, then its
+ * input pipe is closed, so it drains and exits (see net_done())
+ */
+static void
+net_exit (int code)
+{
+    if (net.exiting) {
+        return;
+    }
+
+    net.exiting = true;
+    net.exit_code = code;
+    ev_timer_start(&net.loop, &net.exit_timer, now_ns() + SHUTDOWN_DRAIN_NS,
+        net_exit_callback, NULL);
+}
+
+/*
+ * uterm is done after uterm_exit(). Its output pipe is closed, so
+ * the bridge gets EOF after the last data
+ */
+static void
+net_done (void *data)
+{
+    uterm_state *u = data;
+
+    net_exit(u->exit_code);
+    ev_del(&net.loop, &u->src_con_out);
+    close(net.out[1]);
+}
+
+/*
+ * Recompute interest of the bridge sources
+ */
+static void
+net_update (void)
+{
+    bool    space = ring_space(&net.con_in) != 0 && !net.exiting;
+    int     i, pending = 0;
+
+    /* On exit, uterm input ends after the typed data */
+    if (net.exiting && net.in[1] >= 0 && ring_count(&net.con_in) == 0) {
+        ev_del(&net.loop, &net.src_in);
+        close(net.in[1]);
+        net.in[1] = -1;
+    }
+
+    if (net.in[1] >= 0) {
+        ev_want(&net.loop, &net.src_in,
+            ring_count(&net.con_in) != 0 ? EV_WRITE : 0);
+    }
+
+    ev_want(&net.loop, &net.src_out, net.out_eof ? 0 : EV_READ);
+
+    for (i = 0; i < net.nclients; i ++) {
+        net_client      *c = net.clients[i];
+        unsigned int    rd = space ? EV_READ : 0;
+        unsigned int    wr = ring_count(&c->out) != 0 ? EV_WRITE : 0;
+
+        if (c->console) {
+            ev_want(&net.loop, &c->src, rd);
+            ev_want(&net.loop, &c->src_out, wr);
+        } else {
+            ev_want(&net.loop, &c->src, rd | wr);
+        }
+
+        pending += wr != 0;
+    }
+
+    if (net.out_eof && pending == 0) {
+        exit(net.exit_code);
+    }
+}
+
+/*
+ * Disconnect client
+ */
+static void
+net_client_close (net_client *c)
+{
+    int     i;
+
+    for (i = 0; net.clients[i] != c; i ++)
+        ;
+
+    net.clients[i] = net.clients[-- net.nclients];
+
+    fprintf(stderr, "%s: %s: disconnected", program_name, c->name);
+    if (c->dropped != 0) {
+        fprintf(stderr, ", %llu bytes dropped", c->dropped);
+    }
+    fprintf(stderr, "\n");
+
+    ev_del(&net.loop, &c->src);
+    close(c->src.fd);
+    net.pool[net.npool ++] = c;
+}
+
+/*
+ * Write pending client output. Returns false, if client
+ * was disconnected
+ */
+static bool
+net_client_flush (net_client *c)
+{
+    unsigned char       *data;
+    size_t              avail;
+
+    while ((avail = ring_read_ptr(&c->out, &data)) != 0) {
+        ssize_t rc;
+
+        if (c->console) {
+            rc = write(c->src_write->fd, data, avail);
+        } else {
+            rc = send(c->src_write->fd, data, avail, MSG_NOSIGNAL);
+        }
+
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN) {
+                ev_clear(c->src_write, EV_WRITE);
+                break;
+            }
+
+            if (c->console) {
+                panic_perror( "write(console)" );
+            }
+
+            net_client_close(c);
+            return false;
+        }
+
+        ring_consume(&c->out, rc);
+    }
+
+    return true;
+}
+
+/*
+ * Queue data to client. Data that doesn't fit is dropped
+ */
+static void
+net_client_queue (net_client *c, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+
+    if (ring_space(&c->out) < len) {
+        c->dropped += len;
+        return;
+    }
+
+    while (len != 0) {
+        unsigned char   *dst;
+        size_t          n = ring_write_ptr(&c->out, &dst);
+
+        n = n < len ? n : len;
+        memcpy(dst, p, n);
+        ring_produce(&c->out, n);
+        p += n;
+        len -= n;
+    }
+}
+
+/*
+ * Send telnet command
+ */
+static void
+net_telnet_cmd (net_client *c, int cmd, int opt)
+{
+    unsigned char   buf[3] = {TELNET_IAC, cmd, opt};
+    net_client_queue(c, buf, sizeof(buf));
+}
+
+/*
+ * Send RFC 2217 server reply with 1 or 4 bytes value
+ */
+static void
+net_comport_reply (net_client *c, int cmd, uint32_t value, size_t size)
+{
+    unsigned char   buf[32];
+    size_t          len = 0, i;
+
+    buf[len ++] = TELNET_IAC;
+    buf[len ++] = TELNET_SB;
+    buf[len ++] = TELOPT_COMPORT;
+    buf[len ++] = cmd + COMPORT_SERVER;
+
+    for (i = size; i > 0; i --) {
+        unsigned char   b = value >> (8 * (i - 1));
+
+        buf[len ++] = b;
+        if (b == TELNET_IAC) {
+            buf[len ++] = TELNET_IAC;
+        }
+    }
+
+    buf[len ++] = TELNET_IAC;
+    buf[len ++] = TELNET_SE;
+
+    net_client_queue(c, buf, len);
+}
+
+/*
+ * Handle RFC 2217 request
+ */
+static void
+net_comport (net_client *c)
+{
+    int         cmd, modem = 0;
+    uint32_t    value;
+
+    if (c->sb_len < 3 || c->sb[0] != TELOPT_COMPORT) {
+        return;
+    }
+
+    cmd = c->sb[1];
+    value = c->sb[2];
+
+    switch (cmd) {
+    case COMPORT_SET_BAUDRATE:
+        if (c->sb_len < 6) {
+            return;
+        }
+
+        value = ((uint32_t) c->sb[2] << 24) | ((uint32_t) c->sb[3] << 16) |
+                ((uint32_t) c->sb[4] << 8) | c->sb[5];
+
+        if (value != 0) {
+            unsigned long   effective = tty_set_speed(net.fd_tty, value);
+
+            if (effective == 0) {
+                fprintf(stderr, "%s: %s: can't set speed %lu: %s\n",
+                    program_name, c->name, (unsigned long) value,
+                    strerror(errno));
+            } else {
+                uterm_ctx.speed = effective;
+                fprintf(stderr, "%s: %s: speed set to %lu\n",
+                    program_name, c->name, effective);
+            }
+        }
+
+        net_comport_reply(c, cmd, uterm_ctx.speed, 4);
+        break;
+
+    case COMPORT_SET_DATASIZE:
+        net_comport_reply(c, cmd, 8, 1);
+        break;
+
+    case COMPORT_SET_PARITY:
+        net_comport_reply(c, cmd, 1, 1);        /* NONE */
+        break;
+
+    case COMPORT_SET_STOPSIZE:
+        net_comport_reply(c, cmd, 1, 1);        /* 1 stop bit */
+        break;
+
+    case COMPORT_SET_CONTROL:
+        /* Flow control, BREAK, DTR and RTS are not managed, so
+         * both requests and settings are answered with the actual
+         * state, as RFC 2217 requires */
+        ioctl(net.fd_tty, TIOCMGET, &modem);
+        if (value <= 3 || value == 17 || value == 19) {
+            /* Outbound flow control */
+            value = opt_flow == FLOW_RTSCTS ? 3 :
+                    opt_flow == FLOW_XONXOFF ? 2 : 1;
+        } else if (value <= 6) {
+            value = 6;                          /* BREAK off */
+        } else if (value <= 9) {
+            value = modem & TIOCM_DTR ? 8 : 9;
+        } else if (value <= 12) {
+            value = modem & TIOCM_RTS ? 11 : 12;
+        } else if (value <= 16 || value == 18) {
+            /* Inbound flow control */
+            value = opt_flow == FLOW_RTSCTS ? 16 :
+                    opt_flow == FLOW_XONXOFF ? 15 : 14;
+        } else {
+            return;
+        }
+        net_comport_reply(c, cmd, value, 1);
+        break;
+
+    case COMPORT_PURGE_DATA:
+        if (value == 1 || value == 3) {
+            tcflush(net.fd_tty, value == 1 ? TCIFLUSH : TCIOFLUSH);
+        } else if (value == 2) {
+            tcflush(net.fd_tty, TCOFLUSH);
+        }
+        net_comport_reply(c, cmd, value, 1);
+        break;
+
+    default:
+        /* Line/modem state notifications and masks: just ack */
+        net_comport_reply(c, cmd, value, 1);
+        break;
+    }
+}
+
+/*
+ * Handle telnet option negotiation
+ */
+static void
+net_telnet_opt (net_client *c, int cmd, int opt)
+{
+    uint64_t    bit = opt < 64 ? 1ULL << opt : 0;
+    bool        us = opt == TELOPT_BINARY || opt == TELOPT_ECHO ||
+                     opt == TELOPT_SGA;
+    bool        him = opt == TELOPT_BINARY || opt == TELOPT_SGA ||
+                      opt == TELOPT_COMPORT;
+
+    /* Requests that don't change the state are not answered */
+    switch (cmd) {
+    case TELNET_WILL:
+        if (!(c->opts_him & bit)) {
+            if (him) {
+                c->opts_him |= bit;
+            }
+            net_telnet_cmd(c, him ? TELNET_DO : TELNET_DONT, opt);
+        }
+        break;
+
+    case TELNET_WONT:
+        if (c->opts_him & bit) {
+            c->opts_him &= ~bit;
+            net_telnet_cmd(c, TELNET_DONT, opt);
+        }
+        break;
+
+    case TELNET_DO:
+        if (!(c->opts_us & bit)) {
+            if (us) {
+                c->opts_us |= bit;
+            }
+            net_telnet_cmd(c, us ? TELNET_WILL : TELNET_WONT, opt);
+        }
+        break;
+
+    case TELNET_DONT:
+        if (c->opts_us & bit) {
+            c->opts_us &= ~bit;
+            net_telnet_cmd(c, TELNET_WONT, opt);
+        }
+        break;
+    }
+}
+
+/*
+ * Strip telnet protocol from the client input, in place.
+ * Returns count of data bytes
+ */
+static size_t
+net_telnet_input (net_client *c, unsigned char *buf, size_t len)
+{
+    size_t      i, out = 0;
+
+    for (i = 0; i < len; i ++) {
+        unsigned char   b = buf[i];
+
+        switch (c->tn) {
+        case TN_CR:
+            c->tn = TN_DATA;
+            if (b == 0) {
+                break; /* CR NUL means CR */
+            }
+            /* Fall through */
+
+        case TN_DATA:
+            if (b == TELNET_IAC) {
+                c->tn = TN_IAC;
+            } else {
+                buf[out ++] = b;
+                if (b == '\r' && !(c->opts_him & (1ULL << TELOPT_BINARY))) {
+                    c->tn = TN_CR;
+                }
+            }
+            break;
+
+        case TN_IAC:
+            c->tn = TN_DATA;
+            if (b == TELNET_IAC) {
+                buf[out ++] = b;
+            } else if (b >= TELNET_WILL) {
+                c->tn_cmd = b;
+                c->tn = TN_OPT;
+            } else if (b == TELNET_SB) {
+                c->sb_len = 0;
+                c->tn = TN_SB;
+            }
+            break;
+
+        case TN_OPT:
+            net_telnet_opt(c, c->tn_cmd, b);
+            c->tn = TN_DATA;
+            break;
+
+        case TN_SB:
+            if (b == TELNET_IAC) {
+                c->tn = TN_SB_IAC;
+            } else if (c->sb_len < sizeof(c->sb)) {
+                c->sb[c->sb_len ++] = b;
+            }
+            break;
+
+        case TN_SB_IAC:
+            if (b == TELNET_SE) {
+                net_comport(c);
+                c->tn = TN_DATA;
+            } else {
+                if (c->sb_len < sizeof(c->sb)) {
+                    c->sb[c->sb_len ++] = b;
+                }
+                c->tn = TN_SB;
+            }
+            break;
+        }
+    }
+
+    return out;
+}
+
+/*
+ * Read client input. Returns false, if client was disconnected
+ */
+static bool
+net_client_read (net_client *c)
+{
+    unsigned char       buf[NET_CHUNK];
+    size_t              space, len, i;
+
+    while ((space = ring_space(&net.con_in)) != 0) {
+        ssize_t rc = read(c->src.fd, buf,
+            space < sizeof(buf) ? space : sizeof(buf));
+
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN) {
+                ev_clear(&c->src, EV_READ);
+                break;
+            }
+
+            if (c->console) {
+                panic_perror( "read(console)" );
+            }
+
+            net_client_close(c);
+            return false;
+        } else if (!rc) {
+            if (c->console) {
+                ev_clear(&c->src, EV_READ);
+                break;
+            }
+
+            net_client_close(c);
+            return false;
+        }
+
+        len = rc;
+        if (c->console) {
+            unsigned char   *esc = memchr(buf, opt_esc_char, len);
 
-    for (i = 0; i < size; i ++) {
-        if (buffer[i] < 0x20 ) {
-            switch (buffer[i]) {
-                case '\n':
-                case '\r':
-                case '\b':
-                    break;
-                default:
-                    buffer[i] = '?';
+            /* What was typed before the exit char still goes out */
+            if (esc != NULL) {
+                len = esc - buf;
+                net_exit(0);
             }
+        } else if (opt_rfc2217) {
+            len = net_telnet_input(c, buf, len);
+        }
+
+        for (i = 0; i < len; ) {
+            unsigned char   *data;
+            size_t          n = ring_write_ptr(&net.con_in, &data);
+
+            n = n < len - i ? n : len - i;
+            memcpy(data, buf + i, n);
+            ring_produce(&net.con_in, n);
+            i += n;
+        }
+
+        if (net.exiting) {
+            break;
         }
     }
 
-    return size;
+    return true;
 }
 
-/***** Main loop *****/
 /*
- * microterm - main loop
+ * Client callback
  */
 static void
-uterm (int fd_con_in, int fd_con_out, int fd_tty, int fd_tee)
+net_client_callback (ev_source *src, unsigned int events)
 {
-    unsigned char       con2tty_buffer[1024];
-    size_t              con2tty_count = 0;
-    size_t              con2tty_next = 0;
-    unsigned char       tty2con_buffer[1024];
-    size_t              tty2con_count = 0;
-    size_t              tty2con_next = 0;
-    int                 fd_max;
-    unsigned const char *nl_seq = NULL, *nl_end;
+    net_client  *c = src->data;
 
-    fd_max= fd_con_in;
-
-    if (fd_con_out > fd_max) {
-        fd_max = fd_con_out;
+    if ((events & EV_READ) && !net_client_read(c)) {
+        goto DONE;
     }
 
-    if (fd_tty > fd_max) {
-        fd_max = fd_tty;
+    if (events & EV_WRITE) {
+        net_client_flush(c);
     }
 
-    fd_max ++;
+DONE:
+    net_update();
+}
 
-    while( 1 )
-    {
-        fd_set          fds_in, fds_out;
-        int             rc;
+/*
+ * Add client. Clients, with their buffers, are preallocated
+ * by net_run(), so it doesn't allocate memory
+ */
+static net_client*
+net_client_add (int fd, const char *name, bool console)
+{
+    net_client          *c = net.pool[-- net.npool];
+    unsigned char       *data = c->out.data;
+    size_t              size = c->out.size;
 
-        FD_ZERO( &fds_in );
-        FD_ZERO( &fds_out );
+    memset(c, 0, sizeof(*c));
+    c->out.data = data;
+    c->out.size = size;
 
-        if (con2tty_next == con2tty_count) {
-            FD_SET(fd_con_in, &fds_in);
-        } else {
-            FD_SET(fd_tty, &fds_out);
-        }
+    c->console = console;
+    snprintf(c->name, sizeof(c->name), "%s", name);
 
-        if (tty2con_next == tty2con_count) {
-            FD_SET(fd_tty, &fds_in);
-        } else {
-            FD_SET(fd_con_out, &fds_out);
-        }
+    ev_add(&net.loop, &c->src, fd, console ? EV_READ : EV_READ | EV_WRITE,
+        net_client_callback, c);
+    c->src_write = &c->src;
 
-        rc = select(fd_max, &fds_in, &fds_out, NULL, NULL);
-        if (rc <= 0) {
-            continue;
-        }
+    net.clients[net.nclients ++] = c;
 
-        if (FD_ISSET(fd_tty, &fds_in)) {
-            rc = read(fd_tty, tty2con_buffer, sizeof(tty2con_buffer));
-            if (rc < 0) {
-                panic_perror( "read(tty)" );
-            } else if (!rc) {
-                panic( "read(tty): end of input" );
-            }
+    return c;
+}
+
+/*
+ * uterm->clients pipe callback: fan out data to all clients
+ */
+static void
+net_out_callback (ev_source *src, unsigned int events)
+{
+    static unsigned char        buf[NET_CHUNK], tn_buf[2 * NET_CHUNK];
+    int                         i;
+
+    (void) events;
 
-            if (fd_tee >= 0 && rc > 0) {
-                write(fd_tee, tty2con_buffer, rc);
+    for (;;) {
+        ssize_t rc = read(src->fd, buf, sizeof(buf));
+        size_t  tn_len = 0;
+
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
             }
 
-            tty2con_count = rc;
-            if (opt_supress_ctrls) {
-                tty2con_count = suppress_ctrls(tty2con_buffer,tty2con_count);
+            if (errno == EAGAIN) {
+                ev_clear(src, EV_READ);
+                break;
             }
-            tty2con_next = 0;
+
+            panic_perror( "read(pipe)" );
+        } else if (!rc) {
+            /* uterm is done, exit once clients have the rest */
+            ev_clear(src, EV_READ);
+            net.out_eof = true;
+            break;
         }
 
-        if (FD_ISSET(fd_con_in, &fds_in)) {
-            rc = read(fd_con_in, con2tty_buffer, sizeof(con2tty_buffer));
-            if (rc < 0) {
-                panic_perror( "read(console)" );
-            }
-            if (memchr(con2tty_buffer, opt_esc_char, rc)) {
-                exit(0);
-            }
+        /* Escape IAC for telnet clients, once */
+        if (opt_rfc2217) {
+            size_t  j;
 
-            con2tty_count = rc;
-            con2tty_next = 0;
+            for (j = 0; j < (size_t) rc; j ++) {
+                tn_buf[tn_len ++] = buf[j];
+                if (buf[j] == TELNET_IAC) {
+                    tn_buf[tn_len ++] = TELNET_IAC;
+                }
+            }
         }
 
-        if (FD_ISSET(fd_tty, &fds_out)) {
-            size_t              sz;
-            unsigned const char *out = con2tty_buffer + con2tty_next;;
+        for (i = 0; i < net.nclients; ) {
+            net_client  *c = net.clients[i];
 
-            if (nl_seq) {
-                out = nl_seq;
-                sz = (size_t) (nl_end - nl_seq);
-            } else if(opt_nl_sequence && out[0] == '\n') {
-                out = nl_seq = opt_nl_sequence;
-                nl_end = opt_nl_sequence + opt_nl_size;
-                sz = opt_nl_size;
+            if (opt_rfc2217 && !c->console) {
+                net_client_queue(c, tn_buf, tn_len);
             } else {
-                unsigned char   *s;
+                net_client_queue(c, buf, rc);
+            }
 
-                sz = con2tty_count - con2tty_next;
-                if (opt_nl_sequence && (s = memchr(out, '\n', sz)) != NULL) {
-                    sz = (size_t) (s - out);
-                }
+            /* On disconnect, last client took this place */
+            if (net_client_flush(c)) {
+                i ++;
             }
+        }
+    }
+
+    net_update();
+}
+
+/*
+ * clients->uterm pipe callback
+ */
+static void
+net_in_callback (ev_source *src, unsigned int events)
+{
+    unsigned char       *data;
+    size_t              avail;
+
+    (void) events;
+
+    while ((avail = ring_read_ptr(&net.con_in, &data)) != 0) {
+        ssize_t rc = write(src->fd, data, avail);
 
-            if (opt_send_delay) {
-                sz = 1;
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
             }
 
-            rc = write(fd_tty, out, sz);
-            if (rc < 0) {
-                panic_perror( "write(tty)" );
+            if (errno == EAGAIN) {
+                ev_clear(src, EV_WRITE);
+                break;
             }
 
-            if (nl_seq) {
-                nl_seq += rc;
-                if ( nl_seq == nl_end ) {
-                    nl_seq = NULL;
-                    con2tty_next ++;
-                }
-            } else {
-                con2tty_next += rc;
+            panic_perror( "write(pipe)" );
+        }
+
+        ring_consume(&net.con_in, rc);
+    }
+
+    net_update();
+}
+
+/*
+ * Listening socket callback: accept new clients
+ */
+static void
+net_listen_callback (ev_source *src, unsigned int events)
+{
+    (void) events;
+
+    for (;;) {
+        struct sockaddr_storage addr;
+        socklen_t               addrlen = sizeof(addr);
+        char                    host[NI_MAXHOST], port[NI_MAXSERV];
+        char                    name[64];
+        net_client              *c;
+        int                     fd, on = 1;
+
+        fd = accept(src->fd, (struct sockaddr*) &addr, &addrlen);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
             }
 
-            /*
-             * FIXME: delay should not block tty->con transfer
-             */
-            if (opt_send_delay) {
-                usleep(opt_send_delay);
+            if (errno == EAGAIN) {
+                ev_clear(src, EV_READ);
+                break;
             }
+
+            panic_perror("accept()");
         }
 
-        if (FD_ISSET(fd_con_out, &fds_out)) {
-            rc = write(
-                fd_con_out, tty2con_buffer + tty2con_next,
-                tty2con_count - tty2con_next
-            );
-            if (rc < 0) {
-                panic_perror( "write(console)" );
-            }
+        if (getnameinfo((struct sockaddr*) &addr, addrlen, host, sizeof(host),
+            port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+            strcpy(host, "?");
+            strcpy(port, "?");
+        }
+        snprintf(name, sizeof(name), "%s:%s", host, port);
+
+        fd_nonblock(fd);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+        if (net.nclients == NET_MAX_CLIENTS) {
+            fprintf(stderr, "%s: %s: too many clients\n", program_name, name);
+            close(fd);
+            continue;
+        }
+
+        if (!opt_listen_batch) {
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        }
+
+        c = net_client_add(fd, name, false);
+        fprintf(stderr, "%s: %s: connected\n", program_name, name);
+
+        if (opt_rfc2217) {
+            c->opts_us = (1ULL << TELOPT_BINARY) | (1ULL << TELOPT_ECHO) |
+                         (1ULL << TELOPT_SGA);
+            c->opts_him = (1ULL << TELOPT_BINARY) | (1ULL << TELOPT_SGA);
+            net_telnet_cmd(c, TELNET_WILL, TELOPT_BINARY);
+            net_telnet_cmd(c, TELNET_WILL, TELOPT_ECHO);
+            net_telnet_cmd(c, TELNET_WILL, TELOPT_SGA);
+            net_telnet_cmd(c, TELNET_DO, TELOPT_BINARY);
+            net_telnet_cmd(c, TELNET_DO, TELOPT_SGA);
+            net_telnet_cmd(c, TELNET_DO, TELOPT_COMPORT);
+            c->opts_him |= 1ULL << TELOPT_COMPORT;
+            net_client_flush(c);
+        }
+    }
 
-            tty2con_next += rc;
+    net_update();
+}
+
+/*
+ * Open listening socket (--listen [addr:]port)
+ */
+static int
+net_listen (void)
+{
+    struct addrinfo     hints, *res, *ai;
+    char                *spec = mem_strdup(opt_listen), *host, *port;
+    int                 fd = -1, rc, on = 1;
+
+    port = strrchr(spec, ':');
+    if (port != NULL) {
+        *port ++ = '\0';
+        host = spec;
+        if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+            host[strlen(host) - 1] = '\0';
+            host ++;
+        }
+    } else {
+        port = spec;
+        host = NULL;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    rc = getaddrinfo(host && *host ? host : NULL, port, &hints, &res);
+    if (rc != 0) {
+        panic("%s: %s", opt_listen, gai_strerror(rc));
+    }
+
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+            ai->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+            listen(fd, 8) == 0) {
+            break;
         }
+
+        close(fd);
+        fd = -1;
+    }
+
+    if (fd < 0) {
+        panic_perror("%s", opt_listen);
+    }
+
+    freeaddrinfo(res);
+    mem_free(spec);
+
+    fd_nonblock(fd);
+    fprintf(stderr, "%s: listening on %s\n", program_name, opt_listen);
+
+    return fd;
+}
+
+/*
+ * Network bridge main loop. fd_con_in is -1, if there is
+ * no local console
+ */
+static void
+net_run (int fd_con_in, int fd_con_out, int fd_tty, int fd_tee)
+{
+    uterm_state *u = &uterm_ctx;
+    int         i;
+
+    u->line = opt_tty_line;
+    u->tee_name = opt_tee_file;
+    u->capture_name = opt_capture_file;
+
+    ev_init(&net.loop);
+    ev_reserve(&net.loop, 2 * (NET_MAX_CLIENTS + 1) + 16);
+    ring_init(&net.con_in, opt_ring_size);
+    net.fd_tty = fd_tty;
+
+    for (i = 0; i < NET_MAX_CLIENTS + 1; i ++) {
+        net_client  *c = mem_alloc(sizeof(net_client));
+
+        ring_init(&c->out, opt_ring_size);
+        net.pool[net.npool ++] = c;
+    }
+
+    fd_pipe(net.in);
+    fd_pipe(net.out);
+
+    /* Merged client input; exit char is checked by net_client_read() */
+    u->con_data = true;
+    u->done = net_done;
+    uterm_setup(u, &net.loop, net.in[0], net.out[1], fd_tty, fd_tee);
+    atexit(uterm_stop_ctx);
+
+    ev_add(&net.loop, &u->src_signal, sig_init(), EV_READ,
+        uterm_signal_callback, u);
+
+    if (opt_stats_socket != NULL) {
+        ev_add(&net.loop, &u->src_stats, uterm_stats_open(), EV_READ,
+            uterm_stats_callback, u);
+    }
+
+    ev_add(&net.loop, &net.src_in, net.in[1], EV_WRITE,
+        net_in_callback, NULL);
+    ev_add(&net.loop, &net.src_out, net.out[0], EV_READ,
+        net_out_callback, NULL);
+    ev_add(&net.loop, &net.src_listen, net_listen(), EV_READ,
+        net_listen_callback, NULL);
+
+    if (fd_con_in >= 0) {
+        net_client  *c = net_client_add(fd_con_in, "console", true);
+
+        fd_nonblock(fd_con_in);
+        fd_nonblock(fd_con_out);
+        ev_add(&net.loop, &c->src_out, fd_con_out, EV_WRITE,
+            net_client_callback, c);
+        c->src_write = &c->src_out;
+    }
+
+    net_update();
+    mem_seal();
+
+    while( 1 ) {
+        ev_run(&net.loop, -1);
+    }
+}
+
+/***** Latency probe *****/
+/*
+ * Latency probe (--latency-probe) measures TX->RX round trip of
+ * the line, with a loopback plug or an echoing target
+ *
+ * Probes are single printable bytes, sent one at a time; byte value
+ * is the probe sequence number, so late echo of the previous probe
+ * is not taken for the current one. Printable, so echoing target
+ * doesn't take it for a control char
+ *
+ * Probes run through the usual uterm data path: they are put into
+ * con2tty, as typed on console, and echoes are matched by the last
+ * line stage (see uterm_stage_probe()), so the result includes the
+ * event engine, --rx-thread and the other line stages
+ *
+ * Even the ideal line echoes the probe one byte time after it was
+ * sent: the byte must be shifted out and, at the same time, in. The
+ * rest is the driver, USB polling (see --latency-timer) and target
+ */
+#define PROBE_TIMEOUT_NS        1000000000ULL
+#define PROBE_FIRST             0x21
+#define PROBE_COUNT             94
+#define PROBE_BUCKETS           32
+#define PROBE_BAR               40
+
+/*
+ * Compare latencies, for qsort()
+ */
+static int
+probe_cmp (const void *a, const void *b)
+{
+    uint64_t    x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Print latency histogram and percentiles
+ */
+static void
+probe_report (uterm_state *u)
+{
+    uint64_t            *lat = u->probe_lat;
+    double              byte_us = 1e7 / u->speed;
+    unsigned long long  hist[PROBE_BUCKETS] = {0}, top = 0;
+    int                 i, n = u->probe_echoed, lo = PROBE_BUCKETS, hi = 0;
+
+    if (n == 0) {
+        panic("%s: no echo received (is loopback connected?)", u->line);
+    }
+
+    for (i = 0; i < n; i ++) {
+        uint64_t    t = lat[i];
+        int         b;
+
+        /* Bucket b is [2^b, 2^(b+1)) us, bucket 0 also has below 1 us */
+        for (b = 0; b < PROBE_BUCKETS - 1 && (t / 1000) >> (b + 1); b ++)
+            ;
+
+        hist[b] ++;
+        lo = b < lo ? b : lo;
+        hi = b > hi ? b : hi;
+        top = hist[b] > top ? hist[b] : top;
+    }
+
+    printf("\n    latency, us          count\n");
+    for (i = lo; i <= hi; i ++) {
+        int     bar = (int) (hist[i] * PROBE_BAR / top);
+
+        printf("    %7llu - %7llu   |%-*.*s %llu\n",
+            i ? 1ULL << i : 0ULL, 1ULL << (i + 1),
+            PROBE_BAR, bar, "########################################",
+            hist[i]);
+    }
+
+    qsort(lat, n, sizeof(*lat), probe_cmp);
+
+#define PROBE_P(p)      (lat[(size_t) (n * (p)) < (size_t) n ? \
+                             (size_t) (n * (p)) : (size_t) n - 1] / 1e3)
+
+    printf("\nprobes %d, echoed %d, lost %d\n", u->probe_sent, n,
+        u->probe_sent - n);
+    printf("min %.1f us, p50 %.1f us, p99 %.1f us, p999 %.1f us, "
+        "max %.1f us\n", lat[0] / 1e3, PROBE_P(0.5), PROBE_P(0.99),
+        PROBE_P(0.999), lat[n - 1] / 1e3);
+    if (PROBE_P(0.5) < byte_us) {
+        printf("p50 is below the byte time: not a real line?\n");
+    } else {
+        printf("p50 is %.1f byte times; driver, polling and target "
+            "take %.1f us\n", PROBE_P(0.5) / byte_us, PROBE_P(0.5) - byte_us);
+    }
+
+#undef  PROBE_P
+
+    fflush(stdout);
+}
+
+/*
+ * Probe timer callback: the probe was echoed (see uterm_stage_probe())
+ * or timed out. Send the next one or, when all are done, report and
+ * exit
+ */
+static void
+probe_callback (ev_timer *timer)
+{
+    uterm_state *u = timer->data;
+
+    u->probe_time = 0;
+
+    if (u->probe_sent == opt_latency_probe) {
+        probe_report(u);
+        uterm_exit(u, 0);
+        uterm_update(u);
+        return;
+    }
+
+    /* Goes the same way as typed on console */
+    u->probe_seq = PROBE_FIRST + u->probe_sent ++ % PROBE_COUNT;
+    if (ring_space(&u->con2tty) != 0) {
+        uterm_ring_put(&u->con2tty, &u->probe_seq, 1);
+        u->probe_time = now_ns();
+    }
+
+    ev_timer_start(u->loop, timer, now_ns() + PROBE_TIMEOUT_NS,
+        probe_callback, u);
+    uterm_update(u);
+}
+
+/*
+ * Run the latency probe. Line is opened by the caller; console
+ * is not used
+ */
+static void
+latency_probe (int fd_tty)
+{
+    static ev_loop      loop;
+    uterm_state         *u = &uterm_ctx;
+    int                 fd_con_in = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    int                 fd_con_out = open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+    if (fd_con_in == -1 || fd_con_out == -1) {
+        panic_perror("/dev/null");
+    }
+
+    u->line = opt_tty_line;
+    u->probe_lat = mem_alloc(opt_latency_probe * sizeof(*u->probe_lat));
+
+    ev_init(&loop);
+    u->con_data = true;
+    uterm_setup(u, &loop, fd_con_in, fd_con_out, fd_tty, -1);
+
+    ev_add(&loop, &u->src_signal, sig_init(), EV_READ,
+        uterm_signal_callback, u);
+
+    printf("%s: %s: %lu bps, byte time %.1f us, %d probes\n",
+        program_name, u->line, u->speed, 1e7 / u->speed, opt_latency_probe);
+
+    u->probe_timer.data = u;
+    probe_callback(&u->probe_timer);
+    mem_seal();
+
+    while( 1 ) {
+        ev_run(&loop, -1);
     }
 }
 
 /***** The main function *****/
+/*
+ * Compute the arena size (see mem_arena_init()) from the options.
+ * It follows allocations of uterm_setup() and its helpers, and of
+ * mport_run() and net_run(); small things go into the slack.
+ * Heap use of libraries, which can't be given mem_alloc(), is
+ * planned separately as lib_heap
+ */
+static size_t
+mem_plan (void)
+{
+    size_t      ports = opt_nports != 0 ? opt_nports : 1;
+    size_t      port = 2 * opt_ring_size + TX_CHUNK;
+    size_t      total = MEM_PLAN_SLACK + STATS_BUF_SIZE;
+
+    if (opt_render_fps || opt_scrollback != 0) {
+        port += RENDER_CHUNK;
+    }
+
+    if (opt_timestamp != TS_NONE) {
+        port += TS_CHUNK + TS_CHUNK * (TS_MAX_LEN + 1);
+    }
+
+    if (opt_hex) {
+        port += TS_CHUNK + HEXD_MAX_LEN(TS_CHUNK);
+    }
+
+#ifdef  HAVE_IO_URING
+    port += opt_ring_size;      /* Line may be read by io_uring */
+#else
+    if (opt_rx_thread) {
+        port += opt_ring_size;
+    }
+#endif
+
+    if (opt_scrollback != 0) {
+        size_t  lines = opt_scrollback / SB_LINE_AVG;
+
+        lines = lines > SB_LINES_MIN ? lines : SB_LINES_MIN;
+        port += opt_scrollback + lines * sizeof(uint64_t) +
+            SB_BLOCK + SB_QUERY_MAX + SB_UI_SIZE;
+    }
+
+    if (opt_send_file != NULL) {
+        port += SEND_CHUNK + strlen(opt_send_prompt) * sizeof(size_t);
+    }
+
+    if (opt_tee_file != NULL) {
+        port += opt_tee_buffer + sizeof(tee_segments);
+        if (opt_tee_compress != SEG_COMPRESS_NONE) {
+            port += SEG_COMPRESS_BLOCK + seg_out_size(opt_tee_compress) +
+                seg_state_size(opt_tee_compress);
+            mem_arena.lib_heap = ports * seg_lib_heap(opt_tee_compress);
+        }
+    }
+
+    if (opt_capture_file != NULL) {
+        port += CTC_BLOCK + opt_tee_buffer;
+    }
+
+    if (opt_nports != 0) {
+        size_t  workers = opt_threads != 0 ? opt_threads : MAX_THREADS;
+
+        workers = workers < ports ? workers : ports;
+        total += 2 * opt_ring_size + workers * sizeof(mport_worker);
+        port += sizeof(mport) + 2 * PATH_MAX;
+    }
+
+    if (opt_latency_probe != 0) {
+        total += opt_latency_probe * sizeof(uint64_t);
+    }
+
+    if (opt_listen != NULL) {
+        total += opt_ring_size +
+            (NET_MAX_CLIENTS + 1) * (sizeof(net_client) + opt_ring_size);
+    }
+
+    return total + ports * port;
+}
+
 /*
  * Main function
  */
 int
 main (int argc, char *argv[])
 {
-    int fd_tty, fd_tee = -1;
+    int             fd_tty, fd_tee = -1;
+    unsigned long   speed;
 
-    parse_esc_char(DEFAULT_ESC_CHAR);
+    parse_ctrl_char(DEFAULT_ESC_CHAR, &opt_esc_char, "exit");
+    parse_ctrl_char(DEFAULT_SWITCH_CHAR, &opt_switch_char, "switch");
+    parse_ctrl_char(DEFAULT_SEARCH_CHAR, &opt_search_char, "search");
     parse_argv(argc, argv);
+    hexd_init();
+
+    /* Not in usage: for make check */
+    if (opt_self_test) {
+        int     failed = suppress_ctrls_selftest();
+
+        failed += trig_selftest();
+        return failed == 0 ? 0 : 1;
+    }
+
+    if (opt_replay_file != NULL) {
+        ctc_replay(opt_replay_file);
+        return 0;
+    }
+
+    /* Pipelines and CI jobs have no terminal to set up */
+    if (opt_listen == NULL && opt_latency_probe == 0 && !isatty(0)) {
+        opt_batch = true;
+    }
+
+    suppress_ctrls_init();
+    trig_init();
+    mem_arena_init(mem_plan(), opt_hugepages);
+    stats_buf = mem_alloc(STATS_BUF_SIZE);
+
+    if (opt_latency_probe != 0) {
+        atexit(tty_tune_restore);
+        fd_tty = open_tty(opt_tty_line, &speed);
+        uterm_ctx.speed = speed;
+        latency_probe(fd_tty);
+    }
+
+    if (opt_nports != 0) {
+        atexit(mport_report);
+        atexit(tty_tune_restore);
+        console_setup();
+        mport_run(0, 1);
+    }
+
+    fd_tee = open_tee(opt_tee_file);
+    atexit(uterm_report);
+    atexit(tty_tune_restore);
+
+    if (opt_listen != NULL && !isatty(0)) {
+        /* Bridge without local console */
+        fd_tty = open_tty(opt_tty_line, &speed);
+        uterm_ctx.speed = speed;
+        net_run(-1, -1, fd_tty, fd_tee);
+    }
 
-    fd_tee = open_tee();
     console_setup();
-    fd_tty = open_tty();
+    fd_tty = open_tty(opt_tty_line, &speed);
+    uterm_ctx.speed = speed;
+
+    if (opt_listen != NULL) {
+        net_run(0, 1, fd_tty, fd_tee);
+    }
 
     uterm(0, 1, fd_tty, fd_tee);
 